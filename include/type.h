@@ -1,6 +1,8 @@
 #ifndef TYPE_H
 #define TYPE_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 /*** Type Tag ***/
@@ -10,9 +12,13 @@ extern const char TYPE_TAG_STILL_ATTACHED[];    /* Data: C String */
 extern const char TYPE_TAG_ALREADY_ATTACHED[];  /* Data: C String */
 extern const char TYPE_TAG_NOT_ATTACHED[];      /* Data: C String */
 extern const char TYPE_TAG_IS_STATIC[];         /* Data: C String */
+extern const char TYPE_TAG_IS_IMMORTAL[];       /* Data: C String */
 extern const char TYPE_TAG_STILL_ACQUIRED[];    /* Data: C String */
 extern const char TYPE_TAG_NOT_ACQUIRED[];      /* Data: C String */
 extern const char TYPE_TAG_MISMATCH[];          /* Data: C String */
+extern const char TYPE_TAG_IMMUTABLE[];         /* Data: C String */
+extern const char TYPE_TAG_NOT_SHAPE[];         /* Data: C String */
+extern const char TYPE_TAG_CYCLE[];             /* Data: C String */
 
 /* Opaque type tag structure. */
 struct type_tag;
@@ -22,8 +28,12 @@ struct type_tag_impl {
     struct type_tag *tag;
     const char *type;
     void *impl;
+    unsigned int flags;                 /* Set by acquire (or 0). */
 };
 
+/* Flags for struct type_tag_impl. */
+#define TYPE_TAG_IMPL_IMMORTAL 0x1      /* Acquired an immortal type. */
+
 /* Type Tag Interface */
 struct type_tag_i;
 struct type_tag_static_i;
@@ -98,12 +108,20 @@ type_tag_init(
         struct type_tag *tag,
         const struct type_tag_static_i *hooks);
 
-/* Finalize the type tag.
+/* Finalize the type tag (detaching the immortal types, if any, or all the
+ * types if the type tag is frozen).
  *
  * Throws:
  *
  * TYPE_TAG_STILL_ATTACHED
- *  If any implementations are still attached.
+ *  If any implementations (other than immortal ones) are still attached to a
+ *  type tag that isn't frozen.
+ *
+ * TYPE_TAG_STILL_ATTACHED
+ *  If the type tag is the parent of another type tag.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is a shape.
  */
 void
 type_tag_fini(
@@ -115,12 +133,60 @@ type_tag_fini(
  *
  * TYPE_TAG_ALREADY_ATTACHED
  *  If an implementation for the given type is already attached.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is immutable.
  */
 void
 type_tag_attach(
         struct type_tag_impl *tti,
         void (*impl_detach)(void *impl));
 
+/* Returns a newly created implementation for a lazily attached type. */
+typedef void *(*type_tag_factory_f)(void *ctx);
+
+/* Attach a type implementation that is created on first use.
+ *
+ * The factory is called with ctx by the first acquisition of the type (from
+ * the tag, its clones or its children) and the result is kept for later ones.
+ * The tti->impl is ignored. The impl_detach callback is only called if the
+ * implementation was created. Until then type_tag_for_each(...) reports a NULL
+ * implementation.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_ALREADY_ATTACHED
+ *  If an implementation for the given type is already attached.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is immutable.
+ */
+void
+type_tag_attach_lazy(
+        struct type_tag_impl *tti,
+        type_tag_factory_f factory,
+        void *ctx,
+        void (*impl_detach)(void *impl));
+
+/* Attach a type implementation that lives as long as the type tag (e.g. a
+ * static table of functions). Acquisitions of immortal types aren't counted,
+ * so acquiring is cheaper and releasing does nothing (without even looking up
+ * the type, if given the tti->flags set by the acquire). Immortal types can't
+ * be detached; they are detached by type_tag_fini(...) (and are still attached
+ * to clones).
+ *
+ * Throws:
+ *
+ * TYPE_TAG_ALREADY_ATTACHED
+ *  If an implementation for the given type is already attached.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is immutable.
+ */
+void
+type_tag_attach_immortal(
+        struct type_tag_impl *tti);
+
 /* Detach the given type and implementation.
  *
  * Throws:
@@ -128,33 +194,36 @@ type_tag_attach(
  * TYPE_TAG_NOT_ATTACHED
  *  If an implementation for the given type is NOT attached.
  *
+ * TYPE_TAG_IS_IMMORTAL
+ *  If the implementation is immortal.
+ *
  * TYPE_TAG_STILL_ACQUIRED
  *  If the existing implementation has outstanding acquisitions.
  *
  * TYPE_TAG_MISMATCH
  *  If an implementation is provided and does NOT match the currently
  *  attached implementation.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is immutable.
  */
 void
 type_tag_detach(
         struct type_tag_impl *tti);
 
-/* Detach all the attached types and implementations.
+/* Detach all the dynamically attached types and implementations. Acquisitions
+ * are checked first, so either all the types are detached or none are.
  *
  * Throws:
  *
- * TYPE_TAG_IS_STATIC
- *  If an implementation for the given type is statically attached.
- *
- * TYPE_TAG_NOT_ATTACHED
- *  If an implementation for the given type is NOT attached.
- *
  * TYPE_TAG_STILL_ACQUIRED
- *  If the existing implementation has outstanding acquisitions.
+ *  If any implementation has outstanding acquisitions.
  *
- * TYPE_TAG_MISMATCH
- *  If an implementation is provided and does NOT match the currently
- *  attached implementation.
+ * TYPE_TAG_IS_IMMORTAL
+ *  If any implementation is immortal.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is immutable.
  */
 void
 type_tag_detach_all(
@@ -171,7 +240,9 @@ size_t
 type_tag_attachments(
         struct type_tag *tag);
 
-/* Returns 1 if the type has an implementation attached, otherwise returns 0. */
+/* Returns 1 if the type has an implementation attached (to the type tag or
+ * one of its parents), otherwise returns 0.
+ */
 unsigned int
 type_tag_has_a(
         struct type_tag *tag,
@@ -180,7 +251,9 @@ type_tag_has_a(
 /* Acquire the type implementation.
  *
  * Requires that the tti->tag and tti->type be set. It will overwrite the
- * tti->impl with the acquired implementation.
+ * tti->impl with the acquired implementation (and tti->flags). If the type isn't attached to
+ * the type tag, then its parents are searched (and the acquisition is counted
+ * by the parent the type is attached to).
  *
  * Throws:
  *
@@ -192,9 +265,19 @@ void
 type_tag_acquire(
         struct type_tag_impl *tti);
 
+/* Acquire the type implementation (see type_tag_acquire(...)) from the call
+ * site given (recorded while profiling, see type_profile_enable()).
+ */
+void
+type_tag_acquire_at(
+        struct type_tag_impl *tti,
+        const char *file,
+        unsigned int line);
+
 /* Release a previously acquired type implementation.
  *
- * Requires that at least the tti->tag and tti->type are set.
+ * Requires that at least the tti->tag and tti->type are set. The tti->flags
+ * must be 0 or as set by the acquire.
  *
  * Throws:
  *
@@ -239,6 +322,204 @@ type_tag_for_each(
             void *self,
             struct type_tag_impl *tti));
 
+/* A dynamically attached type and its implementation. */
+struct type_tag_entry {
+    const char *type;
+    void *impl;                 /* NULL for lazy types not yet created. */
+    size_t acquisitions;
+};
+
+/* Cursor over the dynamically attached types of a type tag (in the order of
+ * their type pointers). The cursor only remembers the current type, so it can
+ * be kept across calls and continues after the current type even if the tag
+ * was changed in between.
+ */
+struct type_tag_cursor {
+    struct type_tag *tag;
+    struct type_tag_entry entry;    /* Current entry. */
+};
+
+/* Moves the cursor to the first type attached to the tag. Returns 1 if there
+ * is one (set in cursor->entry), otherwise returns 0.
+ */
+unsigned int
+type_tag_cursor_first(
+        struct type_tag_cursor *cursor,
+        struct type_tag *tag);
+
+/* Moves the cursor to the next type. Returns 1 if there is one (set in
+ * cursor->entry), otherwise returns 0.
+ */
+unsigned int
+type_tag_cursor_next(
+        struct type_tag_cursor *cursor);
+
+/* Copies up to size of the dynamically attached types (in the same order as
+ * the cursor) into entries. Returns the number of dynamically attached types,
+ * so if the result is larger than size, then the snapshot was truncated.
+ */
+size_t
+type_tag_snapshot(
+        struct type_tag *tag,
+        struct type_tag_entry *entries,
+        size_t size);
+
+/* Event counts (see type_stats_enable(...)). */
+struct type_stats {
+    size_t attaches;        /* Types attached. */
+    size_t detaches;        /* Types detached. */
+    size_t acquires;        /* Implementations (or data) acquired. */
+    size_t releases;        /* Implementations (or data) released. */
+    size_t hits;            /* Types found by type_tag_has_a(...). */
+    size_t misses;          /* Types NOT found by has_a(...) or acquire(...). */
+    size_t statics;         /* Acquisitions from the static hooks. */
+    size_t dynamics;        /* Acquisitions from dynamic types. */
+    size_t exceptions;      /* Exceptions thrown (of any kind). */
+    size_t bloom_probes;    /* Types checked with a filter. */
+    size_t bloom_negatives; /* Types rejected by a filter. */
+    size_t bloom_false_positives; /* Types let through, but NOT attached. */
+};
+
+/* Copies the type tag's event counts into stats. Acquisitions and releases are
+ * counted by the tag the type was found on (i.e. possibly a parent). The
+ * exceptions, data acquisitions (see type_acquire(...)) and events on frozen
+ * type tags aren't counted per tag.
+ */
+void
+type_tag_stats(
+        struct type_tag *tag,
+        struct type_stats *stats);
+
+/* Reset the type tag's event counts to zero. */
+void
+type_tag_stats_reset(
+        struct type_tag *tag);
+
+/* Statistics for the filter that type_tag_has_a(...) and acquire check before
+ * looking for a type on the tag itself. The filter never rejects attached
+ * types, but may let through ones that aren't attached. Static types are only
+ * in the filter if the tag opted in (see type_tag_bloom_statics(...)),
+ * otherwise they're always checked with the has_a hook. Like the other event
+ * counts, these are only counted while stats are enabled.
+ */
+struct type_bloom_stats {
+    size_t probes;          /* Types checked with the filter. */
+    size_t negatives;       /* Types rejected by the filter. */
+    size_t false_positives; /* Types let through, but NOT attached. */
+};
+
+/* Copies the type tag's filter statistics into stats. The false positive rate
+ * is false_positives / (negatives + false_positives).
+ */
+void
+type_tag_bloom_stats(
+        struct type_tag *tag,
+        struct type_bloom_stats *stats);
+
+/* Declares that the type tag's has_a hook only answers for the types its
+ * for_each hook lists (and that the list never changes). The listed types are
+ * then added to the filter, so the hooks are only asked about types that pass
+ * it.
+ *
+ * Throws:
+ *
+ * TYPE_INVALID_ARG
+ *  If the type tag doesn't have both a has_a and a for_each hook.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is immutable (e.g. frozen).
+ */
+void
+type_tag_bloom_statics(
+        struct type_tag *tag);
+
+/* Memory usage in bytes. */
+struct type_memory_usage {
+    size_t maps;        /* Map (Judy array) nodes. */
+    size_t records;     /* Internal per entry records. */
+    size_t tags;        /* Automatically created type tags and shapes. */
+    size_t shared;      /* Maps shared with clones (counted for each clone). */
+};
+
+/* Returns the number of bytes used by the type tag's internal structures. The
+ * type tag structure itself is not included. If usage is not NULL, then the
+ * breakdown is added to it.
+ */
+size_t
+type_tag_memory_usage(
+        struct type_tag *tag,
+        struct type_memory_usage *usage);
+
+/* Make dst a copy of the src's dynamic types and implementations. The copy
+ * is copy-on-write: src and dst share their entries until either attaches or
+ * detaches a type, which then only costs that entry. Acquisitions are
+ * independent between src and dst (and dst starts with none). Static hooks are
+ * not copied.
+ *
+ * Shared implementations are detached (impl_detach is called) once, when the
+ * last type tag sharing them detaches every type or is finalized.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_STILL_ATTACHED
+ *  If dst has dynamic types attached.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If dst is immutable.
+ */
+void
+type_tag_clone(
+        struct type_tag *src,
+        struct type_tag *dst);
+
+/* Freeze the type tag's dynamic types. The type tag becomes immutable and its
+ * types are copied into a compact array ordered for lookups. Like immortal
+ * types, frozen ones aren't counted when acquired, so acquire, release and
+ * has_a on them (directly or through children) don't write to the type tag
+ * and are safe from any thread. Events on it are only counted per thread (its
+ * own counts stay as they were when frozen). Type tags in several threads may
+ * also have it as their parent, but it doesn't keep track of them, so they
+ * must drop it before it's finalized. Lookups of other types (i.e. static
+ * types or those of the parents) are as before. Freezing can't be undone; the
+ * types are detached by type_tag_fini(...).
+ *
+ * Throws:
+ *
+ * TYPE_TAG_STILL_ACQUIRED
+ *  If any implementation has outstanding acquisitions.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is already immutable (e.g. a shape).
+ */
+void
+type_tag_freeze(
+        struct type_tag *tag);
+
+/* Set the parent (or NULL for none) searched for types the type tag doesn't
+ * have attached. Acquire, release, acquisitions and has_a search the parents;
+ * the other operations (e.g. detach, attachments and for_each) only apply to
+ * the type tag itself. Resolutions through parents are cached per thread
+ * (nothing is written to the type tag or the parents passed through), so in the
+ * steady state they cost a couple of lookups regardless of depth.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_CYCLE
+ *  If the type tag is the parent or an ancestor of the parent.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is immutable (e.g. a shape or frozen).
+ */
+void
+type_tag_set_parent(
+        struct type_tag *tag,
+        struct type_tag *parent);
+
+/* Returns the parent of the type tag (or NULL). */
+struct type_tag *
+type_tag_parent(
+        struct type_tag *tag);
+
 /* The type tag interface provided by this library. */
 extern struct type_tag_i TYPE_TAG_I;
 
@@ -254,12 +535,288 @@ extern struct type_tag_i TYPE_TAG_I;
              type_tag_with_impl_.tag = tag_, \
              type_tag_with_impl_.type = type_, \
              type_tag_with_impl_.impl = NULL, \
-             type_tag_acquire(&type_tag_with_impl_), \
+             type_tag_acquire_at(&type_tag_with_impl_, __FILE__, __LINE__), \
              impl_ = type_tag_with_impl_.impl, \
              1); \
          type_tag_with_once_ = (void *)1) \
         ec_with (type_tag_with_impl_p_, (ec_unwind_f)type_tag_release) \
 
+/* Like type_tag_with(...), but the implementation is released by a cleanup
+ * attribute when the scope exits (including by break, goto or return) instead
+ * of an unwind handler. This avoids the cost of setting up the handler, but an
+ * exception thrown out of the scope will NOT release the implementation: use
+ * type_tag_with(...) if the scope can throw.
+ */
+#define type_tag_scope(tag_, type_, impl_) \
+    for (struct type_tag_impl type_tag_scope_impl_ \
+             __attribute__((cleanup(type_tag_release))), \
+         *type_tag_scope_once_ = NULL; \
+         type_tag_scope_once_ == NULL && ( \
+             type_tag_scope_impl_.tag = tag_, \
+             type_tag_scope_impl_.type = type_, \
+             type_tag_scope_impl_.impl = NULL, \
+             type_tag_acquire_at(&type_tag_scope_impl_, __FILE__, __LINE__), \
+             impl_ = type_tag_scope_impl_.impl, \
+             1); \
+         type_tag_scope_once_ = (void *)1) \
+
+/*** Shape ***/
+
+/* Shapes are immutable type tags shared by all data with the same type
+ * implementations attached (e.g. via type_attach(...)). Shapes are canonical:
+ * the same contents always give the same shape, so shapes can be compared by
+ * identity. Shapes have no detach callbacks and live as long as the thread
+ * that created them.
+ */
+
+/* Returns the calling thread's empty shape. */
+struct type_tag *
+type_shape_empty();
+
+/* Returns 1 if the type tag is a shape, otherwise returns 0. */
+unsigned int
+type_tag_is_shape(
+        struct type_tag *tag);
+
+/* Returns the shape with the contents of tti->tag plus tti->type implemented
+ * by tti->impl.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_NOT_SHAPE
+ *  If tti->tag is not a shape.
+ *
+ * TYPE_TAG_ALREADY_ATTACHED
+ *  If an implementation for the given type is already attached.
+ *
+ * TYPE_TAG_MISMATCH
+ *  If tti->impl is NULL.
+ */
+struct type_tag *
+type_shape_attach(
+        struct type_tag_impl *tti);
+
+/* Returns the shape with the contents of tti->tag minus tti->type.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_NOT_SHAPE
+ *  If tti->tag is not a shape.
+ *
+ * TYPE_TAG_NOT_ATTACHED
+ *  If an implementation for the given type is NOT attached.
+ *
+ * TYPE_TAG_MISMATCH
+ *  If an implementation is provided and does NOT match the currently
+ *  attached implementation.
+ */
+struct type_tag *
+type_shape_detach(
+        struct type_tag_impl *tti);
+
+/*** Subtype ***/
+
+/* Exceptions */
+extern const char TYPE_SUBTYPE_CYCLE[];         /* Data: C String */
+
+/* Declares that sub is a subtype of super. The relation is transitive and
+ * global (shared by all threads). Declarations are serialized with a lock and
+ * invalidate every thread's memo of type_is_a(...), so they're best made
+ * before types are shared across threads.
+ *
+ * Throws:
+ *
+ * TYPE_SUBTYPE_CYCLE
+ *  If super is already a subtype of sub.
+ */
+void
+type_subtype(
+        const char *sub,
+        const char *super);
+
+/* Returns 1 if type is super or a (transitive) subtype of super, otherwise
+ * returns 0. Answers are memoized per thread until the next declaration.
+ */
+unsigned int
+type_is_a(
+        const char *type,
+        const char *super);
+
+/* Acquire the most specific implementation of the type.
+ *
+ * Like type_tag_acquire(...), but acquires the implementation of the most
+ * specific dynamic type attached to the tag (or its parents) that is a
+ * tti->type. The tti->type is overwritten with the acquired type, so the
+ * implementation can be released with type_tag_release(...). If several
+ * unrelated subtypes are attached, one of them is chosen. The choice is
+ * cached until the tag, its parents or the subtype relation change.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_NOT_ATTACHED
+ *  If no implementation of the type or its subtypes is attached.
+ */
+void
+type_tag_acquire_a(
+        struct type_tag_impl *tti);
+
+/*** Dispatch ***/
+
+/* Exceptions */
+extern const char TYPE_DISPATCH_ALREADY_REGISTERED[];   /* Data: C String */
+extern const char TYPE_DISPATCH_NOT_REGISTERED[];       /* Data: C String */
+extern const char TYPE_DISPATCH_NOT_FOUND[];            /* Data: C String */
+extern const char TYPE_DISPATCH_AMBIGUOUS[];            /* Data: C String */
+
+/* Opaque dispatch table structure.
+ *
+ * A dispatch table maps pairs of types to implementations (e.g. of binary
+ * operations like compare or convert) and picks one from the types attached to
+ * a pair of type tags. Lookups are cached per pair of tags and table until
+ * either tag, their parents, the subtype relation or the table change. The
+ * cache is per thread, shared by all tables and has a fixed size, so lookups
+ * may evict each other.
+ */
+struct type_dispatch;
+
+/* Size of the dispatch table struct. */
+size_t
+type_dispatch_size();
+
+/* Initialize the dispatch table. */
+void
+type_dispatch_init(
+        struct type_dispatch *dispatch);
+
+/* Finalize the dispatch table. Registered implementations are owned by the
+ * caller and not freed.
+ */
+void
+type_dispatch_fini(
+        struct type_dispatch *dispatch);
+
+/* Register the implementation for the pair of types.
+ *
+ * Throws:
+ *
+ * TYPE_DISPATCH_ALREADY_REGISTERED
+ *  If an implementation for the pair is already registered.
+ *
+ * TYPE_INVALID_ARG
+ *  If impl is NULL.
+ */
+void
+type_dispatch_register(
+        struct type_dispatch *dispatch,
+        const char *a,
+        const char *b,
+        void *impl);
+
+/* Unregister the implementation for the pair of types.
+ *
+ * Throws:
+ *
+ * TYPE_DISPATCH_NOT_REGISTERED
+ *  If an implementation for the pair is NOT registered.
+ */
+void
+type_dispatch_unregister(
+        struct type_dispatch *dispatch,
+        const char *a,
+        const char *b);
+
+/* Returns the implementation registered for the types attached to the tags.
+ * A registered type matches if it or one of its subtypes is attached. If
+ * several pairs match, then the pair whose types are subtypes (see
+ * type_is_a(...)) of every other pair's is chosen.
+ *
+ * Throws:
+ *
+ * TYPE_DISPATCH_NOT_FOUND
+ *  If no implementation is registered for the types attached to the tags.
+ *
+ * TYPE_DISPATCH_AMBIGUOUS
+ *  If several pairs match, but none is more specific than all the others.
+ */
+void *
+type_dispatch(
+        struct type_dispatch *dispatch,
+        struct type_tag *a,
+        struct type_tag *b);
+
+/*** Plugin ***/
+
+/* Exceptions */
+extern const char TYPE_PLUGIN_ALREADY_REGISTERED[]; /* Data: C String */
+extern const char TYPE_PLUGIN_NOT_REGISTERED[];     /* Data: C String */
+extern const char TYPE_PLUGIN_LOAD_FAILED[];        /* Data: C String */
+extern const char TYPE_PLUGIN_BAD_MANIFEST[];       /* Data: C String */
+
+/* Plugins are implementations exported (as symbols) by shared libraries. The
+ * plugin registry is shared by all threads and maps types to the library and
+ * symbol implementing them. Libraries are opened when an implementation is
+ * first acquired and closed once none of their implementations are attached.
+ */
+
+/* Returns the type for the name. Types registered with
+ * type_plugin_register(...) are returned as is, otherwise a copy of the name is
+ * made on first use.
+ */
+const char *
+type_plugin_intern(
+        const char *name);
+
+/* Register the symbol in the library as the implementation of the type.
+ *
+ * Throws:
+ *
+ * TYPE_PLUGIN_ALREADY_REGISTERED
+ *  If a plugin for the type is already registered or the type's name is
+ *  interned as a different type.
+ */
+void
+type_plugin_register(
+        const char *type,
+        const char *library,
+        const char *symbol);
+
+/* Register the plugins listed in the manifest. Each line of the manifest has
+ * the fields 'type library symbol' separated by whitespace. Blank lines and
+ * text following '#' are ignored. Type names are interned.
+ *
+ * Throws:
+ *
+ * TYPE_PLUGIN_BAD_MANIFEST
+ *  If the manifest can't be read or a line is malformed.
+ *
+ * TYPE_PLUGIN_ALREADY_REGISTERED
+ *  If a plugin for a type is already registered.
+ */
+void
+type_plugin_manifest(
+        const char *path);
+
+/* Attach the plugin registered for tti->type. The implementation is loaded on
+ * first acquire (see type_tag_attach_lazy(...)) and unloaded on detach.
+ *
+ * Throws:
+ *
+ * TYPE_PLUGIN_NOT_REGISTERED
+ *  If no plugin is registered for the type.
+ *
+ * TYPE_TAG_ALREADY_ATTACHED
+ *  If an implementation for the given type is already attached.
+ *
+ * TYPE_TAG_IMMUTABLE
+ *  If the type tag is immutable.
+ *
+ * Acquiring the type throws TYPE_PLUGIN_LOAD_FAILED if the library or symbol
+ * can't be loaded.
+ */
+void
+type_tag_attach_plugin(
+        struct type_tag_impl *tti);
+
 /*** Global ***/
 
 /* Exceptions */
@@ -339,6 +896,15 @@ void
 type_acquire(
         struct type_tagged *tagged);
 
+/* Acquires the type tag attached to the data (see type_acquire(...)) from the
+ * call site given (recorded while profiling, see type_profile_enable()).
+ */
+void
+type_acquire_at(
+        struct type_tagged *tagged,
+        const char *file,
+        unsigned int line);
+
 /* Releases the type tag attached to the data. Requires at least tagged->data
  * to be non-NULL.
  *
@@ -357,6 +923,30 @@ void
 type_release(
         struct type_tagged *tagged);
 
+/* Returns the number of bytes used by the calling thread's registry. This
+ * includes the map from data to type tag, the per data records, the
+ * automatically created type tags (along with their contents), the handles
+ * (see type_handle_attach(...)), the shapes and the reverse index (see
+ * type_index_enable()). Type tags provided to type_attach(...) are owned by
+ * the caller and not included. If usage is not NULL, then the breakdown is
+ * added to it.
+ */
+size_t
+type_registry_memory_usage(
+        struct type_memory_usage *usage);
+
+/* Calls action(...) for each data with a type tag attached (not handles, see
+ * type_handle_for_each(...)). Returns the same value as the last call to
+ * action(...). If action(...) returns non-zero, then it terminates immediately
+ * returning the value from the action(...) call.
+ */
+int
+type_for_each(
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_tagged *tagged));
+
 /* A utility macro for acquiring and releasing a tag.
  *
  * In the event that an exception is thrown, the tag will be released.
@@ -368,10 +958,718 @@ type_release(
          type_with_tag_once_ == NULL && ( \
              type_with_tagged_.data = data_, \
              type_with_tagged_.tag = NULL, \
-             type_acquire(&type_with_tagged_), \
+             type_acquire_at(&type_with_tagged_, __FILE__, __LINE__), \
              tag_ = type_with_tagged_.tag, \
              1); \
          type_with_tag_once_ = (void *)1) \
         ec_with (type_with_tagged_p_, (ec_unwind_f)type_release) \
 
+/* Like type_with(...), but the tag is released by a cleanup attribute when the
+ * scope exits (see type_tag_scope(...)). An exception thrown out of the scope
+ * will NOT release the tag: use type_with(...) if the scope can throw.
+ */
+#define type_scope(data_, tag_) \
+    for (struct type_tagged type_scope_tagged_ \
+             __attribute__((cleanup(type_release))), \
+         *type_scope_once_ = NULL; \
+         type_scope_once_ == NULL && ( \
+             type_scope_tagged_.data = data_, \
+             type_scope_tagged_.tag = NULL, \
+             type_acquire_at(&type_scope_tagged_, __FILE__, __LINE__), \
+             tag_ = type_scope_tagged_.tag, \
+             1); \
+         type_scope_once_ = (void *)1) \
+
+/*** Handle ***/
+
+/* The handle registry is a variant of the global registry keyed by integer
+ * handles (e.g. file descriptors or slot indices) rather than data pointers.
+ * Handles index a growable two-level array directly, so it suits small dense
+ * ranges of handles. Like the global registry, it is per thread and its memory
+ * is included in type_registry_memory_usage(...). Acquisitions are counted in
+ * the statistics and profiled like those of data, but kept apart from other
+ * keys (see struct type_profile_hold). Handles are only iterated over by
+ * type_handle_for_each(...): they aren't part of the reverse index (see
+ * type_index_enable()) or type_for_each(...).
+ */
+
+/* The largest handle that can have a type tag attached. */
+#define TYPE_HANDLE_MAX (((size_t)1 << 24) - 1)
+
+/* Handle type tagged structure. */
+struct type_handle_tagged {
+    size_t handle;
+    struct type_tag *tag;
+};
+
+/* Attach the type tag to the handle. If tagged->tag and tag_detach are NULL,
+ * then an empty type tag will be allocated automatically.
+ *
+ * Throws:
+ *
+ * TYPE_ALREADY_ATTACHED
+ *  If a type tag is already attached.
+ *
+ * TYPE_INVALID_ARG
+ *  If the handle is larger than TYPE_HANDLE_MAX or tagged->tag is NULL, but
+ *  tag_detach is NOT NULL.
+ */
+void
+type_handle_attach(
+        struct type_handle_tagged *tagged,
+        void (*tag_detach)(struct type_tag *tag));
+
+/* Detach the type tag from the handle.
+ *
+ * Throws:
+ *
+ * TYPE_NOT_ATTACHED
+ *  If a type tag is NOT attached.
+ *
+ * TYPE_STILL_ACQUIRED
+ *  If the type tag has outstanding acquisitions.
+ *
+ * TYPE_MISMATCH
+ *  If a type tag is provided and does not match the existing type tag.
+ */
+void
+type_handle_detach(
+        struct type_handle_tagged *tagged);
+
+/* Returns true(1) if the handle has an associated tag and false(0) otherwise. */
+unsigned int
+type_handle_has_a(
+        size_t handle);
+
+/* Returns the number of outstanding acquisitions for the handle's tag.
+ *
+ * Throws:
+ *
+ * TYPE_NOT_ATTACHED
+ *  If a type tag is NOT attached.
+ */
+size_t
+type_handle_acquisitions(
+        size_t handle);
+
+/* Acquires the type tag attached to the handle.
+ *
+ * Throws:
+ *
+ * TYPE_NOT_ATTACHED
+ *  If a type tag is NOT attached.
+ */
+void
+type_handle_acquire(
+        struct type_handle_tagged *tagged);
+
+/* Releases the type tag attached to the handle.
+ *
+ * Throws:
+ *
+ * TYPE_NOT_ATTACHED
+ *  If a type tag is NOT attached.
+ *
+ * TYPE_MISMATCH
+ *  If a type tag is provided and does not match the existing type tag.
+ *
+ * TYPE_NOT_ACQUIRED
+ *  If the type tag has NO acquisitions.
+ */
+void
+type_handle_release(
+        struct type_handle_tagged *tagged);
+
+/* Calls action(...) for each handle with a type tag attached (in increasing
+ * order). Returns the same value as the last call to action(...). If
+ * action(...) returns non-zero, then it terminates immediately returning the
+ * value from the action(...) call.
+ */
+int
+type_handle_for_each(
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_handle_tagged *tagged));
+
+/*** Index ***/
+
+/* The reverse index maps types to the type tags with them dynamically attached
+ * and to the data with those tags (see type_attach(...)). Like the registry,
+ * the index is per thread. It's off by default, since keeping it up to date
+ * adds to the cost of attaching and detaching.
+ *
+ * When enabled, the tags of the data in the registry are indexed. Other tags
+ * are indexed once they are changed or attached to data. Types attached to a
+ * tag's parents are not indexed for the tag.
+ *
+ * Handles (see type_handle_attach(...)) aren't indexed: their tags are only
+ * indexed once changed (like other tags) and handles are never returned.
+ */
+
+/* Enable the reverse index. */
+void
+type_index_enable();
+
+/* Disable the reverse index (freeing it). */
+void
+type_index_disable();
+
+/* Copies up to size of the indexed tags with the type attached into tags.
+ * Returns the number of such tags, so if the result is larger than size, then
+ * the result was truncated.
+ */
+size_t
+type_index_tags(
+        const char *type,
+        struct type_tag **tags,
+        size_t size);
+
+/* Copies up to size of the data whose tags have the type attached into data.
+ * Returns the number of such data, so if the result is larger than size, then
+ * the result was truncated. Handles aren't included.
+ */
+size_t
+type_index_data(
+        const char *type,
+        void **data,
+        size_t size);
+
+/*** Mask ***/
+
+/* Exceptions */
+extern const char TYPE_MASK_FULL[];         /* Data: C String */
+
+/* Number of types that can be used in masks. */
+#define TYPE_MASK_BITS 256
+
+/* A set of types. Types are given IDs (shared by all threads) on first use in
+ * a mask. Each type tag keeps a mask of its dynamic types, so checking for
+ * several types at once costs a few bitwise operations. Static types and types
+ * attached to parents are checked with type_tag_has_a(...).
+ */
+struct type_mask {
+    uint64_t bits[TYPE_MASK_BITS / 64];
+};
+
+/* Initialize the mask to the empty set. */
+void
+type_mask_init(
+        struct type_mask *mask);
+
+/* Add the type to the mask.
+ *
+ * Throws:
+ *
+ * TYPE_MASK_FULL
+ *  If the type doesn't have an ID and all TYPE_MASK_BITS are in use.
+ */
+void
+type_mask_add(
+        struct type_mask *mask,
+        const char *type);
+
+/* Returns 1 if all the types in the mask are attached, otherwise returns 0. */
+unsigned int
+type_tag_has_all(
+        struct type_tag *tag,
+        const struct type_mask *mask);
+
+/* Returns 1 if any of the types in the mask are attached, otherwise returns 0.
+ */
+unsigned int
+type_tag_has_any(
+        struct type_tag *tag,
+        const struct type_mask *mask);
+
+/* Copies the tags (of count) with all the types in the mask attached into
+ * matched (in order) and returns the number copied. The matched array must
+ * have room for count tags (and may be the same as tags).
+ */
+size_t
+type_tag_filter(
+        struct type_tag **tags,
+        size_t count,
+        const struct type_mask *mask,
+        struct type_tag **matched);
+
+/*** Parallel ***/
+
+/* Parallel versions of type_tag_for_each(...) and type_for_each(...) (so
+ * handles aren't iterated over either). The keys are split into chunks and
+ * each thread (the caller and threads - 1 others, or one per online CPU if
+ * threads is 0) takes an equal share of them, then steals chunks from the
+ * others' shares once its own are done. The action is called concurrently, so
+ * it must be thread safe, must not throw and must not change the tag or
+ * registry being iterated over.
+ *
+ * The other threads come from a pool started on first use (and grown to the
+ * largest number asked for) that's kept for later calls. Only one call uses
+ * the pool at a time, others (e.g. from an action) run on the calling thread
+ * alone. Actions run on pool threads see those threads' own per-thread state:
+ * their registry (see type_attach(...)), index, stats and profile are empty
+ * (or whatever earlier actions left there), not the calling thread's.
+ *
+ * If an action returns non-zero, then the threads stop early and the result is
+ * the value type_tag_for_each(...) (or type_for_each(...)) would return, i.e.
+ * that of the first key (in key order) an action returned non-zero for.
+ * Otherwise the result is 0. The order actions are called in is unspecified
+ * (except that the for_each hook is called first, by the calling thread).
+ */
+
+int
+type_tag_for_each_parallel(
+        struct type_tag *tag,
+        size_t threads,
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_tag_impl *tti));
+
+int
+type_for_each_parallel(
+        size_t threads,
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_tagged *tagged));
+
+/*** Stats ***/
+
+/* Enable (or disable, if enable is 0) counting events. Counts are kept per
+ * thread and merged when read. Type tags also keep their own counts (see
+ * type_tag_stats(...)), which are only written by the thread using the type
+ * tag (frozen ones aren't written at all). While disabled (the default),
+ * counting costs a single branch per event.
+ */
+void
+type_stats_enable(
+        unsigned int enable);
+
+/* Copies the event counts (summed over all threads) into stats. */
+void
+type_stats_get(
+        struct type_stats *stats);
+
+/* Returns the number of exceptions of the kind (e.g. TYPE_TAG_NOT_ATTACHED)
+ * thrown (summed over all threads).
+ */
+size_t
+type_stats_exceptions(
+        const char *id);
+
+/* Reset the event counts of all threads to zero. Counts from other threads may
+ * be lost or kept while they're running. Type tag counts aren't reset (see
+ * type_tag_stats_reset(...)).
+ */
+void
+type_stats_reset();
+
+/*** Profile ***/
+
+/* Profiling records how long acquisitions are held. Acquisitions are
+ * timestamped and on release the hold time is added to the type's histogram.
+ * Acquisitions of data (e.g. type_acquire(...)) and handles are recorded under
+ * the NULL type. Handles are recorded apart from type tags and data, so a
+ * handle never shares a hold with a pointer of the same value. Like the registry, the profile is per thread. It's off by
+ * default and costs a single branch per acquire and release while off.
+ */
+
+/* Hold times bucketed by powers of two: bucket 0 counts holds of 0 ns and
+ * bucket i holds of [2^(i-1), 2^i) ns. The last bucket also counts longer
+ * holds.
+ */
+#define TYPE_PROFILE_BUCKETS 40
+
+struct type_profile_histogram {
+    size_t count;                       /* Releases recorded. */
+    uint64_t total;                     /* Sum of the hold times (in ns). */
+    uint64_t max;                       /* Longest hold time (in ns). */
+    size_t buckets[TYPE_PROFILE_BUCKETS];
+};
+
+/* Kinds of acquisitions (see struct type_profile_hold). */
+#define TYPE_PROFILE_TAG 0              /* Of a type tag. */
+#define TYPE_PROFILE_DATA 1             /* Of data. */
+#define TYPE_PROFILE_HANDLE 2           /* Of a handle. */
+
+/* An outstanding acquisition. */
+struct type_profile_hold {
+    unsigned int kind;                  /* See TYPE_PROFILE_TAG, etc. */
+    const void *key;                    /* Type tag or data (NULL for handles). */
+    size_t handle;                      /* Handle acquired (or 0). */
+    const char *type;                   /* Type acquired (NULL for data). */
+    const char *file;                   /* Call site (NULL if unknown). */
+    unsigned int line;
+    uint64_t held;                      /* Time held so far (in ns). */
+};
+
+/* Enable profiling. Only acquisitions made while enabled are recorded; the
+ * call site is known for those made by type_tag_with(...) and type_with(...)
+ * (or the *_acquire_at(...) functions).
+ */
+void
+type_profile_enable();
+
+/* Disable profiling (freeing the histograms and outstanding acquisitions). */
+void
+type_profile_disable();
+
+/* Copies the type's hold time histogram into histogram. */
+void
+type_profile_histogram(
+        const char *type,
+        struct type_profile_histogram *histogram);
+
+/* Calls action(...) for each outstanding acquisition. Returns the same value as
+ * the last call to action(...). If action(...) returns non-zero, then it
+ * terminates immediately returning the value from the action(...) call.
+ */
+int
+type_profile_for_each(
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_profile_hold *hold));
+
+/* Writes the outstanding acquisitions (one per line) to the file. */
+void
+type_profile_dump(
+        FILE *file);
+
+/*** Optimistic ***/
+
+/* Optimistic reads look up a type tag's implementations from other threads
+ * without locks (acquisitions aren't counted). A reader takes the tag's
+ * sequence number, looks up and uses the implementation, then checks that the
+ * sequence number didn't change (i.e. that no type was attached or detached
+ * meanwhile) and retries otherwise.
+ *
+ * Only the type tag's own dynamic types are searched (not its parents or
+ * static types). Readers may use an implementation that is being detached, so
+ * the reads must be short and tolerate that (e.g. a detach callback must not
+ * unmap the implementation). Changes to the type tag still have to come from
+ * one thread at a time and finalizing requires that no readers remain.
+ */
+
+/* Enable optimistic reads of the type tag. The type tag keeps a copy of its
+ * types (materializing lazy implementations) that is replaced on every change.
+ * Readers don't write to the type tag: each thread only marks the copy it is
+ * searching during type_tag_optimistic_get(...). Replaced copies are freed by
+ * the first change made once no thread is searching them (or when the type tag
+ * is finalized).
+ */
+void
+type_tag_optimistic_enable(
+        struct type_tag *tag);
+
+/* Returns the sequence number to check with type_tag_optimistic_retry(...).
+ * Never waits: reads begun during a change see the types from before it (or
+ * after it) and are retried once the change ends. Requires that optimistic
+ * reads are enabled.
+ */
+size_t
+type_tag_optimistic_begin(
+        struct type_tag *tag);
+
+/* Returns the implementation of the type (or NULL if it isn't attached). */
+void *
+type_tag_optimistic_get(
+        struct type_tag *tag,
+        const char *type);
+
+/* Returns 1 if the type tag changed since type_tag_optimistic_begin(...)
+ * returned the sequence number (so the read must be retried), otherwise
+ * returns 0. Reads needn't be checked: skipping the check only skips noticing
+ * the change.
+ */
+unsigned int
+type_tag_optimistic_retry(
+        struct type_tag *tag,
+        size_t sequence);
+
+/* A utility macro for optimistic reads. The impl_ is NULL if the type isn't
+ * attached. The block is run again if the type tag changed while it ran, so it
+ * must not have side effects (other than on locals it resets). Leaving the
+ * block with break (or return, goto, etc.) is fine and skips the check.
+ */
+#define type_tag_optimistic(tag_, type_, impl_) \
+    for (size_t type_tag_optimistic_seq_ = 0, type_tag_optimistic_done_ = 0; \
+         !type_tag_optimistic_done_ && ( \
+             type_tag_optimistic_seq_ = type_tag_optimistic_begin(tag_), \
+             impl_ = type_tag_optimistic_get(tag_, type_), \
+             1); \
+         type_tag_optimistic_done_ = \
+             !type_tag_optimistic_retry(tag_, type_tag_optimistic_seq_)) \
+
+/*** Shared ***/
+
+/* Exceptions */
+extern const char TYPE_SHARED_MAP_FAILED[];     /* Data: C String */
+extern const char TYPE_SHARED_BAD_SEGMENT[];    /* Data: C String */
+extern const char TYPE_SHARED_FULL[];           /* Data: C String */
+extern const char TYPE_SHARED_NOT_PROVIDED[];   /* Data: C String */
+
+/* A shared registry keeps type tags in a memory segment that several processes
+ * map (e.g. workers forked from a server that filled it in, or processes given
+ * its descriptor). Types are identified by interned IDs rather than pointers
+ * and acquisitions are counted atomically in the segment, so every process
+ * sees the same counts.
+ *
+ * Implementations are attached by ID too (an interned name). Each process
+ * provides its own implementation for the ID (see type_shared_provide(...)),
+ * so implementations needn't be at the same address in every process. Forked
+ * processes inherit what was provided before the fork (for that mapping).
+ *
+ * Readers don't take locks. Changes are serialized by a process-shared lock and
+ * each is a single store, so a process that dies while changing the segment
+ * leaves it consistent. A tag uses one entry per type it ever had attached, so
+ * attaching and detaching again doesn't use up the segment.
+ *
+ * A shared tag can be used through the type tag API by binding a type tag to
+ * it (see type_shared_bind(...)).
+ */
+
+/* Opaque mapping of a shared segment. */
+struct type_shared;
+
+/* Opaque shared type tag (part of the segment). */
+struct type_shared_tag;
+
+/* A shared tag with its type ID and implementation. */
+struct type_shared_impl {
+    struct type_shared_tag *tag;
+    size_t type;                        /* See type_shared_intern(...). */
+    size_t id;                          /* See type_shared_provide(...). */
+    void *impl;                         /* This process's (set by acquire). */
+};
+
+/* Create a shared segment of the given size and map it. If the name is NULL
+ * the segment is anonymous (see type_shared_fd(...)), otherwise it is created
+ * with shm_open(...) and must not already exist.
+ *
+ * Throws:
+ *
+ * TYPE_SHARED_MAP_FAILED
+ *  If the segment can't be created or mapped.
+ */
+struct type_shared *
+type_shared_create(
+        const char *name,
+        size_t size);
+
+/* Map the named shared segment.
+ *
+ * Throws:
+ *
+ * TYPE_SHARED_MAP_FAILED
+ *  If the segment can't be opened or mapped.
+ *
+ * TYPE_SHARED_BAD_SEGMENT
+ *  If it isn't a shared segment (or is from an incompatible version).
+ */
+struct type_shared *
+type_shared_open(
+        const char *name);
+
+/* Map the shared segment in the file descriptor. The mapping owns the
+ * descriptor (even if this throws).
+ *
+ * Throws:
+ *
+ * TYPE_SHARED_MAP_FAILED
+ *  If the segment can't be mapped.
+ *
+ * TYPE_SHARED_BAD_SEGMENT
+ *  If it isn't a shared segment (or is from an incompatible version).
+ */
+struct type_shared *
+type_shared_map(
+        int fd);
+
+/* Returns the segment's file descriptor (e.g. to pass to another process). */
+int
+type_shared_fd(
+        struct type_shared *shared);
+
+/* Unmap the segment. Named segments remain until shm_unlink(...). */
+void
+type_shared_close(
+        struct type_shared *shared);
+
+/* Returns the ID of the type with the given name, interning it on first use.
+ * IDs are the same in every process mapping the segment.
+ *
+ * Throws:
+ *
+ * TYPE_SHARED_FULL
+ *  If the segment is full.
+ */
+size_t
+type_shared_intern(
+        struct type_shared *shared,
+        const char *name);
+
+/* Returns the name of the type ID. */
+const char *
+type_shared_name(
+        struct type_shared *shared,
+        size_t type);
+
+/* Provide this process's implementation for the ID of the given name
+ * (interning it on first use) and return the ID. Acquires in this process
+ * (through this mapping) of types attached with the ID return the
+ * implementation.
+ *
+ * Throws:
+ *
+ * TYPE_SHARED_FULL
+ *  If the segment is full.
+ */
+size_t
+type_shared_provide(
+        struct type_shared *shared,
+        const char *name,
+        void *impl);
+
+/* Returns the shared type tag with the given name, creating it on first use.
+ *
+ * Throws:
+ *
+ * TYPE_SHARED_FULL
+ *  If the segment is full.
+ */
+struct type_shared_tag *
+type_shared_tag(
+        struct type_shared *shared,
+        const char *name);
+
+/* Attach the implementation with the ID for the type.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_ALREADY_ATTACHED
+ *  If an implementation for the given type is already attached.
+ *
+ * TYPE_SHARED_FULL
+ *  If the segment is full.
+ */
+void
+type_shared_attach(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi);
+
+/* Detach the implementation for the type.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_NOT_ATTACHED
+ *  If the type isn't attached.
+ *
+ * TYPE_TAG_STILL_ACQUIRED
+ *  If the type is acquired (by any process).
+ */
+void
+type_shared_detach(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi);
+
+/* Returns 1 if the type is attached, otherwise returns 0. */
+unsigned int
+type_shared_has_a(
+        struct type_shared *shared,
+        struct type_shared_tag *tag,
+        size_t type);
+
+/* Acquire the implementation for the type (as provided in this process).
+ *
+ * Throws:
+ *
+ * TYPE_TAG_NOT_ATTACHED
+ *  If the type isn't attached.
+ *
+ * TYPE_SHARED_NOT_PROVIDED
+ *  If this process didn't provide the implementation's ID.
+ */
+void
+type_shared_acquire(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi);
+
+/* Release the implementation for the type.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_NOT_ATTACHED
+ *  If the type isn't attached.
+ *
+ * TYPE_TAG_NOT_ACQUIRED
+ *  If the type isn't acquired.
+ */
+void
+type_shared_release(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi);
+
+/* Returns the number of acquisitions of the type (by all processes).
+ *
+ * Throws:
+ *
+ * TYPE_TAG_NOT_ATTACHED
+ *  If the type isn't attached.
+ */
+size_t
+type_shared_acquisitions(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi);
+
+/* Attach the type tag's implementations (including its static types) to the
+ * shared type tag. Type names are interned and each implementation is provided
+ * by this process with the ID of "<shared tag name>/<type name>" (so other
+ * processes provide theirs with the same names).
+ *
+ * Throws:
+ *
+ * TYPE_TAG_ALREADY_ATTACHED
+ *  If an implementation for one of the types is already attached.
+ *
+ * TYPE_SHARED_FULL
+ *  If the segment is full.
+ */
+void
+type_shared_export(
+        struct type_shared *shared,
+        struct type_shared_tag *tag,
+        struct type_tag *from);
+
+/* Returns a new type tag whose static types are the shared type tag's types,
+ * so the type tag functions (has_a, acquire, for_each, etc.) work on it. Types
+ * are looked up by name and for_each passes the interned names. The type tag
+ * can have its own dynamic types too, but must not have its static types in
+ * the filter (see type_tag_bloom_statics(...)) since other processes change
+ * them. Acquisitions may throw TYPE_SHARED_NOT_PROVIDED (see
+ * type_shared_acquire(...)).
+ */
+struct type_tag *
+type_shared_bind(
+        struct type_shared *shared,
+        struct type_shared_tag *tag);
+
+/* Finalize and free the type tag returned by type_shared_bind(...). Must be
+ * called before the segment is closed.
+ *
+ * Throws:
+ *
+ * TYPE_TAG_STILL_ATTACHED
+ *  If any dynamic types are still attached to the type tag.
+ */
+void
+type_shared_unbind(
+        struct type_tag *tag);
+
+/* Returns the number of bytes of the segment in use. */
+size_t
+type_shared_memory_usage(
+        struct type_shared *shared);
+
 #endif /* TYPE_H */
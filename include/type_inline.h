@@ -0,0 +1,116 @@
+#ifndef TYPE_INLINE_H
+#define TYPE_INLINE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <type.h>
+
+/*** Inline ***/
+
+/* Opt-in fast path for acquiring and releasing type implementations. Every
+ * type tag starts with a struct type_inline caching the implementations most
+ * recently acquired (through the library) from the tag itself. While a cached
+ * type is acquired, acquiring it again (or releasing all but its last
+ * acquisition) inlines at the call site by counting in the cache slot, which
+ * the library adds to its own count the next time it looks at the type tag.
+ * Anything else (including the first acquisition, the last release and type
+ * tags from a library with a different TYPE_INLINE_ABI) calls
+ * type_tag_acquire(...) or type_tag_release(...).
+ *
+ * Only the types dynamically attached to a type tag without parents or static
+ * hooks are cached. The cache is cleared whenever the type tag changes. While
+ * stats or profiling are enabled everything goes through the library.
+ * Otherwise inline acquisitions and releases skip what only the library does:
+ * they don't fire the tracing probes (see probe.h), aren't counted or profiled
+ * and never demote the library's records (the last release does that).
+ */
+
+/* Version of the layout below. Changes whenever the layout does. */
+#define TYPE_INLINE_ABI 2
+
+/* Number of types cached per type tag. */
+#define TYPE_INLINE_SLOTS 4
+
+struct type_inline_slot {
+    const char *type;                   /* Cached type (or NULL). */
+    void *impl;                         /* The type's implementation. */
+    size_t acquisitions;                /* Inline ones not yet counted. */
+    void *record;                       /* Private to the library. */
+};
+
+struct type_inline {
+    unsigned int abi;                   /* Always first. */
+    unsigned int next;                  /* Next slot to replace. */
+    size_t acquired;                    /* Private to the library. */
+    struct type_inline_slot slots[TYPE_INLINE_SLOTS];
+};
+
+/* Older layouts must be told apart by the abi field. */
+_Static_assert(offsetof(struct type_inline, abi) == 0,
+        "The abi field of struct type_inline must be first.");
+
+/* Non-zero while the library must see every acquisition and release. */
+extern unsigned int type_inline_bypass;
+
+/* Returns the cached slot for the type (or NULL). */
+static inline struct type_inline_slot *
+type_inline_slot(
+        struct type_tag *tag,
+        const char *type)
+{
+    struct type_inline *fast = (struct type_inline *)tag;
+
+    if (fast->abi != TYPE_INLINE_ABI ||
+        __atomic_load_n(&type_inline_bypass, __ATOMIC_RELAXED) != 0) {
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < TYPE_INLINE_SLOTS; i++) {
+        if (fast->slots[i].type == type) {
+            return &fast->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Same as type_tag_acquire(...). */
+static inline void
+type_tag_acquire_inline(
+        struct type_tag_impl *tti)
+{
+    struct type_inline_slot *slot = type_inline_slot(tti->tag, tti->type);
+
+    if (__builtin_expect(slot == NULL, 0)) {
+        type_tag_acquire(tti);
+        return;
+    }
+
+    slot->acquisitions++;
+
+    tti->impl = slot->impl;
+    tti->flags = 0;
+}
+
+/* Same as type_tag_release(...). */
+static inline void
+type_tag_release_inline(
+        struct type_tag_impl *tti)
+{
+    struct type_inline_slot *slot = type_inline_slot(tti->tag, tti->type);
+
+    /* Errors (and the last release) are handled by the library. */
+    if (__builtin_expect(slot == NULL ||
+                         slot->acquisitions == 0 ||
+                         (tti->impl != NULL && tti->impl != slot->impl), 0)) {
+        type_tag_release(tti);
+        return;
+    }
+
+    slot->acquisitions--;
+
+    tti->impl = NULL;
+}
+
+#endif /* TYPE_INLINE_H */
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <ec/ec.h>
+#include <ecx_stdio.h>
+#include <ecx_stdlib.h>
+
+#include <Judy.h>
+
+#include "type.h"
+#include "stats.h"
+
+/*** Plugin ***/
+
+const char TYPE_PLUGIN_ALREADY_REGISTERED[] = "Type Plugin: Already Registered";
+const char TYPE_PLUGIN_NOT_REGISTERED[]     = "Type Plugin: Not Registered";
+const char TYPE_PLUGIN_LOAD_FAILED[]        = "Type Plugin: Load Failed";
+const char TYPE_PLUGIN_BAD_MANIFEST[]       = "Type Plugin: Bad Manifest";
+
+/* Shared library providing implementations. */
+struct library {
+    char *path;
+    void *handle;                       /* Open handle (or NULL). */
+    size_t refs;                        /* Implementations in use. */
+};
+
+/* Where a type's implementation lives. */
+struct plugin {
+    struct library *library;
+    char *symbol;
+};
+
+/* An implementation resolved from a library. */
+struct loaded {
+    struct library *library;
+    size_t refs;                        /* Attachments using it. */
+};
+
+/* The plugin registry is shared by all threads. */
+static pthread_mutex_t plugin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Pvoid_t name_to_type = NULL;     /* JudySL from name to type. */
+static Pvoid_t type_to_plugin = NULL;   /* JudyL from type to plugin. */
+static Pvoid_t path_to_library = NULL;  /* JudySL from path to library. */
+static Pvoid_t impl_to_loaded = NULL;   /* JudyL from impl to loaded. */
+
+static char *
+plugin_strdup(
+        const char *str)
+{
+    size_t size = strlen(str) + 1;
+    char *copy = ecx_malloc(size);
+
+    return memcpy(copy, str, size);
+}
+
+static void
+plugin_unlock(
+        void *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+const char *
+type_plugin_intern(
+        const char *name)
+{
+    const char *type = NULL;
+
+    pthread_mutex_lock(&plugin_lock);
+    ec_with (&plugin_lock, plugin_unlock) {
+        Pvoid_t *PValue = NULL;
+        JSLI(PValue, name_to_type, (const uint8_t *)name);
+
+        if (*PValue == NULL) {
+            *PValue = plugin_strdup(name);
+        }
+
+        type = *PValue;
+    }
+
+    return type;
+}
+
+void
+type_plugin_register(
+        const char *type,
+        const char *library,
+        const char *symbol)
+{
+    unsigned int registered = 0;
+
+    pthread_mutex_lock(&plugin_lock);
+    ec_with (&plugin_lock, plugin_unlock) {
+        Pvoid_t *PName = NULL;
+        Pvoid_t *PValue = NULL;
+
+        JSLG(PName, name_to_type, (const uint8_t *)type);
+        JLG(PValue, type_to_plugin, (Word_t)type);
+
+        if ((PName != NULL && *PName != type) || PValue != NULL) {
+            registered = 1;
+        }
+        else {
+            /* Find (or add) the library. */
+            Pvoid_t *PLibrary = NULL;
+            JSLI(PLibrary, path_to_library, (const uint8_t *)library);
+
+            if (*PLibrary == NULL) {
+                struct library *lib = ecx_malloc(sizeof(struct library));
+                lib->path = plugin_strdup(library);
+                lib->handle = NULL;
+                lib->refs = 0;
+
+                *PLibrary = lib;
+            }
+
+            struct plugin *plugin = ecx_malloc(sizeof(struct plugin));
+            plugin->library = *PLibrary;
+            plugin->symbol = plugin_strdup(symbol);
+
+            JSLI(PName, name_to_type, (const uint8_t *)type);
+            *PName = (void *)type;
+
+            JLI(PValue, type_to_plugin, (Word_t)type);
+            *PValue = plugin;
+        }
+    }
+
+    if (registered) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "A plugin (or another type) for '%s' is already registered.", type);
+        stats_throw_str(TYPE_PLUGIN_ALREADY_REGISTERED) msg;
+    }
+}
+
+void
+type_plugin_manifest(
+        const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        char *msg = NULL;
+        ecx_asprintf(&msg, "Can't open manifest '%s'.", path);
+        stats_throw_str(TYPE_PLUGIN_BAD_MANIFEST) msg;
+    }
+
+    char line[4096];
+    size_t number = 0;
+
+    ec_with (file, (ec_unwind_f)fclose) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            number++;
+
+            /* Drop comments. */
+            char *comment = strchr(line, '#');
+            if (comment != NULL) {
+                *comment = '\0';
+            }
+
+            /* Split into fields: type library symbol */
+            char *fields[4] = {NULL, NULL, NULL, NULL};
+            char *save = NULL;
+            size_t count = 0;
+
+            for (char *field = strtok_r(line, " \t\r\n", &save);
+                 field != NULL && count < 4;
+                 field = strtok_r(NULL, " \t\r\n", &save)) {
+                fields[count++] = field;
+            }
+
+            if (count == 0) continue;
+
+            if (count != 3) {
+                char *msg = NULL;
+                ecx_asprintf(&msg,
+                        "%s:%zu: Expected 'type library symbol'.", path, number);
+                stats_throw_str(TYPE_PLUGIN_BAD_MANIFEST) msg;
+            }
+
+            type_plugin_register(
+                    type_plugin_intern(fields[0]), fields[1], fields[2]);
+        }
+    }
+}
+
+/* Factory for plugin implementations. Opens the library if needed. */
+static void *
+plugin_load(
+        void *ctx)
+{
+    struct plugin *plugin = ctx;
+    struct library *library = plugin->library;
+
+    void *impl = NULL;
+    char *error = NULL;
+    void *unused = NULL;
+
+    /* Opened without the lock, since library constructors may call back into
+     * the registry. The loader counts opens, so a redundant handle is simply
+     * closed again.
+     */
+    void *handle = dlopen(library->path, RTLD_NOW | RTLD_LOCAL);
+
+    if (handle == NULL) {
+        ecx_asprintf(&error, "Can't load '%s' from '%s': %s",
+                plugin->symbol, library->path, dlerror());
+    }
+    else {
+        pthread_mutex_lock(&plugin_lock);
+        ec_with (&plugin_lock, plugin_unlock) {
+            /* Another thread may have opened it meanwhile. */
+            if (library->handle == NULL) {
+                library->handle = handle;
+                handle = NULL;
+            }
+
+            dlerror();
+            impl = dlsym(library->handle, plugin->symbol);
+
+            if (impl == NULL) {
+                ecx_asprintf(&error, "Can't load '%s' from '%s': %s",
+                        plugin->symbol, library->path, dlerror());
+
+                if (library->refs == 0) {
+                    unused = library->handle;
+                    library->handle = NULL;
+                }
+            }
+            else {
+                Pvoid_t *PValue = NULL;
+                JLI(PValue, impl_to_loaded, (Word_t)impl);
+
+                if (*PValue == NULL) {
+                    struct loaded *loaded = ecx_malloc(sizeof(struct loaded));
+                    loaded->library = library;
+                    loaded->refs = 0;
+
+                    *PValue = loaded;
+                }
+
+                ((struct loaded *)*PValue)->refs++;
+                library->refs++;
+            }
+        }
+
+        /* Closed without the lock too (for the destructors). */
+        if (handle != NULL) dlclose(handle);
+        if (unused != NULL) dlclose(unused);
+    }
+
+    if (impl == NULL) {
+        stats_throw_str(TYPE_PLUGIN_LOAD_FAILED) error;
+    }
+
+    return impl;
+}
+
+/* Detach callback for plugin implementations. Closes the library once none of
+ * its implementations are in use.
+ */
+static void
+plugin_unload(
+        void *impl)
+{
+    void *unused = NULL;
+
+    pthread_mutex_lock(&plugin_lock);
+    ec_with (&plugin_lock, plugin_unlock) {
+        Pvoid_t *PValue = NULL;
+        JLG(PValue, impl_to_loaded, (Word_t)impl);
+
+        struct loaded *loaded = *PValue;
+        struct library *library = loaded->library;
+
+        if (--loaded->refs == 0) {
+            free(loaded);
+
+            int status = 0;
+            JLD(status, impl_to_loaded, (Word_t)impl);
+        }
+
+        if (--library->refs == 0) {
+            unused = library->handle;
+            library->handle = NULL;
+        }
+    }
+
+    /* Closed without the lock, since destructors may use the registry. */
+    if (unused != NULL) dlclose(unused);
+}
+
+void
+type_tag_attach_plugin(
+        struct type_tag_impl *tti)
+{
+    struct plugin *plugin = NULL;
+
+    pthread_mutex_lock(&plugin_lock);
+    ec_with (&plugin_lock, plugin_unlock) {
+        Pvoid_t *PValue = NULL;
+        JLG(PValue, type_to_plugin, (Word_t)tti->type);
+
+        if (PValue != NULL) {
+            plugin = *PValue;
+        }
+    }
+
+    if (plugin == NULL) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "No plugin for '%s' is registered.", tti->type);
+        stats_throw_str(TYPE_PLUGIN_NOT_REGISTERED) msg;
+    }
+
+    type_tag_attach_lazy(tti, plugin_load, plugin, plugin_unload);
+}
@@ -0,0 +1,59 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* USDT probes (provider libtype) for perf, bpftrace, SystemTap, etc. A probe
+ * is a single nop until a tracer attaches to it. Without sys/sdt.h the probes
+ * compile to nothing.
+ *
+ * Probes:
+ *
+ * tag_attach(tag, type, count)     After attaching (count is the tag's types).
+ * tag_detach(tag, type, count)     After detaching.
+ * tag_detach_all(tag, count)       After detaching all (count detached).
+ * tag_acquire(tag, type, impl, count)
+ *                                  After acquiring (count is the acquisitions
+ *                                  now, 0 if they aren't counted).
+ * tag_release(tag, type, count)    After releasing.
+ * attach(data, tag)               After attaching.
+ * detach(data, tag)               After detaching.
+ * acquire(data, tag, count)       After acquiring (count is the acquisitions
+ *                                 now).
+ * release(data, tag, count)       After releasing.
+ * handle_attach(handle, tag)      Like attach(...), but for handles.
+ * handle_detach(handle, tag)      Like detach(...).
+ * handle_acquire(handle, tag, count)
+ *                                 Like acquire(...).
+ * handle_release(handle, tag, count)
+ *                                 Like release(...).
+ * throw(id)                       Before throwing (id is the exception's).
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define probe1(name_, a_) \
+    DTRACE_PROBE1(libtype, name_, a_)
+#define probe2(name_, a_, b_) \
+    DTRACE_PROBE2(libtype, name_, a_, b_)
+#define probe3(name_, a_, b_, c_) \
+    DTRACE_PROBE3(libtype, name_, a_, b_, c_)
+#define probe4(name_, a_, b_, c_, d_) \
+    DTRACE_PROBE4(libtype, name_, a_, b_, c_, d_)
+#else
+/* The arguments are still compiled (but never evaluated), so values only
+ * computed for probes don't warn as unused.
+ */
+#define probe1(name_, a_) \
+    do { if (0) { (void)(a_); } } while (0)
+#define probe2(name_, a_, b_) \
+    do { if (0) { (void)(a_); (void)(b_); } } while (0)
+#define probe3(name_, a_, b_, c_) \
+    do { if (0) { (void)(a_); (void)(b_); (void)(c_); } } while (0)
+#define probe4(name_, a_, b_, c_, d_) \
+    do { if (0) { (void)(a_); (void)(b_); (void)(c_); (void)(d_); } } while (0)
+#endif
+
+#endif /* PROBE_H */
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ec/ec.h>
+#include <ecx_stdlib.h>
+
+#include <Judy.h>
+
+#include "type.h"
+#include "type_inline.h"
+#include "profile.h"
+
+/*** Profile ***/
+
+__thread unsigned int profile_enabled = 0;
+
+/* An outstanding acquisition. */
+struct hold {
+    uint64_t start;                     /* When acquired (in ns). */
+    const char *file;                   /* Where acquired (or NULL). */
+    unsigned int line;
+    struct hold *next;                  /* The previous acquisition. */
+};
+
+/* Map from key (type tag or data) to type to the most recent hold. */
+static __thread Pvoid_t key_to_type_to_hold = NULL;
+
+/* Map from handle to type to the most recent hold (kept apart, since handles
+ * are small integers that could equal a key).
+ */
+static __thread Pvoid_t handle_to_type_to_hold = NULL;
+
+/* Map from type to histogram. */
+static __thread Pvoid_t type_to_histogram = NULL;
+
+static uint64_t
+profile_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/* Returns the bucket for the hold time: 0 for 0 ns, otherwise i for
+ * [2^(i-1), 2^i) ns (with the last bucket open ended).
+ */
+static size_t
+profile_bucket(
+        uint64_t ns)
+{
+    size_t bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+    return bucket < TYPE_PROFILE_BUCKETS ? bucket : TYPE_PROFILE_BUCKETS - 1;
+}
+
+/* Pushes a hold of the type through the key in the map. */
+static void
+hold_push(
+        Pvoid_t *keys,
+        Word_t key,
+        const char *type,
+        const char *file,
+        unsigned int line)
+{
+    struct hold *hold = ecx_malloc(sizeof(struct hold));
+    hold->file = file;
+    hold->line = line;
+
+    Pvoid_t *PTypes = NULL;
+    JLI(PTypes, *keys, key);
+
+    Pvoid_t *PValue = NULL;
+    JLI(PValue, *PTypes, (Word_t)type);
+
+    hold->next = *PValue;
+    *PValue = hold;
+
+    hold->start = profile_now();
+}
+
+/* Pops the most recent hold of the type through the key in the map and adds
+ * its hold time to the type's histogram.
+ */
+static void
+hold_pop(
+        Pvoid_t *keys,
+        Word_t key,
+        const char *type)
+{
+    uint64_t end = profile_now();
+
+    Pvoid_t *PTypes = NULL;
+    JLG(PTypes, *keys, key);
+
+    /* Acquired before profiling was enabled. */
+    if (PTypes == NULL) return;
+
+    Pvoid_t *PValue = NULL;
+    JLG(PValue, *PTypes, (Word_t)type);
+
+    if (PValue == NULL) return;
+
+    struct hold *hold = *PValue;
+    uint64_t held = end - hold->start;
+
+    /* Drop the hold (and the maps once empty). */
+    if (hold->next != NULL) {
+        *PValue = hold->next;
+    }
+    else {
+        int status = 0;
+        JLD(status, *PTypes, (Word_t)type);
+
+        if (*PTypes == NULL) {
+            JLD(status, *keys, key);
+        }
+    }
+
+    free(hold);
+
+    /* Add to the type's histogram. */
+    JLI(PValue, type_to_histogram, (Word_t)type);
+
+    if (*PValue == NULL) {
+        *PValue = ecx_malloc(sizeof(struct type_profile_histogram));
+        memset(*PValue, 0, sizeof(struct type_profile_histogram));
+    }
+
+    struct type_profile_histogram *histogram = *PValue;
+    histogram->count++;
+    histogram->total += held;
+    histogram->max = held > histogram->max ? held : histogram->max;
+    histogram->buckets[profile_bucket(held)]++;
+}
+
+void
+profile_hold(
+        const void *key,
+        const char *type,
+        const char *file,
+        unsigned int line)
+{
+    hold_push(&key_to_type_to_hold, (Word_t)key, type, file, line);
+}
+
+void
+profile_unhold(
+        const void *key,
+        const char *type)
+{
+    hold_pop(&key_to_type_to_hold, (Word_t)key, type);
+}
+
+void
+profile_hold_handle(
+        size_t handle,
+        const char *file,
+        unsigned int line)
+{
+    hold_push(&handle_to_type_to_hold, (Word_t)handle, NULL, file, line);
+}
+
+void
+profile_unhold_handle(
+        size_t handle)
+{
+    hold_pop(&handle_to_type_to_hold, (Word_t)handle, NULL);
+}
+
+/* Frees the holds in the map (and the map). */
+static void
+holds_free(
+        Pvoid_t *keys)
+{
+    Word_t freed = 0;
+
+    Pvoid_t *PTypes = NULL;
+    Word_t Key = 0;
+
+    JLF(PTypes, *keys, Key);
+
+    while (PTypes != NULL) {
+        Pvoid_t *PValue = NULL;
+        Word_t Type = 0;
+
+        JLF(PValue, *PTypes, Type);
+
+        while (PValue != NULL) {
+            struct hold *hold = *PValue;
+
+            while (hold != NULL) {
+                struct hold *next = hold->next;
+                free(hold);
+                hold = next;
+            }
+
+            JLN(PValue, *PTypes, Type);
+        }
+
+        JLFA(freed, *PTypes);
+        JLN(PTypes, *keys, Key);
+    }
+
+    JLFA(freed, *keys);
+}
+
+void
+type_profile_enable()
+{
+    if (profile_enabled) return;
+
+    /* Profiled acquisitions can't be inlined. */
+    __atomic_add_fetch(&type_inline_bypass, 1, __ATOMIC_RELAXED);
+
+    profile_enabled = 1;
+}
+
+void
+type_profile_disable()
+{
+    if (profile_enabled) {
+        __atomic_sub_fetch(&type_inline_bypass, 1, __ATOMIC_RELAXED);
+    }
+
+    profile_enabled = 0;
+
+    Word_t freed = 0;
+
+    /* Free the outstanding holds. */
+    holds_free(&key_to_type_to_hold);
+    holds_free(&handle_to_type_to_hold);
+
+    /* Free the histograms. */
+    Pvoid_t *PValue = NULL;
+    Word_t Type = 0;
+
+    JLF(PValue, type_to_histogram, Type);
+
+    while (PValue != NULL) {
+        free(*PValue);
+        JLN(PValue, type_to_histogram, Type);
+    }
+
+    JLFA(freed, type_to_histogram);
+}
+
+void
+type_profile_histogram(
+        const char *type,
+        struct type_profile_histogram *histogram)
+{
+    Pvoid_t *PValue = NULL;
+    JLG(PValue, type_to_histogram, (Word_t)type);
+
+    if (PValue == NULL) {
+        memset(histogram, 0, sizeof(struct type_profile_histogram));
+        return;
+    }
+
+    *histogram = *(struct type_profile_histogram *)*PValue;
+}
+
+/* Calls action(...) for each hold in the map (see type_profile_for_each(...)).
+ */
+static int
+holds_for_each(
+        Pvoid_t keys,
+        unsigned int handles,
+        uint64_t now,
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_profile_hold *hold))
+{
+    int status = 0;
+
+    Pvoid_t *PTypes = NULL;
+    Word_t Key = 0;
+
+    JLF(PTypes, keys, Key);
+
+    while (PTypes != NULL) {
+        Pvoid_t *PValue = NULL;
+        Word_t Type = 0;
+
+        JLF(PValue, *PTypes, Type);
+
+        while (PValue != NULL) {
+            for (struct hold *hold = *PValue; hold != NULL; hold = hold->next) {
+                struct type_profile_hold outstanding = {
+                    .kind = handles ? TYPE_PROFILE_HANDLE :
+                        Type == 0 ? TYPE_PROFILE_DATA : TYPE_PROFILE_TAG,
+                    .key = handles ? NULL : (const void *)Key,
+                    .handle = handles ? (size_t)Key : 0,
+                    .type = (const char *)Type,
+                    .file = hold->file,
+                    .line = hold->line,
+                    .held = now - hold->start,
+                };
+
+                status = action(self, &outstanding);
+                if (status != 0) return status;
+            }
+
+            JLN(PValue, *PTypes, Type);
+        }
+
+        JLN(PTypes, keys, Key);
+    }
+
+    return status;
+}
+
+int
+type_profile_for_each(
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_profile_hold *hold))
+{
+    uint64_t now = profile_now();
+
+    int status = holds_for_each(key_to_type_to_hold, 0, now, self, action);
+    if (status != 0) return status;
+
+    return holds_for_each(handle_to_type_to_hold, 1, now, self, action);
+}
+
+static int
+profile_print(
+        void *self,
+        struct type_profile_hold *hold)
+{
+    FILE *file = self;
+
+    if (hold->kind == TYPE_PROFILE_HANDLE) {
+        fprintf(file, "handle %zu ", hold->handle);
+    }
+    else {
+        fprintf(file, "%p ", hold->key);
+    }
+
+    fprintf(file, "%s%s%s held %" PRIu64 " ns, acquired at %s:%u\n",
+            hold->type == NULL ? "(data)" : "'",
+            hold->type == NULL ? "" : hold->type,
+            hold->type == NULL ? "" : "'",
+            hold->held,
+            hold->file == NULL ? "(unknown)" : hold->file,
+            hold->line);
+
+    return 0;
+}
+
+void
+type_profile_dump(
+        FILE *file)
+{
+    type_profile_for_each(file, profile_print);
+}
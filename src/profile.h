@@ -0,0 +1,66 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "type.h"
+
+extern __thread unsigned int profile_enabled;
+
+/* Records an acquisition of the type through key (a type tag or data). */
+void
+profile_hold(
+        const void *key,
+        const char *type,
+        const char *file,
+        unsigned int line);
+
+/* Records the release of the most recent acquisition of the type through key. */
+void
+profile_unhold(
+        const void *key,
+        const char *type);
+
+/* Records an acquisition of the handle (kept apart from the other keys). */
+void
+profile_hold_handle(
+        size_t handle,
+        const char *file,
+        unsigned int line);
+
+/* Records the release of the most recent acquisition of the handle. */
+void
+profile_unhold_handle(
+        size_t handle);
+
+/* Profile the acquisition. Costs a single branch when disabled. */
+#define profile_acquired(key_, type_, file_, line_) \
+    do { \
+        if (__builtin_expect(profile_enabled, 0)) { \
+            profile_hold(key_, type_, file_, line_); \
+        } \
+    } while (0)
+
+/* Profile the release. Costs a single branch when disabled. */
+#define profile_released(key_, type_) \
+    do { \
+        if (__builtin_expect(profile_enabled, 0)) { \
+            profile_unhold(key_, type_); \
+        } \
+    } while (0)
+
+/* Profile the handle's acquisition. Costs a single branch when disabled. */
+#define profile_handle_acquired(handle_, file_, line_) \
+    do { \
+        if (__builtin_expect(profile_enabled, 0)) { \
+            profile_hold_handle(handle_, file_, line_); \
+        } \
+    } while (0)
+
+/* Profile the handle's release. Costs a single branch when disabled. */
+#define profile_handle_released(handle_) \
+    do { \
+        if (__builtin_expect(profile_enabled, 0)) { \
+            profile_unhold_handle(handle_); \
+        } \
+    } while (0)
+
+#endif /* PROFILE_H */
@@ -0,0 +1,1022 @@
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Judy.h>
+#include <ec/ec.h>
+#include <ecx_stdio.h>
+#include <ecx_stdlib.h>
+
+#include "type.h"
+#include "stats.h"
+
+/*** Shared ***/
+
+const char TYPE_SHARED_MAP_FAILED[]  = "Type Shared: Map Failed";
+const char TYPE_SHARED_BAD_SEGMENT[] = "Type Shared: Bad Segment";
+const char TYPE_SHARED_FULL[]        = "Type Shared: Full";
+const char TYPE_SHARED_NOT_PROVIDED[] = "Type Shared: Not Provided";
+
+#define SHARED_MAGIC 0x74797065         /* "type" */
+#define SHARED_VERSION 2
+#define SHARED_BUCKETS 256              /* Interned name hash chains. */
+#define SHARED_TAG_BUCKETS 8            /* Entry hash chains per tag. */
+#define SHARED_ALIGN 16
+
+/* Set in an entry's acquisitions while it is detached. */
+#define SHARED_DETACHED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+/* Everything in the segment refers to everything else by offset from the
+ * start of the segment (0 is NULL), so processes may map it anywhere. Space is
+ * handed out by bumping the used offset and isn't reclaimed.
+ */
+struct segment {
+    uint32_t magic;
+    uint32_t version;
+    size_t size;
+    size_t used;                        /* Allocated bytes. */
+    pthread_mutex_t lock;               /* Serializes changes. */
+    size_t tags;                        /* First tag. */
+    size_t names[SHARED_BUCKETS];       /* First name in each chain. */
+};
+
+/* An interned name. Its offset is the type ID. */
+struct name {
+    size_t next;
+    size_t hash;
+    char name[];
+};
+
+/* A type attached (or once attached) to a tag. Entries are never moved or
+ * removed: detaching marks the entry and attaching the type again reuses it,
+ * so readers never see reclaimed space and a tag uses at most one entry per
+ * type. Every change is a single store, so a process that dies while changing
+ * the segment can't leave an entry half changed.
+ */
+struct entry {
+    size_t next;                        /* Next entry in the chain. */
+    size_t type;
+    size_t impl;                        /* See type_shared_provide(...). */
+    size_t acquired;                    /* Or SHARED_DETACHED. */
+};
+
+struct type_shared_tag {
+    size_t next;
+    size_t name;
+    size_t entries[SHARED_TAG_BUCKETS]; /* First entry in each chain. */
+};
+
+/* A process's mapping of the segment. */
+struct type_shared {
+    char *base;
+    size_t size;
+    int fd;
+    Pvoid_t id_to_impl;                 /* This process's implementations. */
+    pthread_rwlock_t provided_lock;     /* Guards id_to_impl. */
+};
+
+static inline void *
+shared_at(
+        struct type_shared *shared,
+        size_t offset)
+{
+    return offset != 0 ? shared->base + offset : NULL;
+}
+
+static inline size_t
+shared_offset(
+        struct type_shared *shared,
+        void *pointer)
+{
+    return (size_t)((char *)pointer - shared->base);
+}
+
+static inline struct segment *
+shared_segment(
+        struct type_shared *shared)
+{
+    return (struct segment *)shared->base;
+}
+
+static void
+shared_lock(
+        struct type_shared *shared)
+{
+    struct segment *segment = shared_segment(shared);
+
+    /* Changes are published with a single store (and detaching is a single
+     * compare and swap), so a process that died holding the lock can only
+     * have leaked the space it allocated.
+     */
+    if (pthread_mutex_lock(&segment->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&segment->lock);
+    }
+}
+
+static void
+shared_unlock(
+        void *shared)
+{
+    pthread_mutex_unlock(&shared_segment(shared)->lock);
+}
+
+/* Returns the offset of size bytes (or 0 if the segment is full). Requires the
+ * lock.
+ */
+static size_t
+shared_alloc(
+        struct type_shared *shared,
+        size_t size)
+{
+    struct segment *segment = shared_segment(shared);
+
+    size = (size + SHARED_ALIGN - 1) & ~(size_t)(SHARED_ALIGN - 1);
+    if (size > segment->size - segment->used) return 0;
+
+    size_t offset = segment->used;
+    __atomic_store_n(&segment->used, offset + size, __ATOMIC_RELAXED);
+
+    return offset;
+}
+
+static void
+shared_throw_errno(
+        const char *what)
+{
+    char *msg = NULL;
+    ecx_asprintf(&msg, "%s: %s", what, strerror(errno));
+    stats_throw_str(TYPE_SHARED_MAP_FAILED) msg;
+}
+
+static void
+shared_throw_full()
+{
+    stats_throw_str_static(TYPE_SHARED_FULL, "The shared segment is full.");
+}
+
+/* Maps the segment in the file. If created is not NULL, then it's the name of
+ * the segment just created, which is unlinked if it can't be mapped.
+ */
+static struct type_shared *
+shared_map(
+        int fd,
+        size_t size,
+        const char *created)
+{
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        if (created != NULL) shm_unlink(created);
+
+        errno = error;
+        shared_throw_errno("Can't map the shared segment");
+    }
+
+    struct type_shared *shared = malloc(sizeof(struct type_shared));
+    if (shared == NULL) {
+        munmap(base, size);
+        close(fd);
+        if (created != NULL) shm_unlink(created);
+
+        stats_throw_str_static(TYPE_SHARED_MAP_FAILED, "Out of memory.");
+    }
+
+    shared->base = base;
+    shared->size = size;
+    shared->fd = fd;
+    shared->id_to_impl = NULL;
+    pthread_rwlock_init(&shared->provided_lock, NULL);
+
+    return shared;
+}
+
+struct type_shared *
+type_shared_create(
+        const char *name,
+        size_t size)
+{
+    int fd = -1;
+
+    if (name != NULL) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    }
+    else {
+#ifdef HAVE_MEMFD_CREATE
+        fd = memfd_create("type", MFD_CLOEXEC);
+#else
+        /* Unlinked right away, so only the descriptor refers to it. */
+        char path[64];
+        static size_t created = 0;
+        snprintf(path, sizeof(path), "/type-%ld-%zu", (long)getpid(),
+                __atomic_fetch_add(&created, 1, __ATOMIC_RELAXED));
+
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd != -1) shm_unlink(path);
+#endif
+    }
+
+    if (fd == -1) {
+        shared_throw_errno("Can't create the shared segment");
+    }
+
+    if (size < sizeof(struct segment)) {
+        size = sizeof(struct segment);
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        int error = errno;
+        close(fd);
+        if (name != NULL) shm_unlink(name);
+
+        errno = error;
+        shared_throw_errno("Can't size the shared segment");
+    }
+
+    struct type_shared *shared = shared_map(fd, size, name);
+    struct segment *segment = shared_segment(shared);
+
+    segment->version = SHARED_VERSION;
+    segment->size = size;
+    segment->used = (sizeof(struct segment) + SHARED_ALIGN - 1) &
+        ~(size_t)(SHARED_ALIGN - 1);
+    segment->tags = 0;
+    memset(segment->names, 0, sizeof(segment->names));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&segment->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    /* Only now is the segment ready for others. */
+    __atomic_store_n(&segment->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+
+    return shared;
+}
+
+struct type_shared *
+type_shared_map(
+        int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        shared_throw_errno("Can't map the shared segment");
+    }
+
+    size_t size = (size_t)st.st_size;
+    struct type_shared *shared = NULL;
+
+    if (size >= sizeof(struct segment)) {
+        shared = shared_map(fd, size, NULL);
+        struct segment *segment = shared_segment(shared);
+
+        if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) == SHARED_MAGIC &&
+            segment->version == SHARED_VERSION &&
+            segment->size == size) {
+            return shared;
+        }
+
+        pthread_rwlock_destroy(&shared->provided_lock);
+        munmap(shared->base, shared->size);
+        free(shared);
+    }
+
+    close(fd);
+    stats_throw_str_static(TYPE_SHARED_BAD_SEGMENT,
+            "Not a shared segment (or a different version).");
+
+    return NULL;
+}
+
+struct type_shared *
+type_shared_open(
+        const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1) {
+        shared_throw_errno("Can't open the shared segment");
+    }
+
+    return type_shared_map(fd);
+}
+
+int
+type_shared_fd(
+        struct type_shared *shared)
+{
+    return shared->fd;
+}
+
+void
+type_shared_close(
+        struct type_shared *shared)
+{
+    Word_t freed = 0;
+    JLFA(freed, shared->id_to_impl);
+    pthread_rwlock_destroy(&shared->provided_lock);
+
+    munmap(shared->base, shared->size);
+    close(shared->fd);
+    free(shared);
+}
+
+/* FNV-1a */
+static size_t
+shared_hash(
+        const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+
+    return (size_t)hash;
+}
+
+/* Returns the ID of the name (or 0 if it isn't interned). */
+static size_t
+shared_name_find(
+        struct type_shared *shared,
+        const char *name,
+        size_t hash)
+{
+    struct segment *segment = shared_segment(shared);
+    size_t offset = __atomic_load_n(
+            &segment->names[hash % SHARED_BUCKETS], __ATOMIC_ACQUIRE);
+
+    while (offset != 0) {
+        struct name *found = shared_at(shared, offset);
+
+        if (found->hash == hash && strcmp(found->name, name) == 0) {
+            return offset;
+        }
+
+        offset = found->next;
+    }
+
+    return 0;
+}
+
+size_t
+type_shared_intern(
+        struct type_shared *shared,
+        const char *name)
+{
+    size_t hash = shared_hash(name);
+    size_t type = shared_name_find(shared, name, hash);
+    if (type != 0) return type;
+
+    size_t found = 0;
+
+    shared_lock(shared);
+    ec_with (shared, shared_unlock) {
+        found = type = shared_name_find(shared, name, hash);
+
+        if (found == 0) {
+            size_t length = strlen(name) + 1;
+            type = shared_alloc(shared, sizeof(struct name) + length);
+        }
+
+        if (found == 0 && type != 0) {
+            struct name *interned = shared_at(shared, type);
+            size_t *bucket = &shared_segment(shared)->names[hash % SHARED_BUCKETS];
+
+            interned->hash = hash;
+            strcpy(interned->name, name);
+            interned->next = *bucket;
+
+            __atomic_store_n(bucket, type, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (type == 0) {
+        shared_throw_full();
+    }
+
+    return type;
+}
+
+const char *
+type_shared_name(
+        struct type_shared *shared,
+        size_t type)
+{
+    return ((struct name *)shared_at(shared, type))->name;
+}
+
+/* Returns the tag with the name's ID (or NULL if there isn't one). */
+static struct type_shared_tag *
+shared_tag_find(
+        struct type_shared *shared,
+        size_t name)
+{
+    size_t offset = __atomic_load_n(&shared_segment(shared)->tags, __ATOMIC_ACQUIRE);
+
+    while (offset != 0) {
+        struct type_shared_tag *tag = shared_at(shared, offset);
+        if (tag->name == name) return tag;
+
+        offset = tag->next;
+    }
+
+    return NULL;
+}
+
+struct type_shared_tag *
+type_shared_tag(
+        struct type_shared *shared,
+        const char *name)
+{
+    size_t id = type_shared_intern(shared, name);
+
+    struct type_shared_tag *tag = shared_tag_find(shared, id);
+    if (tag != NULL) return tag;
+
+    shared_lock(shared);
+    ec_with (shared, shared_unlock) {
+        tag = shared_tag_find(shared, id);
+
+        if (tag == NULL) {
+            tag = shared_at(shared, shared_alloc(shared, sizeof(struct type_shared_tag)));
+        }
+
+        if (tag != NULL && tag->name != id) {
+            struct segment *segment = shared_segment(shared);
+
+            tag->name = id;
+            memset(tag->entries, 0, sizeof(tag->entries));
+            tag->next = segment->tags;
+
+            __atomic_store_n(&segment->tags, shared_offset(shared, tag), __ATOMIC_RELEASE);
+        }
+    }
+
+    if (tag == NULL) {
+        shared_throw_full();
+    }
+
+    return tag;
+}
+
+size_t
+type_shared_provide(
+        struct type_shared *shared,
+        const char *name,
+        void *impl)
+{
+    size_t id = type_shared_intern(shared, name);
+    Pvoid_t *PValue = NULL;
+
+    pthread_rwlock_wrlock(&shared->provided_lock);
+    JLI(PValue, shared->id_to_impl, (Word_t)id);
+    *PValue = impl;
+    pthread_rwlock_unlock(&shared->provided_lock);
+
+    return id;
+}
+
+/* Returns this process's implementation for the ID (or NULL if it wasn't
+ * provided).
+ */
+static void *
+shared_resolve(
+        struct type_shared *shared,
+        size_t id)
+{
+    Pvoid_t *PValue = NULL;
+
+    pthread_rwlock_rdlock(&shared->provided_lock);
+    JLG(PValue, shared->id_to_impl, (Word_t)id);
+    void *impl = PValue != NULL ? *PValue : NULL;
+    pthread_rwlock_unlock(&shared->provided_lock);
+
+    return impl;
+}
+
+static inline size_t *
+shared_bucket(
+        struct type_shared_tag *tag,
+        size_t type)
+{
+    /* IDs are offsets, so the low bits are always 0. */
+    return &tag->entries[(type / SHARED_ALIGN) % SHARED_TAG_BUCKETS];
+}
+
+/* Returns the type's entry (or NULL if it was never attached). */
+static struct entry *
+shared_find(
+        struct type_shared *shared,
+        struct type_shared_tag *tag,
+        size_t type)
+{
+    size_t offset = __atomic_load_n(shared_bucket(tag, type), __ATOMIC_ACQUIRE);
+
+    while (offset != 0) {
+        struct entry *entry = shared_at(shared, offset);
+        if (entry->type == type) return entry;
+
+        offset = entry->next;
+    }
+
+    return NULL;
+}
+
+static inline unsigned int
+shared_attached(
+        struct entry *entry)
+{
+    return entry != NULL &&
+        !(__atomic_load_n(&entry->acquired, __ATOMIC_ACQUIRE) & SHARED_DETACHED);
+}
+
+static void
+shared_throw_not_attached(
+        struct type_shared *shared,
+        size_t type)
+{
+    char *msg = NULL;
+    ecx_asprintf(&msg,
+            "Type implementation for '%s' not attached.",
+            type_shared_name(shared, type));
+    stats_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+}
+
+void
+type_shared_attach(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi)
+{
+    struct type_shared_tag *tag = tsi->tag;
+    const char *error = NULL;
+
+    shared_lock(shared);
+    ec_with (shared, shared_unlock) {
+        struct entry *entry = shared_find(shared, tag, tsi->type);
+
+        if (shared_attached(entry)) {
+            error = TYPE_TAG_ALREADY_ATTACHED;
+        }
+        else if (entry != NULL) {
+            /* Reattached in place. */
+            entry->impl = tsi->id;
+            __atomic_store_n(&entry->acquired, 0, __ATOMIC_RELEASE);
+        }
+        else {
+            size_t offset = shared_alloc(shared, sizeof(struct entry));
+
+            if (offset == 0) {
+                error = TYPE_SHARED_FULL;
+            }
+            else {
+                size_t *bucket = shared_bucket(tag, tsi->type);
+
+                entry = shared_at(shared, offset);
+                entry->type = tsi->type;
+                entry->impl = tsi->id;
+                entry->acquired = 0;
+                entry->next = *bucket;
+
+                __atomic_store_n(bucket, offset, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    if (error == TYPE_TAG_ALREADY_ATTACHED) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' already attached.",
+                type_shared_name(shared, tsi->type));
+        stats_throw_str(TYPE_TAG_ALREADY_ATTACHED) msg;
+    }
+    else if (error == TYPE_SHARED_FULL) {
+        shared_throw_full();
+    }
+
+    stats_count(NULL, attaches);
+}
+
+void
+type_shared_detach(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi)
+{
+    struct type_shared_tag *tag = tsi->tag;
+    const char *error = NULL;
+
+    shared_lock(shared);
+    ec_with (shared, shared_unlock) {
+        struct entry *entry = shared_find(shared, tag, tsi->type);
+        size_t acquired = 0;
+
+        if (!shared_attached(entry)) {
+            error = TYPE_TAG_NOT_ATTACHED;
+        }
+        else if (!__atomic_compare_exchange_n(&entry->acquired, &acquired,
+                    SHARED_DETACHED, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            /* Acquired in some process. */
+            error = TYPE_TAG_STILL_ACQUIRED;
+        }
+    }
+
+    if (error == TYPE_TAG_NOT_ATTACHED) {
+        shared_throw_not_attached(shared, tsi->type);
+    }
+    else if (error == TYPE_TAG_STILL_ACQUIRED) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' still acquired.",
+                type_shared_name(shared, tsi->type));
+        stats_throw_str(TYPE_TAG_STILL_ACQUIRED) msg;
+    }
+
+    stats_count(NULL, detaches);
+}
+
+unsigned int
+type_shared_has_a(
+        struct type_shared *shared,
+        struct type_shared_tag *tag,
+        size_t type)
+{
+    return shared_attached(shared_find(shared, tag, type));
+}
+
+/* Acquires the type and returns this process's implementation (without
+ * counting it in the stats).
+ */
+static void *
+shared_acquire(
+        struct type_shared *shared,
+        struct type_shared_tag *tag,
+        size_t type)
+{
+    struct entry *entry = shared_find(shared, tag, type);
+
+    if (entry != NULL) {
+        size_t acquired = __atomic_load_n(&entry->acquired, __ATOMIC_RELAXED);
+
+        do {
+            /* Lost a race with detach. */
+            if (acquired & SHARED_DETACHED) {
+                entry = NULL;
+                break;
+            }
+        } while (!__atomic_compare_exchange_n(&entry->acquired, &acquired,
+                    acquired + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    }
+
+    if (entry == NULL) {
+        shared_throw_not_attached(shared, type);
+    }
+
+    /* Acquired, so the implementation can't change. */
+    size_t id = entry->impl;
+    void *impl = shared_resolve(shared, id);
+
+    if (impl == NULL) {
+        __atomic_sub_fetch(&entry->acquired, 1, __ATOMIC_RELEASE);
+
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Implementation '%s' of '%s' not provided in this process.",
+                type_shared_name(shared, id),
+                type_shared_name(shared, type));
+        stats_throw_str(TYPE_SHARED_NOT_PROVIDED) msg;
+    }
+
+    return impl;
+}
+
+/* Releases the type (without counting it in the stats). */
+static void
+shared_release(
+        struct type_shared *shared,
+        struct type_shared_tag *tag,
+        size_t type)
+{
+    struct entry *entry = shared_find(shared, tag, type);
+
+    if (entry == NULL) {
+        shared_throw_not_attached(shared, type);
+    }
+
+    size_t acquired = __atomic_load_n(&entry->acquired, __ATOMIC_RELAXED);
+
+    do {
+        if ((acquired & ~SHARED_DETACHED) == 0) {
+            char *msg = NULL;
+            ecx_asprintf(&msg,
+                    "Type implementation for '%s' not acquired.",
+                    type_shared_name(shared, type));
+            stats_throw_str(TYPE_TAG_NOT_ACQUIRED) msg;
+        }
+    } while (!__atomic_compare_exchange_n(&entry->acquired, &acquired,
+                acquired - 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Returns the type's acquisitions (throwing if it isn't attached). */
+static size_t
+shared_acquisitions(
+        struct type_shared *shared,
+        struct type_shared_tag *tag,
+        size_t type)
+{
+    struct entry *entry = shared_find(shared, tag, type);
+
+    if (!shared_attached(entry)) {
+        shared_throw_not_attached(shared, type);
+    }
+
+    return __atomic_load_n(&entry->acquired, __ATOMIC_RELAXED) & ~SHARED_DETACHED;
+}
+
+void
+type_shared_acquire(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi)
+{
+    tsi->impl = shared_acquire(shared, tsi->tag, tsi->type);
+
+    stats_count(NULL, acquires);
+}
+
+void
+type_shared_release(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi)
+{
+    shared_release(shared, tsi->tag, tsi->type);
+    tsi->impl = NULL;
+
+    stats_count(NULL, releases);
+}
+
+size_t
+type_shared_acquisitions(
+        struct type_shared *shared,
+        struct type_shared_impl *tsi)
+{
+    return shared_acquisitions(shared, tsi->tag, tsi->type);
+}
+
+struct shared_export {
+    struct type_shared *shared;
+    struct type_shared_tag *tag;
+};
+
+static int
+shared_export(
+        void *self,
+        struct type_tag_impl *tti)
+{
+    struct shared_export *export = self;
+
+    /* Acquiring materializes lazy implementations. */
+    struct type_tag_impl acquired = *tti;
+    type_tag_acquire(&acquired);
+
+    void *impl = acquired.impl;
+    type_tag_release(&acquired);
+
+    char *name = NULL;
+    ecx_asprintf(&name, "%s/%s",
+            type_shared_name(export->shared, export->tag->name), tti->type);
+
+    size_t id = 0;
+    ec_with (name, free) {
+        id = type_shared_provide(export->shared, name, impl);
+    }
+
+    struct type_shared_impl tsi = {
+        .tag = export->tag,
+        .type = type_shared_intern(export->shared, tti->type),
+        .id = id,
+        .impl = impl,
+    };
+
+    type_shared_attach(export->shared, &tsi);
+
+    return 0;
+}
+
+void
+type_shared_export(
+        struct type_shared *shared,
+        struct type_shared_tag *tag,
+        struct type_tag *from)
+{
+    struct shared_export export = {
+        .shared = shared,
+        .tag = tag,
+    };
+
+    type_tag_for_each(from, &export, shared_export);
+}
+
+/* A local type tag bound to a shared tag. The type tag follows the binding in
+ * the same allocation, so the hooks find the binding from the type tag.
+ */
+struct shared_bound {
+    struct type_shared *shared;
+    struct type_shared_tag *tag;
+};
+
+static inline size_t
+shared_bound_offset()
+{
+    size_t align = type_tag_align();
+    return (sizeof(struct shared_bound) + align - 1) & ~(align - 1);
+}
+
+static inline struct shared_bound *
+shared_bound(
+        struct type_tag *tag)
+{
+    return (struct shared_bound *)((char *)tag - shared_bound_offset());
+}
+
+/* Returns the type's ID (or 0 if it was never interned). */
+static inline size_t
+shared_bound_type(
+        struct shared_bound *bound,
+        const char *type)
+{
+    return shared_name_find(bound->shared, type, shared_hash(type));
+}
+
+/* Returns the type's ID (throwing if it was never interned). */
+static size_t
+shared_bound_known(
+        struct shared_bound *bound,
+        const char *type)
+{
+    size_t id = shared_bound_type(bound, type);
+
+    if (id == 0) {
+        char *msg = NULL;
+        ecx_asprintf(&msg, "Type implementation for '%s' not attached.", type);
+        stats_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+    }
+
+    return id;
+}
+
+static size_t
+shared_bound_attachments(
+        struct type_tag *tag)
+{
+    struct shared_bound *bound = shared_bound(tag);
+    size_t attachments = 0;
+
+    for (size_t i = 0; i < SHARED_TAG_BUCKETS; i++) {
+        size_t offset = __atomic_load_n(&bound->tag->entries[i], __ATOMIC_ACQUIRE);
+
+        while (offset != 0) {
+            struct entry *entry = shared_at(bound->shared, offset);
+            attachments += shared_attached(entry);
+
+            offset = entry->next;
+        }
+    }
+
+    return attachments;
+}
+
+static unsigned int
+shared_bound_has_a(
+        struct type_tag *tag,
+        const char *type)
+{
+    struct shared_bound *bound = shared_bound(tag);
+    size_t id = shared_bound_type(bound, type);
+
+    return id != 0 && type_shared_has_a(bound->shared, bound->tag, id);
+}
+
+static void
+shared_bound_acquire(
+        struct type_tag_impl *tti)
+{
+    struct shared_bound *bound = shared_bound(tti->tag);
+    size_t id = shared_bound_known(bound, tti->type);
+
+    tti->impl = shared_acquire(bound->shared, bound->tag, id);
+}
+
+static void
+shared_bound_release(
+        struct type_tag_impl *tti)
+{
+    struct shared_bound *bound = shared_bound(tti->tag);
+    size_t id = shared_bound_known(bound, tti->type);
+
+    shared_release(bound->shared, bound->tag, id);
+    tti->impl = NULL;
+}
+
+static size_t
+shared_bound_acquisitions(
+        struct type_tag_impl *tti)
+{
+    struct shared_bound *bound = shared_bound(tti->tag);
+    size_t id = shared_bound_known(bound, tti->type);
+
+    return shared_acquisitions(bound->shared, bound->tag, id);
+}
+
+static int
+shared_bound_for_each(
+        struct type_tag *tag,
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_tag_impl *tti))
+{
+    struct shared_bound *bound = shared_bound(tag);
+    int status = 0;
+
+    for (size_t i = 0; i < SHARED_TAG_BUCKETS; i++) {
+        size_t offset = __atomic_load_n(&bound->tag->entries[i], __ATOMIC_ACQUIRE);
+
+        while (offset != 0) {
+            struct entry *entry = shared_at(bound->shared, offset);
+
+            if (shared_attached(entry)) {
+                struct type_tag_impl tti = {
+                    .tag = tag,
+                    .type = type_shared_name(bound->shared, entry->type),
+                    .impl = shared_resolve(bound->shared, entry->impl),
+                };
+
+                status = action(self, &tti);
+                if (status != 0) return status;
+            }
+
+            offset = entry->next;
+        }
+    }
+
+    return status;
+}
+
+static const struct type_tag_static_i shared_bound_hooks = {
+    .attachments = shared_bound_attachments,
+    .has_a = shared_bound_has_a,
+    .acquire = shared_bound_acquire,
+    .release = shared_bound_release,
+    .acquisitions = shared_bound_acquisitions,
+    .for_each = shared_bound_for_each,
+};
+
+struct type_tag *
+type_shared_bind(
+        struct type_shared *shared,
+        struct type_shared_tag *tag)
+{
+    size_t offset = shared_bound_offset();
+    void *memory = NULL;
+
+    if (posix_memalign(&memory, type_tag_align(), offset + type_tag_size()) != 0) {
+        stats_throw_str_static(TYPE_SHARED_MAP_FAILED, "Out of memory.");
+    }
+
+    struct shared_bound *bound = memory;
+    bound->shared = shared;
+    bound->tag = tag;
+
+    struct type_tag *local = (struct type_tag *)((char *)memory + offset);
+    type_tag_init(local, &shared_bound_hooks);
+
+    return local;
+}
+
+void
+type_shared_unbind(
+        struct type_tag *tag)
+{
+    type_tag_fini(tag);
+    free(shared_bound(tag));
+}
+
+size_t
+type_shared_memory_usage(
+        struct type_shared *shared)
+{
+    return __atomic_load_n(&shared_segment(shared)->used, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ec/ec.h>
+#include <ecx_stdlib.h>
+
+#include "type.h"
+#include "type_inline.h"
+#include "stats.h"
+#include "probe.h"
+
+/*** Stats ***/
+
+int stats_enabled = 0;
+__thread struct stats_block *stats_local = NULL;
+
+/* All the threads' blocks (plus the totals of exited threads). */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_block *stats_blocks = NULL;
+static struct stats_block stats_retired;
+
+/* Frees the thread's block on exit (keeping its counts). */
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/* Exception kinds counted separately. */
+static const char *const stats_exception_ids[] = {
+    TYPE_TAG_STILL_ATTACHED,
+    TYPE_TAG_ALREADY_ATTACHED,
+    TYPE_TAG_NOT_ATTACHED,
+    TYPE_TAG_IS_STATIC,
+    TYPE_TAG_IS_IMMORTAL,
+    TYPE_TAG_STILL_ACQUIRED,
+    TYPE_TAG_NOT_ACQUIRED,
+    TYPE_TAG_MISMATCH,
+    TYPE_TAG_IMMUTABLE,
+    TYPE_TAG_NOT_SHAPE,
+    TYPE_TAG_CYCLE,
+    TYPE_SUBTYPE_CYCLE,
+    TYPE_DISPATCH_ALREADY_REGISTERED,
+    TYPE_DISPATCH_NOT_REGISTERED,
+    TYPE_DISPATCH_NOT_FOUND,
+    TYPE_DISPATCH_AMBIGUOUS,
+    TYPE_PLUGIN_ALREADY_REGISTERED,
+    TYPE_PLUGIN_NOT_REGISTERED,
+    TYPE_PLUGIN_LOAD_FAILED,
+    TYPE_PLUGIN_BAD_MANIFEST,
+    TYPE_SHARED_MAP_FAILED,
+    TYPE_SHARED_BAD_SEGMENT,
+    TYPE_SHARED_FULL,
+    TYPE_SHARED_NOT_PROVIDED,
+    TYPE_STILL_ATTACHED,
+    TYPE_ALREADY_ATTACHED,
+    TYPE_NOT_ATTACHED,
+    TYPE_STILL_ACQUIRED,
+    TYPE_NOT_ACQUIRED,
+    TYPE_INVALID_ARG,
+    TYPE_MISMATCH,
+    TYPE_MASK_FULL,
+};
+
+#define STATS_EXCEPTION_IDS \
+    (sizeof(stats_exception_ids) / sizeof(stats_exception_ids[0]))
+
+_Static_assert(STATS_EXCEPTION_IDS == STATS_EXCEPTIONS,
+        "STATS_EXCEPTIONS must match the exception kinds listed.");
+
+/* Offsets of the counters in struct type_stats. */
+static const size_t stats_fields[] = {
+    offsetof(struct type_stats, attaches),
+    offsetof(struct type_stats, detaches),
+    offsetof(struct type_stats, acquires),
+    offsetof(struct type_stats, releases),
+    offsetof(struct type_stats, hits),
+    offsetof(struct type_stats, misses),
+    offsetof(struct type_stats, statics),
+    offsetof(struct type_stats, dynamics),
+    offsetof(struct type_stats, exceptions),
+    offsetof(struct type_stats, bloom_probes),
+    offsetof(struct type_stats, bloom_negatives),
+    offsetof(struct type_stats, bloom_false_positives),
+};
+
+#define STATS_FIELDS (sizeof(stats_fields) / sizeof(stats_fields[0]))
+
+/* Returns the counter at the offset. */
+static inline size_t *
+stats_field(
+        struct type_stats *stats,
+        size_t offset)
+{
+    return (size_t *)((char *)stats + offset);
+}
+
+/* Returns the index of the exception kind or STATS_EXCEPTIONS if it isn't
+ * counted separately.
+ */
+static size_t
+stats_exception_index(
+        const char *id)
+{
+    for (size_t i = 0; i < STATS_EXCEPTION_IDS; i++) {
+        if (stats_exception_ids[i] == id) return i;
+    }
+
+    return STATS_EXCEPTIONS;
+}
+
+/* Adds the counts in the block to the totals. */
+static void
+stats_merge(
+        struct stats_block *totals,
+        struct stats_block *block)
+{
+    for (size_t i = 0; i < STATS_FIELDS; i++) {
+        size_t *total = stats_field(&totals->stats, stats_fields[i]);
+        size_t *count = stats_field(&block->stats, stats_fields[i]);
+
+        *total += __atomic_load_n(count, __ATOMIC_RELAXED);
+    }
+
+    for (size_t i = 0; i < STATS_EXCEPTIONS; i++) {
+        totals->exceptions[i] += __atomic_load_n(&block->exceptions[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void
+stats_block_retire(
+        void *arg)
+{
+    struct stats_block *block = arg;
+
+    pthread_mutex_lock(&stats_lock);
+
+    stats_merge(&stats_retired, block);
+
+    for (struct stats_block **link = &stats_blocks;
+         *link != NULL;
+         link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+
+    free(block);
+}
+
+static void
+stats_key_create()
+{
+    pthread_key_create(&stats_key, stats_block_retire);
+}
+
+struct stats_block *
+stats_block_new()
+{
+    pthread_once(&stats_once, stats_key_create);
+
+    struct stats_block *block = ecx_malloc(sizeof(struct stats_block));
+    memset(block, 0, sizeof(struct stats_block));
+
+    pthread_mutex_lock(&stats_lock);
+
+    block->next = stats_blocks;
+    stats_blocks = block;
+
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, block);
+
+    return block;
+}
+
+void
+stats_throwing(
+        const char *id)
+{
+    probe1(throw, id);
+
+    if (!stats_enabled) return;
+
+    struct stats_block *block = stats_block();
+
+    __atomic_store_n(&block->stats.exceptions,
+            block->stats.exceptions + 1, __ATOMIC_RELAXED);
+
+    size_t index = stats_exception_index(id);
+    if (index < STATS_EXCEPTIONS) {
+        __atomic_store_n(&block->exceptions[index],
+                block->exceptions[index] + 1, __ATOMIC_RELAXED);
+    }
+}
+
+void
+type_stats_enable(
+        unsigned int enable)
+{
+    pthread_mutex_lock(&stats_lock);
+
+    /* Counted events can't be inlined. */
+    if (enable && !stats_enabled) {
+        __atomic_add_fetch(&type_inline_bypass, 1, __ATOMIC_RELAXED);
+    }
+    else if (!enable && stats_enabled) {
+        __atomic_sub_fetch(&type_inline_bypass, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&stats_enabled, enable != 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Returns the counts merged over all the threads. */
+static void
+stats_totals(
+        struct stats_block *totals)
+{
+    memset(totals, 0, sizeof(struct stats_block));
+
+    pthread_mutex_lock(&stats_lock);
+
+    stats_merge(totals, &stats_retired);
+
+    for (struct stats_block *block = stats_blocks;
+         block != NULL;
+         block = block->next) {
+        stats_merge(totals, block);
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void
+type_stats_get(
+        struct type_stats *stats)
+{
+    struct stats_block totals;
+    stats_totals(&totals);
+
+    *stats = totals.stats;
+}
+
+size_t
+type_stats_exceptions(
+        const char *id)
+{
+    size_t index = stats_exception_index(id);
+    if (index >= STATS_EXCEPTIONS) return 0;
+
+    struct stats_block totals;
+    stats_totals(&totals);
+
+    return totals.exceptions[index];
+}
+
+void
+type_stats_reset()
+{
+    pthread_mutex_lock(&stats_lock);
+
+    memset(&stats_retired, 0, sizeof(struct stats_block));
+
+    for (struct stats_block *block = stats_blocks;
+         block != NULL;
+         block = block->next) {
+        for (size_t i = 0; i < STATS_FIELDS; i++) {
+            __atomic_store_n(stats_field(&block->stats, stats_fields[i]), 0,
+                    __ATOMIC_RELAXED);
+        }
+
+        for (size_t i = 0; i < STATS_EXCEPTIONS; i++) {
+            __atomic_store_n(&block->exceptions[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,72 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "type.h"
+
+/* Exceptions counted by kind (see type_stats_exceptions(...)). Must match the
+ * number of kinds listed in stats.c.
+ */
+#define STATS_EXCEPTIONS 32
+
+/* Per-thread counters. Only the owning thread writes them, other threads read
+ * them when merging.
+ */
+struct stats_block {
+    struct type_stats stats;
+    size_t exceptions[STATS_EXCEPTIONS];
+    struct stats_block *next;           /* Next thread's block. */
+};
+
+extern int stats_enabled;
+extern __thread struct stats_block *stats_local;
+
+struct stats_block *
+stats_block_new();
+
+/* Returns the calling thread's counters. */
+static inline struct stats_block *
+stats_block()
+{
+    if (stats_local == NULL) {
+        stats_local = stats_block_new();
+    }
+
+    return stats_local;
+}
+
+/* Adds n events to the thread's statistics (and to the tag's statistics if
+ * tag_stats_ isn't NULL). Costs a single branch when disabled. Like a thread's
+ * block, a tag's counts only have one writer (the thread using the tag; frozen
+ * tags shared between threads pass NULL), so neither needs an atomic add.
+ */
+#define stats_add(tag_stats_, field_, n_) \
+    do { \
+        if (__builtin_expect(stats_enabled, 0)) { \
+            struct type_stats *stats_thread_ = &stats_block()->stats; \
+            struct type_stats *stats_tag_ = (tag_stats_); \
+            __atomic_store_n(&stats_thread_->field_, \
+                    stats_thread_->field_ + (n_), __ATOMIC_RELAXED); \
+            if (stats_tag_ != NULL) { \
+                __atomic_store_n(&stats_tag_->field_, \
+                        stats_tag_->field_ + (n_), __ATOMIC_RELAXED); \
+            } \
+        } \
+    } while (0)
+
+#define stats_count(tag_stats_, field_) stats_add(tag_stats_, field_, 1)
+
+/* Counts (and traces) the exception about to be thrown. */
+void
+stats_throwing(
+        const char *id);
+
+/* Count (and trace) the exception, then throw it. Used like ec_throw_str(...)
+ * and ec_throw_str_static(...), e.g. stats_throw_str(ID) msg;
+ */
+#define stats_throw_str(id_) \
+    for (stats_throwing(id_);;) ec_throw_str(id_)
+
+#define stats_throw_str_static(id_, msg_) \
+    for (stats_throwing(id_);;) ec_throw_str_static(id_, msg_)
+
+#endif /* STATS_H */
@@ -1,8 +1,12 @@
 #define _GNU_SOURCE
 
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <ec/ec.h>
 #include <ecx_stdio.h>
@@ -11,6 +15,10 @@
 #include <Judy.h>
 
 #include "type.h"
+#include "type_inline.h"
+#include "stats.h"
+#include "profile.h"
+#include "probe.h"
 
 /*** Type Tag ***/
 
@@ -18,638 +26,5012 @@ const char TYPE_TAG_STILL_ATTACHED[]    = "Type Tag: Still Attached";
 const char TYPE_TAG_ALREADY_ATTACHED[]  = "Type Tag: Already Attached";
 const char TYPE_TAG_NOT_ATTACHED[]      = "Type Tag: Not Attached";
 const char TYPE_TAG_IS_STATIC[]         = "Type Tag: Is Static";
+const char TYPE_TAG_IS_IMMORTAL[]       = "Type Tag: Is Immortal";
 const char TYPE_TAG_STILL_ACQUIRED[]    = "Type Tag: Still Acquired";
 const char TYPE_TAG_NOT_ACQUIRED[]      = "Type Tag: Not Acquired";
 const char TYPE_TAG_MISMATCH[]          = "Type Tag: Mismatch";
+const char TYPE_TAG_IMMUTABLE[]         = "Type Tag: Immutable";
+const char TYPE_TAG_NOT_SHAPE[]         = "Type Tag: Not Shape";
+const char TYPE_TAG_CYCLE[]             = "Type Tag: Cycle";
+
+/* Type tag flags. */
+#define TAG_IMMUTABLE   0x1             /* Attach and detach are rejected. */
+#define TAG_SHAPE       0x2             /* Tag is embedded in a struct shape. */
+#define TAG_BLOOM_STATICS 0x4           /* Static types are in the filter. */
 
 struct type_tag {
+    struct type_inline fast;            /* Must be first (see type_inline.h). */
     struct type_tag_static_i hooks;     /* Hooks for static typing. */
     Pvoid_t type_to_impl;               /* Map from type to implementation. */
+    struct tag_base *base;              /* Map shared with clones (or NULL). */
+    size_t count;                       /* Number of dynamic types attached. */
+    size_t immortals;                   /* Number of them that are immortal. */
+    size_t changes;                     /* Entries not shared with clones. */
+    struct type_tag *parent;            /* Searched for missing types. */
+    size_t children;                    /* Tags with this one as parent. */
+    Word_t generation;                  /* Changes on attach and detach. */
+    struct type_mask mask;              /* Dynamic types with mask IDs. */
+    Word_t mask_generation;             /* Tag generation the mask is for. */
+    Word_t mask_epoch;                  /* Mask IDs epoch the mask is for. */
+    uint64_t bloom[2];                  /* Filter of attached types. */
+    Word_t bloom_generation;            /* Tag generation the filter is for. */
+    size_t bloom_stale;                 /* Types detached since rebuilt. */
+    struct type_stats stats;            /* Counted while stats are enabled. */
+    struct optimistic *optimistic;      /* Optimistic reads (or NULL). */
+    struct frozen *frozen;              /* Lookups once frozen (or NULL). */
+    unsigned int flags;                 /* Type tag flags. */
 };
 
+/* Inlined code reads the struct type_inline at the start of the tag. */
+_Static_assert(offsetof(struct type_tag, fast) == 0,
+        "struct type_inline must be first in struct type_tag.");
+
+/* Implementation record flags. */
+#define IMPL_BORROWED   0x1             /* The impl_detach is owned by a base. */
+#define IMPL_LAZY       0x2             /* The impl is a struct lazy. */
+#define IMPL_IMMORTAL   0x4             /* Acquisitions aren't counted. */
+
 struct impl {
     void *impl;
     void (*impl_detach)(void *impl);
     size_t acquisitions;
+    unsigned int flags;
 };
 
-size_t
-type_tag_size()
+/* Factory for an implementation that hasn't been materialized yet. */
+struct lazy {
+    type_tag_factory_f factory;
+    void *ctx;
+};
+
+/* Copy-on-write map shared between a type tag and its clones. Entries found
+ * in a tag's own map override those in its base (and the base's parent and so
+ * on). Bases are immutable and own the detach callbacks of their records.
+ */
+struct tag_base {
+    size_t refs;                        /* Tags and bases sharing this one. */
+    struct tag_base *parent;            /* Next base to search (or NULL). */
+    Pvoid_t type_to_impl;               /* Map from type to implementation. */
+};
+
+/* Map values are either a pointer to a struct impl record or, for entries
+ * without a detach callback or acquisitions, the implementation pointer itself
+ * with the low bit set. Records are only created when needed (and dropped once
+ * they aren't, see impl_demote(...)). A tag with a base hides the base's
+ * entries for detached types with a tombstone.
+ */
+#define IMPL_DIRECT     ((Word_t)0x1)
+#define IMPL_TOMBSTONE  ((Word_t)0x2)
+
+/* Returns true(1) if the implementation can be stored directly. */
+static inline unsigned int
+impl_can_direct(
+        void *impl,
+        void (*impl_detach)(void *impl))
 {
-    return sizeof (struct type_tag);
+    return impl_detach == NULL && ((Word_t)impl & IMPL_DIRECT) == 0;
 }
 
-size_t
-type_tag_align()
+static inline unsigned int
+impl_is_direct(
+        Word_t value)
 {
-    return __alignof__ (struct type_tag);
+    return (value & IMPL_DIRECT) != 0;
 }
 
-void
-type_tag_init(
-        struct type_tag *tag,
-        const struct type_tag_static_i *hooks)
+/* Returns the implementation stored in the map value (NULL if it hasn't been
+ * materialized yet).
+ */
+static inline void *
+impl_of(
+        Word_t value)
 {
-    /* Copy hooks. */
-    if (hooks != NULL) {
-        tag->hooks = *hooks;
+    if (impl_is_direct(value)) {
+        return (void *)(value & ~IMPL_DIRECT);
     }
-    else {
-        /* Set all static hooks to NULL. */
-        struct type_tag_static_i null_hooks = {
-            .attachments    = NULL,
-            .has_a          = NULL,
 
-            .acquire        = NULL,
-            .release        = NULL,
+    struct impl *impl = (struct impl *)value;
 
-            .acquisitions   = NULL,
-            .for_each       = NULL,
-        };
-        tag->hooks = null_hooks;
+    return (impl->flags & IMPL_LAZY) ? NULL : impl->impl;
+}
+
+/* Returns the implementation of the record, calling its factory first if it
+ * hasn't been materialized yet.
+ */
+static void *
+impl_materialize(
+        struct impl *impl)
+{
+    if (impl->flags & IMPL_LAZY) {
+        struct lazy *lazy = impl->impl;
+
+        impl->impl = lazy->factory(lazy->ctx);
+        impl->flags &= ~IMPL_LAZY;
+
+        free(lazy);
     }
 
-    /* Initialize map (just needs to be NULL). */
-    tag->type_to_impl = NULL;
+    return impl->impl;
 }
 
-void
-type_tag_fini(
-        struct type_tag *tag)
+/* Returns the number of bytes used by the record (if any) for the map value. */
+static inline size_t
+impl_size(
+        Word_t value)
 {
-    /* Ignore null tag. */
-    if (tag == NULL) return;
+    if (value == IMPL_TOMBSTONE || impl_is_direct(value)) return 0;
 
-    /* Check if types are attached. */
-    Word_t count = 0;
-    JLC(count, tag->type_to_impl, 0, -1);
-    if (count != 0) {
-        ec_throw_str_static(TYPE_TAG_STILL_ATTACHED, "Can't finalize, types still attached.");
+    if (((struct impl *)value)->flags & IMPL_LAZY) {
+        return sizeof(struct impl) + sizeof(struct lazy);
     }
 
-    /* Finalize map. */
-    Word_t freed = 0;
-    JLFA(freed, tag->type_to_impl);
+    return sizeof(struct impl);
 }
 
-void
-type_tag_attach(
-        struct type_tag_impl *tti,
-        void (*impl_detach)(void *impl))
+/* Returns the number of acquisitions stored in the map value. */
+static inline size_t
+impl_acquisitions(
+        Word_t value)
 {
-    Pvoid_t *PValue = NULL;
+    if (impl_is_direct(value)) {
+        return 0;
+    }
 
-    struct type_tag *tag = tti->tag;
-    const char *type = tti->type;
+    return ((struct impl *)value)->acquisitions;
+}
 
-    /* Check for existing type implementation. */
-    JLG(PValue, tag->type_to_impl, (Word_t)type);
-    if (PValue != NULL ||
-        (tag->hooks.has_a != NULL &&
-         tag->hooks.has_a(tag, type))) {
-        /* Otherwise fail, implementation already exists. */
-        char *msg = NULL;
-        ecx_asprintf(&msg,
-                "Type implementation for '%s' already attached.", type);
-        ec_throw_str(TYPE_TAG_ALREADY_ATTACHED) msg;
-    }
-    else {
-        struct impl *impl= ecx_malloc(sizeof(struct impl));
+static struct impl *
+impl_new(
+        void *impl,
+        void (*impl_detach)(void *impl),
+        unsigned int flags)
+{
+    struct impl *record = ecx_malloc(sizeof(struct impl));
 
-        impl->impl = tti->impl;
-        impl->impl_detach = impl_detach;
-        impl->acquisitions = 0;
+    record->impl = impl;
+    record->impl_detach = impl_detach;
+    record->acquisitions = 0;
+    record->flags = flags;
 
-        /* Insert new mapping type -> impl. */
-        JLI(PValue, tag->type_to_impl, (Word_t)type);
-        *PValue = impl;
-    }
+    return record;
 }
 
-void
-type_tag_detach(
-        struct type_tag_impl *tti)
+/* Returns the record for the map value, creating it if the value is stored
+ * directly.
+ */
+static struct impl *
+impl_record(
+        Pvoid_t *PValue)
 {
-    Pvoid_t *PValue = NULL;
+    Word_t value = (Word_t)*PValue;
 
-    struct type_tag *tag = tti->tag;
-    const char *type = tti->type;
+    if (!impl_is_direct(value)) {
+        return (struct impl *)value;
+    }
 
-    /* Get implementation. */
-    JLG(PValue, tag->type_to_impl, (Word_t)type);
-    if (PValue == NULL) {
-        /* Is it a static type? */
-        if (tag->hooks.has_a != NULL &&
-            tag->hooks.has_a(tag, type)) {
-            char *msg = NULL;
-            ecx_asprintf(&msg,
-                    "Type implementation for '%s' is static (and cannot be detached).", type);
-            ec_throw_str(TYPE_TAG_IS_STATIC) msg;
+    struct impl *impl = impl_new(impl_of(value), NULL, 0);
+    *PValue = impl;
+
+    return impl;
+}
+
+/* Adds the acquisitions made inline (see type_inline.h) to the records, so the
+ * library's counts are complete. Called before the library looks at (or
+ * changes) the tag's acquisitions.
+ */
+static inline void
+tag_inline_flush(
+        struct type_tag *tag)
+{
+    for (unsigned int i = 0; i < TYPE_INLINE_SLOTS; i++) {
+        struct type_inline_slot *slot = &tag->fast.slots[i];
+
+        if (slot->acquisitions != 0) {
+            ((struct impl *)slot->record)->acquisitions += slot->acquisitions;
+            slot->acquisitions = 0;
         }
-        else {
-            /* Otherwise fail, implementation not attached. */
-            char *msg = NULL;
-            ecx_asprintf(&msg,
-                    "Type implementation for '%s' not attached.", type);
-            ec_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+    }
+}
+
+/* Drops the type from the inline cache (its inline acquisitions must have
+ * been flushed).
+ */
+static inline void
+tag_inline_drop(
+        struct type_tag *tag,
+        const char *type)
+{
+    for (unsigned int i = 0; i < TYPE_INLINE_SLOTS; i++) {
+        if (tag->fast.slots[i].type == type) {
+            memset(&tag->fast.slots[i], 0, sizeof(struct type_inline_slot));
         }
     }
+}
 
-    struct impl *impl = *PValue;
+/* Stores the record's implementation directly again once the record isn't
+ * needed (no acquisitions, detach callback or flags). Only the tag's own map is
+ * changed and only while no other tag can resolve to the record (the tag has
+ * no parent or children), so the inline slots are the only other place
+ * referring to it.
+ */
+static void
+impl_demote(
+        struct type_tag *tag,
+        const char *type,
+        struct impl *impl)
+{
+    if (impl->acquisitions != 0 ||
+        impl->flags != 0 ||
+        !impl_can_direct(impl->impl, impl->impl_detach) ||
+        tag->parent != NULL ||
+        tag->children != 0) {
+        return;
+    }
 
-    /* Outstanding acquisitions? */
-    if (impl->acquisitions != 0) {
-        char *msg = NULL;
+    Pvoid_t *PValue = NULL;
+    JLG(PValue, tag->type_to_impl, (Word_t)type);
+    if (PValue == NULL || *PValue != impl) return;
 
-        /* Choose correct numbering. */
-        const char *acq = NULL;
-        const char acq1[] = "acquisition remains";
-        const char acq2[] = "acquisitions remain";
-        acq = impl->acquisitions == 1 ? acq1 : acq2;
+    tag_inline_drop(tag, type);
 
-        ecx_asprintf(&msg, "Can't detach because %zi %s.",
-                impl->acquisitions, acq);
-        ec_throw_str(TYPE_TAG_STILL_ACQUIRED) msg;
-    }
+    *PValue = (void *)((Word_t)impl->impl | IMPL_DIRECT);
+    free(impl);
+}
 
-    /* Provided impl pointer doesn't match attached. */
-    if (tti->impl != NULL && tti->impl != impl->impl) {
-        ec_throw_str_static(TYPE_TAG_MISMATCH,
-                "Implementation provided doesn't match currently attached.");
-    }
+/* Returns true(1) if the map value is an immortal record. */
+static inline unsigned int
+impl_is_immortal(
+        Word_t value)
+{
+    return value != IMPL_TOMBSTONE &&
+           !impl_is_direct(value) &&
+           (((struct impl *)value)->flags & IMPL_IMMORTAL);
+}
 
-    /* Remove type -> impl mapping. */
-    int status = 0;
-    JLD(status, tag->type_to_impl, (Word_t)type);
+/* Frees the record (if any) for the map value. If detach is true(1), then the
+ * detach callback is called for owned records that were materialized.
+ */
+static void
+impl_free(
+        Word_t value,
+        unsigned int detach)
+{
+    if (value == IMPL_TOMBSTONE || impl_is_direct(value)) return;
 
+    struct impl *impl = (struct impl *)value;
+
+    /* Never materialized, so only the factory to free. */
+    if (impl->flags & IMPL_LAZY) {
+        free(impl->impl);
+    }
     /* Call detach callback. */
-    if (impl->impl_detach != NULL) {
+    else if (detach &&
+             impl->impl_detach != NULL &&
+             !(impl->flags & IMPL_BORROWED)) {
         impl->impl_detach(impl->impl);
     }
 
     /* Free the implementation. */
     free(impl);
-
-    /* If all the tags are removed, then free the mapping. */
-    if (type_tag_attachments(tag) == 0) {
-        free(tag->type_to_impl);
-        tag->type_to_impl = NULL;
-    }
 }
 
-void
-type_tag_detach_all(
-        struct type_tag *tag)
+/* Drops a reference to the base, freeing it (and calling the detach callbacks
+ * of its records) if it was the last.
+ */
+static void
+base_release(
+        struct tag_base *base)
 {
-    Pvoid_t *PValue = NULL;
-    Word_t Index = 0;
+    while (base != NULL && --base->refs == 0) {
+        Pvoid_t *PValue = NULL;
+        Word_t Index = 0;
 
-    const char *type = NULL;
-    struct impl *impl = NULL;
+        JLF(PValue, base->type_to_impl, Index);
 
-    /* Get first type implementation. */
-    JLF(PValue, tag->type_to_impl, Index);
+        while (PValue != NULL) {
+            impl_free((Word_t)*PValue, 1);
 
-    while (PValue != NULL) {
-        type = (const char *)Index;
-        impl = *PValue;
+            JLN(PValue, base->type_to_impl, Index);
+        }
 
-        /* Detach type implementation. */
-        struct type_tag_impl tti = {
-            .tag = tag,
-            .type = type,
-            .impl = impl->impl,
-        };
-        type_tag_detach(&tti);
+        Word_t freed = 0;
+        JLFA(freed, base->type_to_impl);
 
-        /* Get next type implementation. */
-        JLN(PValue, tag->type_to_impl, Index);
+        struct tag_base *parent = base->parent;
+        free(base);
+        base = parent;
     }
 }
 
-unsigned int
-type_tag_is_static(
-        struct type_tag *tag,
+/* Returns the map value for the type from the base chain or NULL if the type
+ * is NOT attached.
+ */
+static Pvoid_t *
+base_get(
+        struct tag_base *base,
         const char *type)
 {
-    if (tag->hooks.has_a != NULL &&
-        tag->hooks.has_a(tag, type)) {
-        return 1;
+    Pvoid_t *PValue = NULL;
+
+    for (; base != NULL; base = base->parent) {
+        JLG(PValue, base->type_to_impl, (Word_t)type);
+        if (PValue != NULL) {
+            return (Word_t)*PValue == IMPL_TOMBSTONE ? NULL : PValue;
+        }
     }
 
-    return 0;
+    return NULL;
 }
 
-size_t
-type_tag_attachments(
-        struct type_tag *tag)
+/* Removes the type from the bases that aren't shared (with any other tag or
+ * base), calling the detach callbacks of their records. Returns true(1) if the
+ * type is no longer attached in the base chain.
+ */
+static unsigned int
+base_remove(
+        struct tag_base *base,
+        const char *type)
 {
-    size_t attachments = 0;
+    for (; base != NULL; base = base->parent) {
+        if (base->refs != 1) {
+            return base_get(base, type) == NULL;
+        }
 
-    /* Get dynamic type count. */
-    JLC(attachments, tag->type_to_impl, 0, -1);
+        Pvoid_t *PValue = NULL;
+        JLG(PValue, base->type_to_impl, (Word_t)type);
+        if (PValue == NULL) continue;
 
-    /* Add static types. */
-    if (tag->hooks.attachments != NULL) {
-        attachments += tag->hooks.attachments(tag);
+        /* Keep hiding the entries further down. */
+        Word_t value = (Word_t)*PValue;
+        if (value == IMPL_TOMBSTONE) return 1;
+
+        int status = 0;
+        JLD(status, base->type_to_impl, (Word_t)type);
+
+        impl_free(value, 1);
     }
 
-    return attachments;
+    return 1;
 }
 
-unsigned int
-type_tag_has_a(
+/* Returns the map value for the dynamic type or NULL if the type is NOT
+ * attached. The value may belong to a base and must not be modified.
+ */
+static Pvoid_t *
+tag_get(
         struct type_tag *tag,
         const char *type)
 {
-    /* Is it a static type? */
-    if (tag->hooks.has_a != NULL &&
-        tag->hooks.has_a(tag, type)) {
-        return 1;
-    }
-
-    /* Check dynamic types. */
     Pvoid_t *PValue = NULL;
     JLG(PValue, tag->type_to_impl, (Word_t)type);
 
     if (PValue != NULL) {
-        return 1;
+        return (Word_t)*PValue == IMPL_TOMBSTONE ? NULL : PValue;
     }
 
-    return 0;
+    return base_get(tag->base, type);
 }
 
-void
-type_tag_acquire(
-        struct type_tag_impl *tti)
+/* Like tag_get(...), but entries found in a base are first copied into the
+ * tag's own map (as borrowed records) so they can be modified.
+ */
+static Pvoid_t *
+tag_get_own(
+        struct type_tag *tag,
+        const char *type)
 {
-    struct type_tag *tag = tti->tag;
-    const char *type = tti->type;
+    Pvoid_t *PValue = NULL;
+    JLG(PValue, tag->type_to_impl, (Word_t)type);
 
-    /* Look for static types first. */
-    if (tag->hooks.has_a != NULL &&
-        tag->hooks.acquire != NULL &&
-        tag->hooks.has_a(tag, type) != 0) {
-        return tag->hooks.acquire(tti);
+    if (PValue != NULL) {
+        return (Word_t)*PValue == IMPL_TOMBSTONE ? NULL : PValue;
     }
 
-    /* Look for dynamic types. */
-    Pvoid_t *PValue = NULL;
-    JLG(PValue, tag->type_to_impl, (Word_t)type);
-    if (PValue == NULL) {
-        char *msg = NULL;
-        ecx_asprintf(&msg,
-                "Type implementation for '%s' not attached.", type);
-        ec_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+    Pvoid_t *PBase = base_get(tag->base, type);
+    if (PBase == NULL) {
+        return NULL;
+    }
+
+    /* Materialize in the base, so it's shared with the clones. */
+    void *value = *PBase;
+    if (!impl_is_direct((Word_t)value)) {
+        impl_materialize(value);
+    }
+
+    unsigned int flags = IMPL_BORROWED;
+    if (impl_is_immortal((Word_t)*PBase)) {
+        flags |= IMPL_IMMORTAL;
     }
 
-    struct impl *impl = *PValue;
-    impl->acquisitions++;
+    struct impl *impl = impl_new(impl_of((Word_t)*PBase), NULL, flags);
+
+    JLI(PValue, tag->type_to_impl, (Word_t)type);
+    *PValue = impl;
 
-    tti->impl = impl->impl;
+    return PValue;
 }
 
-void
-type_tag_release(
-        struct type_tag_impl *tti)
+/* Returns the map value for the next dynamic type after *Index (or at *Index
+ * if first is true(1)) and updates *Index. Returns NULL if there are no more.
+ */
+static Pvoid_t *
+tag_next(
+        struct type_tag *tag,
+        Word_t *Index,
+        unsigned int first)
 {
-    struct type_tag *tag = tti->tag;
-    const char *type = tti->type;
+    Pvoid_t *PValue = NULL;
 
-    /* Look for static types first. */
-    if (tag->hooks.has_a != NULL &&
-        tag->hooks.release != NULL &&
-        tag->hooks.has_a(tag, type) != 0) {
-        tag->hooks.release(tti);
-        return;
-    }
+    /* Only the tag's own map to search. */
+    if (tag->base == NULL) {
+        if (first) {
+            JLF(PValue, tag->type_to_impl, *Index);
+        }
+        else {
+            JLN(PValue, tag->type_to_impl, *Index);
+        }
 
-    /* Look for dynamic types. */
-    Pvoid_t *PValue = NULL;
-    JLG(PValue, tag->type_to_impl, (Word_t)type);
-    if (PValue == NULL) {
-        char *msg = NULL;
-        ecx_asprintf(&msg,
-                "Type implementation for '%s' not attached.", type);
-        ec_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+        return PValue;
     }
 
-    struct impl *impl = *PValue;
+    for (;;) {
+        /* Find the smallest next type in any of the maps. */
+        Pvoid_t map = tag->type_to_impl;
+        struct tag_base *base = tag->base;
 
-    /* Provided impl pointer doesn't match attached. */
-    if (tti->impl != NULL && tti->impl != impl->impl) {
-        ec_throw_str_static(TYPE_TAG_MISMATCH,
-                "Implementation provided doesn't match currently attached.");
-    }
+        unsigned int found = 0;
+        Word_t next = 0;
 
-    if (impl->acquisitions == 0) {
-        ec_throw_str_static(TYPE_TAG_NOT_ACQUIRED, "No outstanding acquisitions to release.");
-    }
+        for (;;) {
+            Word_t Try = *Index;
 
-    tti->impl = NULL;
-    impl->acquisitions--;
+            if (first) {
+                JLF(PValue, map, Try);
+            }
+            else {
+                JLN(PValue, map, Try);
+            }
+
+            if (PValue != NULL && (!found || Try < next)) {
+                found = 1;
+                next = Try;
+            }
+
+            if (base == NULL) break;
+
+            map = base->type_to_impl;
+            base = base->parent;
+        }
+
+        if (!found) return NULL;
+
+        *Index = next;
+        first = 0;
+
+        /* Skip detached types. */
+        PValue = tag_get(tag, (const char *)next);
+        if (PValue != NULL) return PValue;
+    }
 }
 
-size_t
-type_tag_acquisitions(
-        struct type_tag_impl *tti)
+/* Records a change in the record's acquisitions. */
+static inline void
+tag_acquired(
+        struct type_tag *tag,
+        struct impl *impl,
+        int delta)
 {
-    struct type_tag *tag = tti->tag;
-    const char *type = tti->type;
+    tag_inline_flush(tag);
 
-    /* Is it a static type? */
+    if (delta > 0) {
+        if (impl->acquisitions++ == 0) tag->fast.acquired++;
+    }
+    else {
+        if (--impl->acquisitions == 0) tag->fast.acquired--;
+    }
+}
+
+/* Source of type tag generations (shared by all threads). Generations are
+ * unique, so a tag reinitialized at the same address never repeats one.
+ */
+static Word_t generations = 0;
+
+/* Returns the tag's counts to add events to (see stats_add(...)) or NULL if
+ * they're only counted per thread. Frozen tags are shared between threads, so
+ * nothing is written to them (their counts stay as they were when frozen).
+ */
+static inline struct type_stats *
+tag_stats(
+        struct type_tag *tag)
+{
+    return tag->frozen != NULL ? NULL : &tag->stats;
+}
+
+/* Generation of the parent chains. Changes whenever a tag with children
+ * changes.
+ */
+static Word_t chain_generation = 0;
+
+static inline Word_t
+generation_next()
+{
+    return __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+}
+
+/* Records a change in the tag's types (invalidating cached resolutions). */
+static inline void
+tag_changed(
+        struct type_tag *tag)
+{
+    tag->generation = generation_next();
+
+    tag_inline_flush(tag);
+    memset(tag->fast.slots, 0, sizeof(tag->fast.slots));
+    tag->fast.next = 0;
+
+    if (tag->children != 0) {
+        __atomic_store_n(&chain_generation, tag->generation, __ATOMIC_RELAXED);
+    }
+}
+
+/* Copy of a tag's types for optimistic readers. Mirrors are immutable once
+ * published. Replaced mirrors are retired and only freed by a change made
+ * once no reader has one as its hazard, so readers never read freed memory.
+ */
+struct mirror_entry {
+    const char *type;
+    void *impl;
+};
+
+struct mirror {
+    struct mirror *retired;             /* The mirror this one replaced. */
+    size_t count;
+    struct mirror_entry entries[];      /* Sorted by type. */
+};
+
+struct optimistic {
+    Word_t sequence;                    /* Odd while the tag is changing. */
+    struct mirror *mirror;              /* The current mirror. */
+};
+
+/* A thread's hazard: the mirror it is searching (or NULL). Only the thread
+ * writes it, writers of tags only read it. Readers are padded apart, so the
+ * stores don't share lines.
+ */
+struct reader {
+    struct reader *next;
+    struct mirror *hazard;
+    char pad[64 - 2 * sizeof(void *)];
+};
+
+/* Every thread that has read optimistically (readers_lock guards the list,
+ * not the hazards).
+ */
+static struct reader *readers = NULL;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Unlinks a thread's reader when the thread exits. */
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static __thread struct reader *reader = NULL;
+
+static void
+reader_exit(
+        void *self)
+{
+    pthread_mutex_lock(&readers_lock);
+
+    struct reader **link = &readers;
+    while (*link != self) link = &(*link)->next;
+    *link = ((struct reader *)self)->next;
+
+    pthread_mutex_unlock(&readers_lock);
+
+    free(self);
+}
+
+static void
+reader_key_create()
+{
+    pthread_key_create(&reader_key, reader_exit);
+}
+
+/* Returns the thread's reader (registering it on the first read). */
+static inline struct reader *
+reader_get()
+{
+    if (reader != NULL) return reader;
+
+    struct reader *self = ecx_malloc(sizeof(struct reader));
+    self->hazard = NULL;
+
+    pthread_mutex_lock(&readers_lock);
+    self->next = readers;
+    readers = self;
+    pthread_mutex_unlock(&readers_lock);
+
+    pthread_once(&reader_once, reader_key_create);
+    pthread_setspecific(reader_key, self);
+
+    return reader = self;
+}
+
+/* Returns 1 if a reader is searching the mirror (readers_lock must be held). */
+static unsigned int
+mirror_hazardous(
+        struct mirror *mirror)
+{
+    for (struct reader *r = readers; r != NULL; r = r->next) {
+        if (__atomic_load_n(&r->hazard, __ATOMIC_SEQ_CST) == mirror) return 1;
+    }
+
+    return 0;
+}
+
+/* Marks the start of a change to an optimistically read tag. Must come before
+ * anything a reader could be using is freed.
+ */
+static inline void
+tag_write_begin(
+        struct type_tag *tag)
+{
+    struct optimistic *optimistic = tag->optimistic;
+    if (optimistic == NULL) return;
+
+    __atomic_store_n(&optimistic->sequence, optimistic->sequence + 1,
+            __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Returns a new mirror of the tag's dynamic types. */
+static struct mirror *
+mirror_new(
+        struct type_tag *tag)
+{
+    struct mirror *mirror = ecx_malloc(
+            sizeof(struct mirror) + tag->count * sizeof(struct mirror_entry));
+    mirror->retired = NULL;
+    mirror->count = 0;
+
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    PValue = tag_next(tag, &Index, 1);
+
+    while (PValue != NULL && mirror->count < tag->count) {
+        Word_t value = (Word_t)*PValue;
+
+        /* Readers can't materialize implementations. */
+        if (!impl_is_direct(value)) {
+            impl_materialize((struct impl *)value);
+        }
+
+        struct mirror_entry *entry = &mirror->entries[mirror->count++];
+        entry->type = (const char *)Index;
+        entry->impl = impl_of(value);
+
+        PValue = tag_next(tag, &Index, 0);
+    }
+
+    return mirror;
+}
+
+/* Marks the end of a change to an optimistically read tag (publishing its new
+ * types).
+ */
+static inline void
+tag_write_end(
+        struct type_tag *tag)
+{
+    struct optimistic *optimistic = tag->optimistic;
+    if (optimistic == NULL) return;
+
+    struct mirror *mirror = mirror_new(tag);
+    mirror->retired = optimistic->mirror;
+
+    __atomic_store_n(&optimistic->mirror, mirror, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&optimistic->sequence, optimistic->sequence + 1,
+            __ATOMIC_RELEASE);
+
+    /* Readers set their hazard before they check the mirror is current, so
+     * any mirror not a hazard now is never searched again.
+     */
+    pthread_mutex_lock(&readers_lock);
+
+    struct mirror **link = &mirror->retired;
+    while (*link != NULL) {
+        struct mirror *retired = *link;
+
+        if (mirror_hazardous(retired)) {
+            link = &retired->retired;
+        }
+        else {
+            *link = retired->retired;
+            free(retired);
+        }
+    }
+
+    pthread_mutex_unlock(&readers_lock);
+}
+
+/* Copy of a frozen tag's types in Eytzinger order (the children of entry k are
+ * 2k and 2k + 1, entry 0 is unused), so lookups walk down from the start of
+ * the array. Entries are cache line aligned.
+ */
+struct frozen_entry {
+    const char *type;
+    void *impl;
+};
+
+struct frozen {
+    void *memory;                       /* Allocation holding the entries. */
+    size_t count;
+    struct frozen_entry *entries;
+};
+
+#define FROZEN_ALIGN 64
+
+/* Fills out[k] (and its children) from sorted[i...]. Returns the next i. */
+static size_t
+frozen_fill(
+        struct frozen_entry *out,
+        const struct frozen_entry *sorted,
+        size_t i,
+        size_t k,
+        size_t count)
+{
+    if (k <= count) {
+        i = frozen_fill(out, sorted, i, 2 * k, count);
+        out[k] = sorted[i++];
+        i = frozen_fill(out, sorted, i, 2 * k + 1, count);
+    }
+
+    return i;
+}
+
+/* Returns the frozen entry for the type (or NULL). */
+static inline struct frozen_entry *
+frozen_find(
+        struct frozen *frozen,
+        const char *type)
+{
+    struct frozen_entry *entries = frozen->entries;
+    size_t k = 1;
+
+    while (k <= frozen->count) {
+        /* Four levels down fit in one line. */
+        __builtin_prefetch(&entries[16 * k]);
+
+        if (entries[k].type == type) {
+            return &entries[k];
+        }
+
+        k = 2 * k + ((Word_t)entries[k].type < (Word_t)type);
+    }
+
+    return NULL;
+}
+
+/* Types with IDs for use in masks (shared by all threads). IDs are looked up
+ * without the lock: slots are only ever filled, and the ID is stored before
+ * the type is published.
+ */
+#define MASK_SLOTS (2 * TYPE_MASK_BITS)
+
+static pthread_mutex_t mask_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *mask_types[MASK_SLOTS];  /* Open addressed by type. */
+static unsigned int mask_slot_ids[MASK_SLOTS];
+static const char *id_to_type[TYPE_MASK_BITS];
+static unsigned int mask_ids = 0;
+static Word_t mask_epoch = 0;           /* Changes when an ID is assigned. */
+
+/* Returns the type's slot in mask_types (or the empty slot it would use). */
+static unsigned int
+mask_slot(
+        const char *type)
+{
+    uint64_t hash = (Word_t)type * UINT64_C(0x9E3779B97F4A7C15);
+    unsigned int slot = (hash >> 32) % MASK_SLOTS;
+
+    for (;;) {
+        const char *found = __atomic_load_n(&mask_types[slot], __ATOMIC_ACQUIRE);
+        if (found == type || found == NULL) return slot;
+
+        slot = (slot + 1) % MASK_SLOTS;
+    }
+}
+
+/* Returns the type's mask ID or TYPE_MASK_BITS if it doesn't have one. If
+ * assign is true(1), then types without one are given the next free ID. Only
+ * type_mask_add(...) assigns IDs, so tags don't use up IDs for types nobody
+ * filters on.
+ */
+static unsigned int
+mask_id(
+        const char *type,
+        unsigned int assign)
+{
+    unsigned int slot = mask_slot(type);
+    if (__atomic_load_n(&mask_types[slot], __ATOMIC_ACQUIRE) == type) {
+        return mask_slot_ids[slot];
+    }
+
+    if (!assign) return TYPE_MASK_BITS;
+
+    unsigned int id = TYPE_MASK_BITS;
+
+    pthread_mutex_lock(&mask_lock);
+
+    /* Another thread may have assigned it meanwhile. */
+    slot = mask_slot(type);
+
+    if (mask_types[slot] == type) {
+        id = mask_slot_ids[slot];
+    }
+    else if (mask_ids < TYPE_MASK_BITS) {
+        id = mask_ids++;
+        id_to_type[id] = type;
+
+        mask_slot_ids[slot] = id;
+        __atomic_store_n(&mask_types[slot], type, __ATOMIC_RELEASE);
+
+        /* Masks built before lack the bit for the type. */
+        __atomic_add_fetch(&mask_epoch, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&mask_lock);
+
+    return id;
+}
+
+static inline void
+mask_set(
+        struct type_mask *mask,
+        unsigned int id)
+{
+    mask->bits[id / 64] |= UINT64_C(1) << (id % 64);
+}
+
+static inline void
+mask_unset(
+        struct type_mask *mask,
+        unsigned int id)
+{
+    mask->bits[id / 64] &= ~(UINT64_C(1) << (id % 64));
+}
+
+/* Returns the tag's mask (rebuilding it if the tag or the mask IDs changed
+ * since). Frozen tags are only read, so if scratch is not NULL, then their
+ * stale mask is rebuilt in it instead.
+ */
+static const struct type_mask *
+tag_mask(
+        struct type_tag *tag,
+        struct type_mask *scratch)
+{
+    Word_t epoch = __atomic_load_n(&mask_epoch, __ATOMIC_ACQUIRE);
+
+    if (tag->mask_generation == tag->generation && tag->mask_epoch == epoch) {
+        return &tag->mask;
+    }
+
+    struct type_mask *mask = &tag->mask;
+    if (tag->frozen != NULL && scratch != NULL) {
+        mask = scratch;
+    }
+
+    memset(mask, 0, sizeof(struct type_mask));
+
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    PValue = tag_next(tag, &Index, 1);
+
+    while (PValue != NULL) {
+        unsigned int id = mask_id((const char *)Index, 0);
+        if (id < TYPE_MASK_BITS) {
+            mask_set(mask, id);
+        }
+
+        PValue = tag_next(tag, &Index, 0);
+    }
+
+    if (mask == &tag->mask) {
+        tag->mask_generation = tag->generation;
+        tag->mask_epoch = epoch;
+    }
+
+    return mask;
+}
+
+/* Updates the tag's mask (if it was valid for the previous generation) for
+ * the type just attached (set is true(1)) or detached.
+ */
+static void
+tag_mask_update(
+        struct type_tag *tag,
+        Word_t previous,
+        const char *type,
+        unsigned int set)
+{
+    if (tag->mask_generation != previous) return;
+
+    unsigned int id = mask_id(type, 0);
+    if (id < TYPE_MASK_BITS) {
+        if (set) {
+            mask_set(&tag->mask, id);
+        }
+        else {
+            mask_unset(&tag->mask, id);
+        }
+    }
+
+    tag->mask_generation = tag->generation;
+}
+
+/* Sets the type's bits in the filter. */
+static inline void
+bloom_add(
+        uint64_t bloom[2],
+        const char *type)
+{
+    uint64_t hash = (Word_t)type * UINT64_C(0x9E3779B97F4A7C15);
+
+    unsigned int a = hash >> 57;
+    unsigned int b = (hash >> 50) & 127;
+
+    bloom[a / 64] |= UINT64_C(1) << (a % 64);
+    bloom[b / 64] |= UINT64_C(1) << (b % 64);
+}
+
+/* Returns 0 if the type is definitely NOT in the filter. */
+static inline unsigned int
+bloom_test(
+        const uint64_t bloom[2],
+        const char *type)
+{
+    uint64_t hash = (Word_t)type * UINT64_C(0x9E3779B97F4A7C15);
+
+    unsigned int a = hash >> 57;
+    unsigned int b = (hash >> 50) & 127;
+
+    return (bloom[a / 64] >> (a % 64)) & (bloom[b / 64] >> (b % 64)) & 1;
+}
+
+/* Adds the static type to the filter (see tag_bloom_build(...)). */
+static int
+bloom_add_static(
+        void *self,
+        struct type_tag_impl *tti)
+{
+    bloom_add(self, tti->type);
+    return 0;
+}
+
+/* Rebuilds the tag's filter from its dynamic types. Static types are only in
+ * the filter if the tag opted in (see type_tag_bloom_statics(...)), since the
+ * hooks may answer for types they don't list.
+ */
+static void
+tag_bloom_build(
+        struct type_tag *tag)
+{
+    tag->bloom[0] = tag->bloom[1] = 0;
+
+    if (tag->flags & TAG_BLOOM_STATICS) {
+        tag->hooks.for_each(tag, tag->bloom, bloom_add_static);
+    }
+
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    PValue = tag_next(tag, &Index, 1);
+
+    while (PValue != NULL) {
+        bloom_add(tag->bloom, (const char *)Index);
+
+        PValue = tag_next(tag, &Index, 0);
+    }
+
+    tag->bloom_generation = tag->generation;
+    tag->bloom_stale = 0;
+}
+
+/* Returns 0 if the type is definitely NOT dynamically attached to the tag
+ * itself (nor statically, if the tag's static types are in the filter).
+ * Rebuilds the filter if the tag changed since (frozen tags' never change).
+ */
+static unsigned int
+tag_bloom_test(
+        struct type_tag *tag,
+        const char *type)
+{
+    if (tag->frozen == NULL &&
+        tag->bloom_generation != tag->generation) {
+        tag_bloom_build(tag);
+    }
+
+    stats_count(tag_stats(tag), bloom_probes);
+
+    if (!bloom_test(tag->bloom, type)) {
+        stats_count(tag_stats(tag), bloom_negatives);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Returns 1 if the static hooks need to be asked about the type (i.e. it may
+ * be static), given what the filter said.
+ */
+static inline unsigned int
+tag_maybe_static(
+        struct type_tag *tag,
+        unsigned int maybe)
+{
+    return tag->hooks.has_a != NULL &&
+        (maybe || !(tag->flags & TAG_BLOOM_STATICS));
+}
+
+/* Updates the tag's filter (if it was valid for the previous generation) for
+ * the type just attached (set is true(1)) or detached. Detached types stay in
+ * the filter until enough have built up to make rebuilding worthwhile.
+ */
+static void
+tag_bloom_update(
+        struct type_tag *tag,
+        Word_t previous,
+        const char *type,
+        unsigned int set)
+{
+    if (tag->bloom_generation != previous) return;
+
+    if (set) {
+        bloom_add(tag->bloom, type);
+    }
+    else if (++tag->bloom_stale > tag->count) {
+        return;
+    }
+
+    tag->bloom_generation = tag->generation;
+}
+
+/* Per-thread reverse index from types to tags and from tags to data (see
+ * type_index_enable(...)). Only maintained while enabled.
+ */
+__thread unsigned int index_enabled = 0;
+__thread Pvoid_t index_tags = NULL;     /* Set (Judy1) of indexed tags. */
+__thread Pvoid_t type_to_tags = NULL;   /* Map from type to set of tags. */
+__thread Pvoid_t tag_to_data = NULL;    /* Map from tag to set of data. */
+
+/* Adds the member to the key's set in the map. */
+static void
+index_set(
+        Pvoid_t *map,
+        Word_t key,
+        Word_t member)
+{
+    Pvoid_t *PSet = NULL;
+    JLI(PSet, *map, key);
+
+    int status = 0;
+    J1S(status, *PSet, member);
+}
+
+/* Removes the member from the key's set in the map. */
+static void
+index_unset(
+        Pvoid_t *map,
+        Word_t key,
+        Word_t member)
+{
+    Pvoid_t *PSet = NULL;
+    JLG(PSet, *map, key);
+
+    if (PSet == NULL) return;
+
+    int status = 0;
+    J1U(status, *PSet, member);
+
+    if (*PSet == NULL) {
+        JLD(status, *map, key);
+    }
+}
+
+/* Adds the tag's current types to the index (unless it's already indexed). */
+static void
+index_tag(
+        struct type_tag *tag)
+{
+    int status = 0;
+    J1S(status, index_tags, (Word_t)tag);
+
+    if (status == 0) return;
+
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    PValue = tag_next(tag, &Index, 1);
+
+    while (PValue != NULL) {
+        index_set(&type_to_tags, Index, (Word_t)tag);
+
+        PValue = tag_next(tag, &Index, 0);
+    }
+}
+
+/* Frees the sets in the map and the map. */
+static void
+index_free(
+        Pvoid_t *map)
+{
+    Pvoid_t *PSet = NULL;
+    Word_t Index = 0;
+
+    JLF(PSet, *map, Index);
+
+    while (PSet != NULL) {
+        Word_t freed = 0;
+        J1FA(freed, *PSet);
+
+        JLN(PSet, *map, Index);
+    }
+
+    Word_t freed = 0;
+    JLFA(freed, *map);
+}
+
+/* Adds the memory used by the sets in the map and the map to used. */
+static void
+index_memory_usage(
+        Pvoid_t map,
+        size_t *used)
+{
+    Pvoid_t *PSet = NULL;
+    Word_t Index = 0;
+    Word_t set = 0;
+
+    JLF(PSet, map, Index);
+
+    while (PSet != NULL) {
+        J1MU(set, *PSet);
+        *used += set;
+
+        JLN(PSet, map, Index);
+    }
+
+    JLMU(set, map);
+    *used += set;
+}
+
+/* Returns the slot for the tag and type in a per-thread cache with the given
+ * number of slots.
+ */
+static inline size_t
+cache_slot(
+        const struct type_tag *tag,
+        const char *type,
+        size_t slots)
+{
+    Word_t hash = ((Word_t)tag >> 4) * 31 + ((Word_t)type >> 3);
+    return (hash ^ (hash >> 8)) % slots;
+}
+
+/* Cached resolution of a type through a tag's parents. Resolutions are cached
+ * per thread, so resolving never writes to (or allocates in) tags that may be
+ * shared between threads. Generations are never reused, so a stale entry for a
+ * finalized tag can't match a new tag at the same address.
+ */
+struct resolution {
+    struct type_tag *tag;               /* Tag resolved through. */
+    const char *type;                   /* Type resolved. */
+    Word_t generation;                  /* Tag generation when resolved. */
+    Word_t chain;                       /* Chain generation when resolved. */
+    struct type_tag *owner;             /* Tag the type is attached to. */
+};
+
+#define RESOLVE_CACHE 256
+
+static __thread struct resolution resolutions[RESOLVE_CACHE];
+
+/* Cached most specific attached subtype of a type. Like resolutions, these are
+ * cached per thread.
+ */
+struct specific {
+    struct type_tag *tag;               /* Tag resolved for. */
+    const char *super;                  /* Type resolved. */
+    Word_t generation;                  /* Tag generation when resolved. */
+    Word_t chain;                       /* Chain generation when resolved. */
+    Word_t relation;                    /* Subtype generation when resolved. */
+    const char *type;                   /* Most specific attached subtype. */
+};
+
+#define SPECIFIC_CACHE 64
+
+static __thread struct specific specifics[SPECIFIC_CACHE];
+
+/* Resolves the dynamic type through the tag and its parents (the tag's own
+ * static types must already have been checked). Returns the owner's map value
+ * and sets *owner. If own is true(1), then the value is the owner's own (see
+ * tag_get_own(...)), otherwise it may belong to a base and must not be
+ * modified. If a parent has the type statically attached (or is frozen with it
+ * attached), then NULL is returned and *owner is set to that parent. If no tag
+ * has the type attached, then NULL is returned and *owner is set to NULL.
+ *
+ * The owner is cached (per thread) until the tag or any tag with children
+ * changes, so in the steady state this costs two lookups.
+ */
+static Pvoid_t *
+tag_resolve(
+        struct type_tag *tag,
+        const char *type,
+        int own,
+        struct type_tag **owner)
+{
+    Word_t chain = __atomic_load_n(&chain_generation, __ATOMIC_RELAXED);
+
+    struct resolution *resolution =
+        &resolutions[cache_slot(tag, type, RESOLVE_CACHE)];
+
+    /* Check the cache. */
+    struct type_tag *current = NULL;
+    Pvoid_t *PValue = NULL;
+
+    if (resolution->tag == tag &&
+        resolution->type == type &&
+        resolution->generation == tag->generation &&
+        resolution->chain == chain) {
+        current = resolution->owner;
+    }
+    else {
+        /* Walk the chain. */
+        for (current = tag;; current = current->parent) {
+            if (current == NULL) {
+                *owner = NULL;
+                return NULL;
+            }
+
+            if (current != tag &&
+                current->hooks.has_a != NULL &&
+                current->hooks.has_a(current, type)) {
+                *owner = current;
+                return NULL;
+            }
+
+            if (current->frozen != NULL) {
+                if (frozen_find(current->frozen, type) != NULL) break;
+            }
+            else {
+                PValue = tag_get(current, type);
+                if (PValue != NULL) break;
+            }
+        }
+
+        resolution->tag = tag;
+        resolution->type = type;
+        resolution->generation = tag->generation;
+        resolution->chain = chain;
+        resolution->owner = current;
+    }
+
+    *owner = current;
+
+    /* Frozen types don't have records. */
+    if (current->frozen != NULL) {
+        return NULL;
+    }
+
+    if (own) {
+        return tag_get_own(current, type);
+    }
+
+    return PValue != NULL ? PValue : tag_get(current, type);
+}
+
+/* Drops the tag's parent. */
+static void
+tag_unparent(
+        struct type_tag *tag)
+{
+    /* Frozen parents don't track their children. */
+    if (tag->parent->frozen == NULL) {
+        tag->parent->children--;
+    }
+
+    tag->parent = NULL;
+}
+
+/* Drops the tag's own map and base once nothing is attached. */
+static void
+tag_reset(
+        struct type_tag *tag)
+{
+    /* Only tombstones can remain. */
+    Word_t freed = 0;
+    JLFA(freed, tag->type_to_impl);
+
+    base_release(tag->base);
+    tag->base = NULL;
+
+    tag->changes = 0;
+    tag->fast.acquired = 0;
+}
+
+size_t
+type_tag_size()
+{
+    return sizeof (struct type_tag);
+}
+
+size_t
+type_tag_align()
+{
+    return __alignof__ (struct type_tag);
+}
+
+void
+type_tag_init(
+        struct type_tag *tag,
+        const struct type_tag_static_i *hooks)
+{
+    /* Copy hooks. */
+    if (hooks != NULL) {
+        tag->hooks = *hooks;
+    }
+    else {
+        /* Set all static hooks to NULL. */
+        struct type_tag_static_i null_hooks = {
+            .attachments    = NULL,
+            .has_a          = NULL,
+
+            .acquire        = NULL,
+            .release        = NULL,
+
+            .acquisitions   = NULL,
+            .for_each       = NULL,
+        };
+        tag->hooks = null_hooks;
+    }
+
+    tag->fast.abi = TYPE_INLINE_ABI;
+    tag->fast.next = 0;
+    memset(tag->fast.slots, 0, sizeof(tag->fast.slots));
+
+    /* Initialize map (just needs to be NULL). */
+    tag->type_to_impl = NULL;
+    tag->base = NULL;
+
+    tag->count = 0;
+    tag->immortals = 0;
+    tag->changes = 0;
+    tag->fast.acquired = 0;
+
+    tag->parent = NULL;
+    tag->children = 0;
+    tag->generation = generation_next();
+
+    memset(&tag->mask, 0, sizeof(tag->mask));
+    tag->mask_generation = 0;
+    tag->mask_epoch = 0;
+
+    tag->bloom[0] = tag->bloom[1] = 0;
+    tag->bloom_generation = 0;
+    tag->bloom_stale = 0;
+    memset(&tag->stats, 0, sizeof(tag->stats));
+
+    tag->optimistic = NULL;
+    tag->frozen = NULL;
+    tag->flags = 0;
+}
+
+/* Throws if the tag can't be modified. */
+static inline void
+tag_check_mutable(
+        struct type_tag *tag)
+{
+    if (tag->flags & TAG_IMMUTABLE) {
+        stats_throw_str_static(TYPE_TAG_IMMUTABLE, "Type tag is immutable.");
+    }
+}
+
+void
+type_tag_fini(
+        struct type_tag *tag)
+{
+    /* Ignore null tag. */
+    if (tag == NULL) return;
+
+    /* Shapes live as long as the thread. */
+    if (tag->flags & TAG_SHAPE) {
+        stats_throw_str_static(TYPE_TAG_IMMUTABLE, "Can't finalize, type tag is a shape.");
+    }
+
+    /* Check if types are attached. */
+    if (tag->count != tag->immortals && tag->frozen == NULL) {
+        stats_throw_str_static(TYPE_TAG_STILL_ATTACHED, "Can't finalize, types still attached.");
+    }
+
+    if (tag->children != 0) {
+        stats_throw_str_static(TYPE_TAG_STILL_ATTACHED, "Can't finalize, type tag is still a parent.");
+    }
+
+    /* Detach the immortal (or frozen) types. */
+    if (tag->count != 0) {
+        Pvoid_t *PValue = NULL;
+        Word_t Index = 0;
+
+        if (index_enabled) {
+            PValue = tag_next(tag, &Index, 1);
+
+            while (PValue != NULL) {
+                index_unset(&type_to_tags, Index, (Word_t)tag);
+
+                PValue = tag_next(tag, &Index, 0);
+            }
+        }
+
+        Index = 0;
+        JLF(PValue, tag->type_to_impl, Index);
+
+        while (PValue != NULL) {
+            impl_free((Word_t)*PValue, 1);
+
+            JLN(PValue, tag->type_to_impl, Index);
+        }
+
+        tag->count = 0;
+        tag->immortals = 0;
+        tag_changed(tag);
+    }
+
+    /* Finalize map. */
+    tag_reset(tag);
+
+    if (index_enabled) {
+        int status = 0;
+        J1U(status, index_tags, (Word_t)tag);
+    }
+
+    /* Drop the parent. */
+    if (tag->parent != NULL) {
+        tag_unparent(tag);
+    }
+
+    if (tag->frozen != NULL) {
+        free(tag->frozen->memory);
+        free(tag->frozen);
+        tag->frozen = NULL;
+    }
+
+    /* Readers are done, so the retired mirrors can go. */
+    if (tag->optimistic != NULL) {
+        struct mirror *mirror = tag->optimistic->mirror;
+
+        while (mirror != NULL) {
+            struct mirror *retired = mirror->retired;
+            free(mirror);
+            mirror = retired;
+        }
+
+        free(tag->optimistic);
+        tag->optimistic = NULL;
+    }
+}
+
+/* Checks that the type can be attached to the tag. */
+static void
+tag_check_attach(
+        struct type_tag *tag,
+        const char *type)
+{
+    Pvoid_t *PValue = NULL;
+
+    tag_check_mutable(tag);
+
+    /* Check for existing type implementation. */
+    PValue = tag_get(tag, type);
+    if (PValue != NULL ||
+        (tag->hooks.has_a != NULL &&
+         tag->hooks.has_a(tag, type))) {
+        /* Otherwise fail, implementation already exists. */
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' already attached.", type);
+        stats_throw_str(TYPE_TAG_ALREADY_ATTACHED) msg;
+    }
+}
+
+/* Inserts the new mapping type -> value (possibly replacing a tombstone). */
+static void
+tag_insert(
+        struct type_tag *tag,
+        const char *type,
+        Word_t value)
+{
+    Pvoid_t *PValue = NULL;
+
+    tag_write_begin(tag);
+
+    JLI(PValue, tag->type_to_impl, (Word_t)type);
+    if ((Word_t)*PValue != IMPL_TOMBSTONE) {
+        tag->changes++;
+    }
+    *PValue = (void *)value;
+
+    Word_t previous = tag->generation;
+
+    tag->count++;
+    tag_changed(tag);
+
+    stats_count(tag_stats(tag), attaches);
+    probe3(tag_attach, tag, type, tag->count);
+
+    tag_mask_update(tag, previous, type, 1);
+    tag_bloom_update(tag, previous, type, 1);
+
+    if (index_enabled) {
+        index_tag(tag);
+        index_set(&type_to_tags, (Word_t)type, (Word_t)tag);
+    }
+
+    tag_write_end(tag);
+}
+
+void
+type_tag_attach(
+        struct type_tag_impl *tti,
+        void (*impl_detach)(void *impl))
+{
+    struct type_tag *tag = tti->tag;
+    const char *type = tti->type;
+
+    tag_check_attach(tag, type);
+
+    Word_t value = 0;
+    if (impl_can_direct(tti->impl, impl_detach)) {
+        /* Without a record. */
+        value = (Word_t)tti->impl | IMPL_DIRECT;
+    }
+    else {
+        value = (Word_t)impl_new(tti->impl, impl_detach, 0);
+    }
+
+    tag_insert(tag, type, value);
+}
+
+void
+type_tag_attach_lazy(
+        struct type_tag_impl *tti,
+        type_tag_factory_f factory,
+        void *ctx,
+        void (*impl_detach)(void *impl))
+{
+    struct type_tag *tag = tti->tag;
+    const char *type = tti->type;
+
+    tag_check_attach(tag, type);
+
+    struct lazy *lazy = ecx_malloc(sizeof(struct lazy));
+    lazy->factory = factory;
+    lazy->ctx = ctx;
+
+    tag_insert(tag, type, (Word_t)impl_new(lazy, impl_detach, IMPL_LAZY));
+}
+
+void
+type_tag_attach_immortal(
+        struct type_tag_impl *tti)
+{
+    struct type_tag *tag = tti->tag;
+    const char *type = tti->type;
+
+    tag_check_attach(tag, type);
+
+    tag_insert(tag, type, (Word_t)impl_new(tti->impl, NULL, IMPL_IMMORTAL));
+    tag->immortals++;
+}
+
+void
+type_tag_detach(
+        struct type_tag_impl *tti)
+{
+    Pvoid_t *PValue = NULL;
+
+    struct type_tag *tag = tti->tag;
+    const char *type = tti->type;
+
+    tag_check_mutable(tag);
+    tag_inline_flush(tag);
+
+    /* Get implementation. */
+    PValue = tag_get(tag, type);
+    if (PValue == NULL) {
+        /* Is it a static type? */
+        if (tag->hooks.has_a != NULL &&
+            tag->hooks.has_a(tag, type)) {
+            char *msg = NULL;
+            ecx_asprintf(&msg,
+                    "Type implementation for '%s' is static (and cannot be detached).", type);
+            stats_throw_str(TYPE_TAG_IS_STATIC) msg;
+        }
+        else {
+            /* Otherwise fail, implementation not attached. */
+            char *msg = NULL;
+            ecx_asprintf(&msg,
+                    "Type implementation for '%s' not attached.", type);
+            stats_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+        }
+    }
+
+    Word_t value = (Word_t)*PValue;
+    size_t acquisitions = impl_acquisitions(value);
+
+    if (impl_is_immortal(value)) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' is immortal (and cannot be detached).", type);
+        stats_throw_str(TYPE_TAG_IS_IMMORTAL) msg;
+    }
+
+    /* Outstanding acquisitions? */
+    if (acquisitions != 0) {
+        char *msg = NULL;
+
+        /* Choose correct numbering. */
+        const char *acq = NULL;
+        const char acq1[] = "acquisition remains";
+        const char acq2[] = "acquisitions remain";
+        acq = acquisitions == 1 ? acq1 : acq2;
+
+        ecx_asprintf(&msg, "Can't detach because %zi %s.",
+                acquisitions, acq);
+        stats_throw_str(TYPE_TAG_STILL_ACQUIRED) msg;
+    }
+
+    /* Provided impl pointer doesn't match attached. */
+    if (tti->impl != NULL && tti->impl != impl_of(value)) {
+        stats_throw_str_static(TYPE_TAG_MISMATCH,
+                "Implementation provided doesn't match currently attached.");
+    }
+
+    if (index_enabled) {
+        index_tag(tag);
+        index_unset(&type_to_tags, (Word_t)type, (Word_t)tag);
+    }
+
+    tag_write_begin(tag);
+
+    /* Remove type -> impl mapping. */
+    Pvoid_t *POwn = NULL;
+    JLG(POwn, tag->type_to_impl, (Word_t)type);
+
+    unsigned int owned = POwn != NULL;
+
+    /* Borrowed copies aren't counted as changes. */
+    unsigned int counted = owned &&
+        (impl_is_direct(value) ||
+         !(((struct impl *)value)->flags & IMPL_BORROWED));
+
+    /* Entries in bases only this tag uses are detached now, the others once
+     * their base is released.
+     */
+    if (base_get(tag->base, type) != NULL &&
+        !base_remove(tag->base, type)) {
+        /* Hide the base's entry. */
+        if (POwn == NULL) {
+            JLI(POwn, tag->type_to_impl, (Word_t)type);
+        }
+
+        if (!counted) {
+            tag->changes++;
+        }
+
+        *POwn = (void *)IMPL_TOMBSTONE;
+    }
+    else if (owned) {
+        int status = 0;
+        JLD(status, tag->type_to_impl, (Word_t)type);
+
+        if (counted) {
+            tag->changes--;
+        }
+    }
+
+    if (owned) {
+        impl_free(value, 1);
+    }
+
+    Word_t previous = tag->generation;
+
+    tag->count--;
+    tag_changed(tag);
+
+    stats_count(tag_stats(tag), detaches);
+    probe3(tag_detach, tag, type, tag->count);
+
+    tag_mask_update(tag, previous, type, 0);
+    tag_bloom_update(tag, previous, type, 0);
+
+    /* If all the tags are removed, then free the mapping. */
+    if (tag->count == 0) {
+        tag_reset(tag);
+    }
+
+    tag_write_end(tag);
+}
+
+void
+type_tag_detach_all(
+        struct type_tag *tag)
+{
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    tag_check_mutable(tag);
+
+    /* Outstanding acquisitions? */
+    if (tag->fast.acquired != 0) {
+        char *msg = NULL;
+
+        /* Choose correct numbering. */
+        const char *acq = NULL;
+        const char acq1[] = "type remains";
+        const char acq2[] = "types remain";
+        acq = tag->fast.acquired == 1 ? acq1 : acq2;
+
+        ecx_asprintf(&msg, "Can't detach all because %zi acquired %s.",
+                tag->fast.acquired, acq);
+        stats_throw_str(TYPE_TAG_STILL_ACQUIRED) msg;
+    }
+
+    if (tag->immortals != 0) {
+        stats_throw_str_static(TYPE_TAG_IS_IMMORTAL, "Can't detach all, immortal types are attached.");
+    }
+
+    if (tag->count == 0) return;
+
+    if (index_enabled) {
+        /* The tag ends up without dynamic types, so only an already indexed
+         * tag has entries to remove (others just become indexed).
+         */
+        int status = 0;
+        J1S(status, index_tags, (Word_t)tag);
+
+        if (status == 0) {
+            PValue = tag_next(tag, &Index, 1);
+
+            while (PValue != NULL) {
+                index_unset(&type_to_tags, Index, (Word_t)tag);
+
+                PValue = tag_next(tag, &Index, 0);
+            }
+        }
+    }
+
+    tag_write_begin(tag);
+
+    /* Detach the tag's own records. Entries in a base are detached when the
+     * base is released.
+     */
+    Index = 0;
+    JLF(PValue, tag->type_to_impl, Index);
+
+    while (PValue != NULL) {
+        impl_free((Word_t)*PValue, 1);
+
+        JLN(PValue, tag->type_to_impl, Index);
+    }
+
+    stats_add(tag_stats(tag), detaches, tag->count);
+    probe2(tag_detach_all, tag, tag->count);
+
+    tag->count = 0;
+    tag_changed(tag);
+
+    /* Free the map and release the base. */
+    tag_reset(tag);
+
+    tag_write_end(tag);
+}
+
+unsigned int
+type_tag_is_static(
+        struct type_tag *tag,
+        const char *type)
+{
+    if (tag->hooks.has_a != NULL &&
+        tag->hooks.has_a(tag, type)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+size_t
+type_tag_attachments(
+        struct type_tag *tag)
+{
+    size_t attachments = tag->count;
+
+    /* Add static types. */
+    if (tag->hooks.attachments != NULL) {
+        attachments += tag->hooks.attachments(tag);
+    }
+
+    return attachments;
+}
+
+/* Returns 1 if the type is attached to the tag or its parents. */
+static unsigned int
+tag_has_a(
+        struct type_tag *tag,
+        const char *type)
+{
+    unsigned int maybe = tag_bloom_test(tag, type);
+
+    /* Is it a static type? */
+    if (tag_maybe_static(tag, maybe) &&
+        tag->hooks.has_a(tag, type)) {
+        return 1;
+    }
+
+    if (maybe) {
+        /* Check dynamic types. */
+        if (tag->frozen != NULL ?
+            frozen_find(tag->frozen, type) != NULL :
+            tag_get(tag, type) != NULL) {
+            return 1;
+        }
+
+        stats_count(tag_stats(tag), bloom_false_positives);
+    }
+
+    /* Check the parent. */
+    if (tag->parent != NULL) {
+        return tag_has_a(tag->parent, type);
+    }
+
+    return 0;
+}
+
+unsigned int
+type_tag_has_a(
+        struct type_tag *tag,
+        const char *type)
+{
+    unsigned int found = tag_has_a(tag, type);
+
+    if (found) {
+        stats_count(tag_stats(tag), hits);
+    }
+    else {
+        stats_count(tag_stats(tag), misses);
+    }
+
+    return found;
+}
+
+unsigned int type_inline_bypass = 0;
+
+/* Caches the record for inline acquires and releases (see type_inline.h). The
+ * record must have acquisitions and stays cached until its last release (or
+ * until the tag changes, which clears the cache). The tag's inline
+ * acquisitions must have been flushed.
+ */
+static inline void
+tag_inline(
+        struct type_tag *tag,
+        const char *type,
+        struct impl *impl)
+{
+    /* Static hooks are searched first and can change. */
+    if (tag->parent != NULL || tag->hooks.has_a != NULL) return;
+
+    struct type_inline_slot *slot = NULL;
+
+    for (unsigned int i = 0; i < TYPE_INLINE_SLOTS; i++) {
+        if (tag->fast.slots[i].type == type) {
+            slot = &tag->fast.slots[i];
+        }
+    }
+
+    if (slot == NULL) {
+        slot = &tag->fast.slots[tag->fast.next];
+        tag->fast.next = (tag->fast.next + 1) % TYPE_INLINE_SLOTS;
+    }
+
+    slot->type = type;
+    slot->impl = impl->impl;
+    slot->acquisitions = 0;
+    slot->record = impl;
+}
+
+/* Acquires the implementation (see type_tag_acquire(...)). Returns its
+ * acquisitions afterwards (0 if they aren't counted).
+ */
+static size_t
+tag_acquire(
+        struct type_tag_impl *tti)
+{
+    struct type_tag *tag = tti->tag;
+    const char *type = tti->type;
+
+    tti->flags = 0;
+
+    unsigned int maybe = tag_bloom_test(tag, type);
+
+    /* Look for static types first. */
+    if (tag_maybe_static(tag, maybe) &&
+        tag->hooks.acquire != NULL &&
+        tag->hooks.has_a(tag, type) != 0) {
+        stats_count(tag_stats(tag), acquires);
+        stats_count(tag_stats(tag), statics);
+
+        tag->hooks.acquire(tti);
+        return 0;
+    }
+
+    /* Frozen types can't be detached, so they aren't counted. */
+    if (maybe && tag->frozen != NULL) {
+        struct frozen_entry *entry = frozen_find(tag->frozen, type);
+
+        if (entry != NULL) {
+            tti->impl = entry->impl;
+            tti->flags = TYPE_TAG_IMPL_IMMORTAL;
+
+            stats_count(tag_stats(tag), acquires);
+            stats_count(tag_stats(tag), dynamics);
+            return 0;
+        }
+    }
+
+    /* Look through the parents. */
+    if (tag->parent != NULL) {
+        struct type_tag *owner = NULL;
+        Pvoid_t *PValue = tag_resolve(tag, type, 1, &owner);
+
+        if (PValue != NULL) {
+            struct impl *impl = impl_record(PValue);
+            tti->impl = impl_materialize(impl);
+
+            if (impl->flags & IMPL_IMMORTAL) {
+                tti->flags = TYPE_TAG_IMPL_IMMORTAL;
+            }
+            else {
+                tag_acquired(owner, impl, 1);
+            }
+
+            stats_count(tag_stats(owner), acquires);
+            stats_count(tag_stats(owner), dynamics);
+            return impl->acquisitions;
+        }
+        else if (owner != NULL) {
+            /* Statically attached to (or frozen in) the owner. */
+            struct type_tag_impl owned = *tti;
+            owned.tag = owner;
+
+            size_t acquisitions = tag_acquire(&owned);
+
+            tti->impl = owned.impl;
+            return acquisitions;
+        }
+    }
+
+    /* Look for dynamic types. */
+    Pvoid_t *PValue = maybe ? tag_get_own(tag, type) : NULL;
+    if (PValue == NULL) {
+        if (maybe) {
+            stats_count(tag_stats(tag), bloom_false_positives);
+        }
+
+        stats_count(tag_stats(tag), misses);
+
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' not attached.", type);
+        stats_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+    }
+
+    struct impl *impl = impl_record(PValue);
+    tti->impl = impl_materialize(impl);
+
+    if (impl->flags & IMPL_IMMORTAL) {
+        tti->flags = TYPE_TAG_IMPL_IMMORTAL;
+    }
+    else {
+        tag_acquired(tag, impl, 1);
+        tag_inline(tag, type, impl);
+    }
+
+    stats_count(tag_stats(tag), acquires);
+    stats_count(tag_stats(tag), dynamics);
+
+    return impl->acquisitions;
+}
+
+void
+type_tag_acquire(
+        struct type_tag_impl *tti)
+{
+    size_t acquisitions = tag_acquire(tti);
+
+    probe4(tag_acquire, tti->tag, tti->type, tti->impl, acquisitions);
+    profile_acquired(tti->tag, tti->type, NULL, 0);
+}
+
+void
+type_tag_acquire_at(
+        struct type_tag_impl *tti,
+        const char *file,
+        unsigned int line)
+{
+    size_t acquisitions = tag_acquire(tti);
+
+    probe4(tag_acquire, tti->tag, tti->type, tti->impl, acquisitions);
+    profile_acquired(tti->tag, tti->type, file, line);
+}
+
+/* Releases the implementation (see type_tag_release(...)). Returns its
+ * acquisitions afterwards (0 if they aren't counted).
+ */
+static size_t
+tag_release(
+        struct type_tag_impl *tti)
+{
+    struct type_tag *tag = tti->tag;
+    const char *type = tti->type;
+
+    /* Look for static types first. */
+    if (tag->hooks.has_a != NULL &&
+        tag->hooks.release != NULL &&
+        tag->hooks.has_a(tag, type) != 0) {
+        stats_count(tag_stats(tag), releases);
+
+        tag->hooks.release(tti);
+        return 0;
+    }
+
+    if (tag->frozen != NULL &&
+        frozen_find(tag->frozen, type) != NULL) {
+        tti->impl = NULL;
+
+        stats_count(tag_stats(tag), releases);
+        return 0;
+    }
+
+    Word_t value = 0;
+    struct type_tag *owner = tag;
+
+    if (tag->parent != NULL) {
+        /* Look through the parents. */
+        Pvoid_t *PValue = tag_resolve(tag, type, 1, &owner);
+
+        if (PValue == NULL && owner != NULL) {
+            /* Statically attached to (or frozen in) the owner. */
+            struct type_tag_impl owned = *tti;
+            owned.tag = owner;
+
+            size_t acquisitions = tag_release(&owned);
+
+            tti->impl = NULL;
+            return acquisitions;
+        }
+
+        value = PValue != NULL ? (Word_t)*PValue : 0;
+    }
+    else {
+        /* Look for dynamic types. */
+        Pvoid_t *PValue = tag_get(tag, type);
+        value = PValue != NULL ? (Word_t)*PValue : 0;
+    }
+
+    if (value == 0) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' not attached.", type);
+        stats_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+    }
+
+    /* Provided impl pointer doesn't match attached. */
+    if (tti->impl != NULL && tti->impl != impl_of(value)) {
+        stats_throw_str_static(TYPE_TAG_MISMATCH,
+                "Implementation provided doesn't match currently attached.");
+    }
+
+    /* Acquisitions aren't counted. */
+    if (impl_is_immortal(value)) {
+        tti->impl = NULL;
+
+        stats_count(tag_stats(owner), releases);
+        return 0;
+    }
+
+    if (impl_acquisitions(value) == 0) {
+        stats_throw_str_static(TYPE_TAG_NOT_ACQUIRED, "No outstanding acquisitions to release.");
+    }
+
+    struct impl *impl = (struct impl *)value;
+
+    tti->impl = NULL;
+    tag_acquired(owner, impl, -1);
+
+    /* Only records with acquisitions are cached for inline acquires. */
+    size_t acquisitions = impl->acquisitions;
+    if (acquisitions == 0) {
+        tag_inline_drop(owner, type);
+        impl_demote(owner, type, impl);
+    }
+
+    stats_count(tag_stats(owner), releases);
+
+    return acquisitions;
+}
+
+void
+type_tag_release(
+        struct type_tag_impl *tti)
+{
+    size_t acquisitions = 0;
+
+    if (tti->flags & TYPE_TAG_IMPL_IMMORTAL) {
+        /* Nothing to look up. */
+        tti->impl = NULL;
+        tti->flags = 0;
+
+        stats_count(tag_stats(tti->tag), releases);
+    }
+    else {
+        acquisitions = tag_release(tti);
+    }
+
+    probe3(tag_release, tti->tag, tti->type, acquisitions);
+    profile_released(tti->tag, tti->type);
+}
+
+size_t
+type_tag_acquisitions(
+        struct type_tag_impl *tti)
+{
+    struct type_tag *tag = tti->tag;
+    const char *type = tti->type;
+
+    /* Is it a static type? */
     if (tag->hooks.has_a != NULL &&
         tag->hooks.acquisitions != NULL &&
         tag->hooks.has_a(tag, type)) {
         return tag->hooks.acquisitions(tti);
     }
 
-    /* Check dynamic types. */
-    Pvoid_t *PValue = NULL;
-    JLG(PValue, tag->type_to_impl, (Word_t)type);
-    if (PValue == NULL) {
-        char *msg = NULL;
-        ecx_asprintf(&msg,
-                "Type implementation for '%s' not attached.", type);
-        ec_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+    if (tag->frozen != NULL &&
+        frozen_find(tag->frozen, type) != NULL) {
+        return 0;
+    }
+
+    Word_t value = 0;
+    struct type_tag *owner = tag;
+
+    if (tag->parent != NULL) {
+        /* Look through the parents. */
+        Pvoid_t *PValue = tag_resolve(tag, type, 0, &owner);
+
+        if (PValue == NULL && owner != NULL) {
+            /* Statically attached to (or frozen in) the owner. */
+            struct type_tag_impl owned = *tti;
+            owned.tag = owner;
+
+            return type_tag_acquisitions(&owned);
+        }
+
+        value = PValue != NULL ? (Word_t)*PValue : 0;
+    }
+    else {
+        /* Check dynamic types. */
+        Pvoid_t *PValue = tag_get(tag, type);
+        value = PValue != NULL ? (Word_t)*PValue : 0;
+    }
+
+    if (value == 0) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' not attached.", type);
+        stats_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+    }
+
+    tag_inline_flush(owner);
+
+    return impl_acquisitions(value);
+}
+
+int
+type_tag_for_each(
+        struct type_tag *tag,
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_tag_impl *tti))
+{
+    int status = 0;
+
+    /* First loop over static types. */
+    if (tag->hooks.for_each != NULL) {
+        status = tag->hooks.for_each(tag, self, action);
+        if (status != 0) return status;
+    }
+
+    /* Loop over dynamic types. */
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    const char *type = NULL;
+
+    /* Get first type implementation. */
+    PValue = tag_next(tag, &Index, 1);
+
+    while (PValue != NULL) {
+        type = (const char *)Index;
+
+        struct type_tag_impl tti = {
+            .tag = tag,
+            .type = type,
+            .impl = impl_of((Word_t)*PValue),
+        };
+
+        /* Call action. */
+        status = action(self, &tti);
+        if (status != 0) return status;
+
+        /* Get next type implementation. */
+        PValue = tag_next(tag, &Index, 0);
+    }
+
+    return status;
+}
+
+/* Fills in the entry for the type and map value. */
+static inline void
+entry_set(
+        struct type_tag_entry *entry,
+        Word_t Index,
+        Pvoid_t *PValue)
+{
+    Word_t value = (Word_t)*PValue;
+
+    entry->type = (const char *)Index;
+    entry->impl = impl_of(value);
+    entry->acquisitions = impl_acquisitions(value);
+}
+
+unsigned int
+type_tag_cursor_first(
+        struct type_tag_cursor *cursor,
+        struct type_tag *tag)
+{
+    tag_inline_flush(tag);
+
+    Word_t Index = 0;
+    Pvoid_t *PValue = tag_next(tag, &Index, 1);
+
+    cursor->tag = tag;
+
+    if (PValue == NULL) return 0;
+
+    entry_set(&cursor->entry, Index, PValue);
+    return 1;
+}
+
+unsigned int
+type_tag_cursor_next(
+        struct type_tag_cursor *cursor)
+{
+    Word_t Index = (Word_t)cursor->entry.type;
+    Pvoid_t *PValue = tag_next(cursor->tag, &Index, 0);
+
+    if (PValue == NULL) return 0;
+
+    entry_set(&cursor->entry, Index, PValue);
+    return 1;
+}
+
+size_t
+type_tag_snapshot(
+        struct type_tag *tag,
+        struct type_tag_entry *entries,
+        size_t size)
+{
+    size_t count = 0;
+
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    tag_inline_flush(tag);
+
+    PValue = tag_next(tag, &Index, 1);
+
+    while (PValue != NULL && count < size) {
+        entry_set(&entries[count++], Index, PValue);
+
+        PValue = tag_next(tag, &Index, 0);
+    }
+
+    return tag->count;
+}
+
+/* Moves the tag's own entries into a new base shared with its clones. Records
+ * with acquisitions keep a borrowed copy (holding the acquisitions) in the
+ * tag's own map.
+ */
+static void
+tag_seal(
+        struct type_tag *tag)
+{
+    struct tag_base *base = ecx_malloc(sizeof(struct tag_base));
+
+    base->refs = 1;
+    base->parent = tag->base;
+    base->type_to_impl = tag->type_to_impl;
+
+    tag->base = base;
+    tag->type_to_impl = NULL;
+    tag->changes = 0;
+
+    /* Records moved, so cached resolutions are stale. */
+    tag_changed(tag);
+
+    if (tag->fast.acquired == 0) return;
+
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, base->type_to_impl, Index);
+
+    while (PValue != NULL) {
+        Word_t value = (Word_t)*PValue;
+
+        if (value != IMPL_TOMBSTONE &&
+            impl_acquisitions(value) != 0) {
+            struct impl *impl = (struct impl *)value;
+            struct impl *borrowed = impl_new(impl->impl, NULL, IMPL_BORROWED);
+
+            /* Move the acquisitions to the tag. */
+            borrowed->acquisitions = impl->acquisitions;
+            impl->acquisitions = 0;
+
+            Pvoid_t *POwn = NULL;
+            JLI(POwn, tag->type_to_impl, Index);
+            *POwn = borrowed;
+        }
+
+        JLN(PValue, base->type_to_impl, Index);
+    }
+}
+
+void
+type_tag_clone(
+        struct type_tag *src,
+        struct type_tag *dst)
+{
+    tag_check_mutable(dst);
+
+    if (dst->count != 0) {
+        stats_throw_str_static(TYPE_TAG_STILL_ATTACHED, "Can't clone, types still attached.");
+    }
+
+    if (src->flags & TAG_IMMUTABLE) {
+        /* The source's map can't be moved, so copy it. */
+        Pvoid_t *PValue = NULL;
+        Word_t Index = 0;
+
+        PValue = tag_next(src, &Index, 1);
+
+        while (PValue != NULL) {
+            struct type_tag_impl tti = {
+                .tag = dst,
+                .type = (const char *)Index,
+                .impl = impl_of((Word_t)*PValue),
+            };
+
+            if (impl_is_immortal((Word_t)*PValue)) {
+                type_tag_attach_immortal(&tti);
+            }
+            else {
+                type_tag_attach(&tti, NULL);
+            }
+
+            PValue = tag_next(src, &Index, 0);
+        }
+
+        return;
+    }
+
+    /* Share everything the source has. */
+    if (src->changes != 0) {
+        tag_seal(src);
+    }
+
+    tag_write_begin(dst);
+
+    dst->base = src->base;
+    if (dst->base != NULL) {
+        dst->base->refs++;
+    }
+
+    dst->count = src->count;
+    dst->immortals = src->immortals;
+    tag_changed(dst);
+
+    tag_write_end(dst);
+
+    if (index_enabled) {
+        /* Reindex with the new types. */
+        int status = 0;
+        J1U(status, index_tags, (Word_t)dst);
+
+        index_tag(dst);
+    }
+}
+
+void
+type_tag_freeze(
+        struct type_tag *tag)
+{
+    if (tag->frozen != NULL) return;
+
+    tag_check_mutable(tag);
+
+    /* Acquisitions aren't counted once frozen. */
+    if (tag->fast.acquired != 0) {
+        stats_throw_str_static(TYPE_TAG_STILL_ACQUIRED, "Can't freeze, types still acquired.");
+    }
+
+    struct frozen_entry *sorted = ecx_malloc(
+            (tag->count + 1) * sizeof(struct frozen_entry));
+    size_t count = 0;
+
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    PValue = tag_next(tag, &Index, 1);
+
+    while (PValue != NULL) {
+        Word_t value = (Word_t)*PValue;
+
+        /* Frozen lookups can't materialize implementations. */
+        if (!impl_is_direct(value)) {
+            impl_materialize((struct impl *)value);
+        }
+
+        sorted[count].type = (const char *)Index;
+        sorted[count].impl = impl_of(value);
+        count++;
+
+        PValue = tag_next(tag, &Index, 0);
+    }
+
+    struct frozen *frozen = ecx_malloc(sizeof(struct frozen));
+    frozen->memory = ecx_malloc(
+            FROZEN_ALIGN + (count + 1) * sizeof(struct frozen_entry));
+    frozen->entries = (struct frozen_entry *)
+        (((Word_t)frozen->memory + FROZEN_ALIGN - 1) & ~(Word_t)(FROZEN_ALIGN - 1));
+    frozen->count = count;
+
+    memset(&frozen->entries[0], 0, sizeof(struct frozen_entry));
+    frozen_fill(frozen->entries, sorted, 0, 1, count);
+
+    free(sorted);
+
+    tag->frozen = frozen;
+    tag->flags |= TAG_IMMUTABLE;
+
+    /* Build what's built lazily now, so reads don't write. */
+    tag_changed(tag);
+    tag_mask(tag, NULL);
+    tag_bloom_build(tag);
+
+    /* Children aren't tracked from now on (see tag_unparent(...)). */
+    tag->children = 0;
+}
+
+void
+type_tag_set_parent(
+        struct type_tag *tag,
+        struct type_tag *parent)
+{
+    tag_check_mutable(tag);
+
+    for (struct type_tag *ancestor = parent;
+         ancestor != NULL;
+         ancestor = ancestor->parent) {
+        if (ancestor == tag) {
+            stats_throw_str_static(TYPE_TAG_CYCLE, "Parent would create a cycle.");
+        }
+    }
+
+    if (tag->parent != NULL) {
+        tag_unparent(tag);
+    }
+
+    /* Frozen parents are shared between threads, so they don't track their
+     * children.
+     */
+    if (parent != NULL && parent->frozen == NULL) {
+        parent->children++;
+    }
+
+    tag->parent = parent;
+
+    tag_changed(tag);
+}
+
+struct type_tag *
+type_tag_parent(
+        struct type_tag *tag)
+{
+    return tag->parent;
+}
+
+void
+type_tag_stats(
+        struct type_tag *tag,
+        struct type_stats *stats)
+{
+    *stats = tag->stats;
+}
+
+void
+type_tag_stats_reset(
+        struct type_tag *tag)
+{
+    memset(&tag->stats, 0, sizeof(tag->stats));
+}
+
+void
+type_tag_bloom_stats(
+        struct type_tag *tag,
+        struct type_bloom_stats *stats)
+{
+    stats->probes = tag->stats.bloom_probes;
+    stats->negatives = tag->stats.bloom_negatives;
+    stats->false_positives = tag->stats.bloom_false_positives;
+}
+
+void
+type_tag_bloom_statics(
+        struct type_tag *tag)
+{
+    tag_check_mutable(tag);
+
+    if (tag->hooks.has_a == NULL || tag->hooks.for_each == NULL) {
+        stats_throw_str_static(TYPE_INVALID_ARG, "Tag doesn't have both has_a and for_each hooks.");
+    }
+
+    tag->flags |= TAG_BLOOM_STATICS;
+
+    /* Rebuilt (with the static types) on the next test. */
+    tag->bloom_generation = 0;
+}
+
+size_t
+type_tag_memory_usage(
+        struct type_tag *tag,
+        struct type_memory_usage *usage)
+{
+    struct type_memory_usage local = {
+        .maps       = 0,
+        .records    = 0,
+        .tags       = 0,
+        .shared     = 0,
+    };
+
+    /* Map nodes. */
+    Word_t used = 0;
+    JLMU(used, tag->type_to_impl);
+    local.maps = used;
+
+    /* Records (only for types not stored directly). */
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, tag->type_to_impl, Index);
+
+    while (PValue != NULL) {
+        Word_t value = (Word_t)*PValue;
+
+        local.records += impl_size(value);
+
+        JLN(PValue, tag->type_to_impl, Index);
+    }
+
+    /* Frozen lookups (including the alignment). */
+    if (tag->frozen != NULL) {
+        local.records += sizeof(struct frozen) + FROZEN_ALIGN +
+            (tag->frozen->count + 1) * sizeof(struct frozen_entry);
+    }
+
+    /* Mirrors for optimistic reads (including the retired ones). */
+    if (tag->optimistic != NULL) {
+        local.records += sizeof(struct optimistic);
+
+        for (struct mirror *mirror = tag->optimistic->mirror;
+             mirror != NULL;
+             mirror = mirror->retired) {
+            local.records += sizeof(struct mirror) +
+                mirror->count * sizeof(struct mirror_entry);
+        }
+    }
+
+    /* Bases shared with clones. */
+    for (struct tag_base *base = tag->base; base != NULL; base = base->parent) {
+        local.shared += sizeof(struct tag_base);
+
+        JLMU(used, base->type_to_impl);
+        local.shared += used;
+
+        Index = 0;
+        JLF(PValue, base->type_to_impl, Index);
+
+        while (PValue != NULL) {
+            Word_t value = (Word_t)*PValue;
+
+            local.shared += impl_size(value);
+
+            JLN(PValue, base->type_to_impl, Index);
+        }
+    }
+
+    if (usage != NULL) {
+        usage->maps += local.maps;
+        usage->records += local.records;
+        usage->tags += local.tags;
+        usage->shared += local.shared;
+    }
+
+    return local.maps + local.records + local.tags + local.shared;
+}
+
+struct type_tag_i TYPE_TAG_I = {
+    .size           = type_tag_size,
+    .align          = type_tag_align,
+
+    .init           = type_tag_init,
+    .fini           = type_tag_fini,
+
+    .attach         = type_tag_attach,
+    .detach         = type_tag_detach,
+    .detach_all     = type_tag_detach_all,
+
+    .is_static      = type_tag_is_static,
+
+    .attachments    = type_tag_attachments,
+    .has_a          = type_tag_has_a,
+
+    .acquire        = type_tag_acquire,
+    .release        = type_tag_release,
+
+    .acquisitions   = type_tag_acquisitions,
+    .for_each       = type_tag_for_each,
+};
+
+/*** Shape ***/
+
+/* Shapes are immutable type tags shared between data with the same
+ * implementations attached. They are hash-consed on their contents (so equal
+ * contents always give the same shape) and transitions between shapes are
+ * cached on the source shape.
+ */
+struct shape {
+    struct type_tag tag;                /* Must be first. */
+    Word_t hash;                        /* Order independent content hash. */
+    Pvoid_t attach_edges;               /* Map from type to (impl to shape). */
+    Pvoid_t detach_edges;               /* Map from type to shape. */
+    struct shape *next;                 /* Next shape with the same hash. */
+};
+
+/* Global per-thread map from content hash to shapes. */
+__thread Pvoid_t hash_to_shape = NULL;
+
+/* Global per-thread empty shape. */
+__thread struct shape *shape_empty = NULL;
+
+static inline struct shape *
+shape_of(
+        struct type_tag *tag)
+{
+    if (!(tag->flags & TAG_SHAPE)) {
+        stats_throw_str_static(TYPE_TAG_NOT_SHAPE, "Type tag is not a shape.");
+    }
+
+    return (struct shape *)tag;
+}
+
+/* Hash of a single type implementation. Entry hashes are summed so the shape
+ * hash doesn't depend on the order of attachment.
+ */
+static inline Word_t
+shape_hash_entry(
+        const char *type,
+        void *impl)
+{
+    uint64_t h = (uint64_t)(Word_t)type * UINT64_C(0x9E3779B97F4A7C15);
+    h ^= (uint64_t)(Word_t)impl + UINT64_C(0x632BE59BD9B4E019) + (h << 6) + (h >> 2);
+    h ^= h >> 29;
+
+    return (Word_t)h;
+}
+
+/* Returns true(1) if the shape contents are equal to the source contents with
+ * the given type changed. If impl is NULL, then the type is removed from the
+ * source, otherwise it is added.
+ */
+static unsigned int
+shape_equals(
+        struct shape *shape,
+        struct shape *source,
+        const char *type,
+        void *impl)
+{
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, shape->tag.type_to_impl, Index);
+
+    while (PValue != NULL) {
+        void *have = impl_of((Word_t)*PValue);
+
+        if ((const char *)Index == type) {
+            if (impl == NULL || have != impl) return 0;
+        }
+        else {
+            Pvoid_t *PSource = NULL;
+            JLG(PSource, source->tag.type_to_impl, Index);
+            if (PSource == NULL || impl_of((Word_t)*PSource) != have) return 0;
+        }
+
+        JLN(PValue, shape->tag.type_to_impl, Index);
+    }
+
+    return 1;
+}
+
+static struct shape *
+shape_new(
+        Word_t hash)
+{
+    struct shape *shape = ecx_malloc(sizeof(struct shape));
+
+    type_tag_init(&shape->tag, NULL);
+    shape->tag.flags = TAG_IMMUTABLE | TAG_SHAPE;
+
+    shape->hash = hash;
+    shape->attach_edges = NULL;
+    shape->detach_edges = NULL;
+
+    /* Insert into the hash chain. */
+    Pvoid_t *PValue = NULL;
+    JLI(PValue, hash_to_shape, hash);
+    shape->next = *PValue;
+    *PValue = shape;
+
+    return shape;
+}
+
+/* Insert the type implementation into a shape under construction. */
+static void
+shape_insert(
+        struct shape *shape,
+        const char *type,
+        void *impl)
+{
+    Pvoid_t *PValue = NULL;
+    JLI(PValue, shape->tag.type_to_impl, (Word_t)type);
+
+    if (impl_can_direct(impl, NULL)) {
+        *PValue = (void *)((Word_t)impl | IMPL_DIRECT);
+    }
+    else {
+        *PValue = impl_new(impl, NULL, 0);
+    }
+
+    shape->tag.count++;
+}
+
+/* Returns the shape for the source contents with the given type changed (see
+ * shape_equals(...)), creating it if needed.
+ */
+static struct shape *
+shape_transition(
+        struct shape *source,
+        const char *type,
+        void *impl)
+{
+    Word_t hash = source->hash;
+    size_t count = source->tag.count;
+    void *previous = NULL;
+
+    if (impl != NULL) {
+        hash += shape_hash_entry(type, impl);
+        count++;
+    }
+    else {
+        Pvoid_t *PValue = NULL;
+        JLG(PValue, source->tag.type_to_impl, (Word_t)type);
+        previous = impl_of((Word_t)*PValue);
+
+        hash -= shape_hash_entry(type, previous);
+        count--;
+    }
+
+    /* Look for an existing shape with the same contents. */
+    Pvoid_t *PValue = NULL;
+    JLG(PValue, hash_to_shape, hash);
+
+    struct shape *shape = PValue != NULL ? *PValue : NULL;
+    for (; shape != NULL; shape = shape->next) {
+        if (shape->tag.count == count &&
+            shape_equals(shape, source, type, impl)) {
+            return shape;
+        }
+    }
+
+    /* Otherwise create it. */
+    shape = shape_new(hash);
+
+    Word_t Index = 0;
+    JLF(PValue, source->tag.type_to_impl, Index);
+
+    while (PValue != NULL) {
+        if ((const char *)Index != type) {
+            shape_insert(shape, (const char *)Index, impl_of((Word_t)*PValue));
+        }
+
+        JLN(PValue, source->tag.type_to_impl, Index);
+    }
+
+    if (impl != NULL) {
+        shape_insert(shape, type, impl);
+    }
+
+    return shape;
+}
+
+struct type_tag *
+type_shape_empty()
+{
+    if (shape_empty == NULL) {
+        shape_empty = shape_new(0);
+    }
+
+    return &shape_empty->tag;
+}
+
+unsigned int
+type_tag_is_shape(
+        struct type_tag *tag)
+{
+    return (tag->flags & TAG_SHAPE) != 0;
+}
+
+struct type_tag *
+type_shape_attach(
+        struct type_tag_impl *tti)
+{
+    struct shape *source = shape_of(tti->tag);
+    const char *type = tti->type;
+    void *impl = tti->impl;
+
+    if (impl == NULL) {
+        stats_throw_str_static(TYPE_TAG_MISMATCH, "Shape implementations can't be NULL.");
+    }
+
+    /* Check for existing type implementation. */
+    Pvoid_t *PValue = NULL;
+    JLG(PValue, source->tag.type_to_impl, (Word_t)type);
+    if (PValue != NULL) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' already attached.", type);
+        stats_throw_str(TYPE_TAG_ALREADY_ATTACHED) msg;
+    }
+
+    /* Follow the cached transition. */
+    Pvoid_t *PEdges = NULL;
+    JLG(PEdges, source->attach_edges, (Word_t)type);
+    if (PEdges != NULL) {
+        JLG(PValue, *PEdges, (Word_t)impl);
+        if (PValue != NULL) {
+            return &((struct shape *)*PValue)->tag;
+        }
+    }
+
+    struct shape *shape = shape_transition(source, type, impl);
+
+    /* Cache the transition. */
+    JLI(PEdges, source->attach_edges, (Word_t)type);
+    JLI(PValue, *PEdges, (Word_t)impl);
+    *PValue = shape;
+
+    return &shape->tag;
+}
+
+struct type_tag *
+type_shape_detach(
+        struct type_tag_impl *tti)
+{
+    struct shape *source = shape_of(tti->tag);
+    const char *type = tti->type;
+
+    /* Get implementation. */
+    Pvoid_t *PValue = NULL;
+    JLG(PValue, source->tag.type_to_impl, (Word_t)type);
+    if (PValue == NULL) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type implementation for '%s' not attached.", type);
+        stats_throw_str(TYPE_TAG_NOT_ATTACHED) msg;
+    }
+
+    /* Provided impl pointer doesn't match attached. */
+    if (tti->impl != NULL && tti->impl != impl_of((Word_t)*PValue)) {
+        stats_throw_str_static(TYPE_TAG_MISMATCH,
+                "Implementation provided doesn't match currently attached.");
+    }
+
+    /* Follow the cached transition. */
+    JLG(PValue, source->detach_edges, (Word_t)type);
+    if (PValue != NULL) {
+        return &((struct shape *)*PValue)->tag;
+    }
+
+    struct shape *shape = source->tag.count == 1 ?
+        shape_of(type_shape_empty()) :
+        shape_transition(source, type, NULL);
+
+    /* Cache the transition. */
+    JLI(PValue, source->detach_edges, (Word_t)type);
+    *PValue = shape;
+
+    return &shape->tag;
+}
+
+/* Adds the memory used by the calling thread's shapes to usage. */
+static void
+shape_memory_usage(
+        struct type_memory_usage *usage)
+{
+    Word_t used = 0;
+    JLMU(used, hash_to_shape);
+    usage->maps += used;
+
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, hash_to_shape, Index);
+
+    while (PValue != NULL) {
+        for (struct shape *shape = *PValue; shape != NULL; shape = shape->next) {
+            usage->tags += sizeof(struct shape);
+            type_tag_memory_usage(&shape->tag, usage);
+
+            JLMU(used, shape->detach_edges);
+            usage->maps += used;
+
+            JLMU(used, shape->attach_edges);
+            usage->maps += used;
+
+            Pvoid_t *PEdges = NULL;
+            Word_t Type = 0;
+
+            JLF(PEdges, shape->attach_edges, Type);
+
+            while (PEdges != NULL) {
+                JLMU(used, *PEdges);
+                usage->maps += used;
+
+                JLN(PEdges, shape->attach_edges, Type);
+            }
+        }
+
+        JLN(PValue, hash_to_shape, Index);
+    }
+}
+
+/*** Subtype ***/
+
+const char TYPE_SUBTYPE_CYCLE[]     = "Type: Subtype Cycle";
+
+/* Global map from type to the set (Judy1) of its declared supertypes. It is
+ * shared by all threads, so declarations take the lock for writing and
+ * type_is_a(...) takes it for reading (only when its memo misses).
+ */
+static Pvoid_t type_to_supers = NULL;
+static pthread_rwlock_t supers_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Generation of the subtype relation. Changes on every declaration. */
+static Word_t subtype_generation = 0;
+
+/* Global per-thread memo of type_is_a(...). Maps from type to a map from
+ * supertype to the answer (plus one). Flushed when the relation changes.
+ */
+__thread Pvoid_t type_to_is_a = NULL;
+__thread Word_t is_a_generation = 0;
+
+static void
+is_a_flush(
+        Pvoid_t *memo)
+{
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, *memo, Index);
+
+    while (PValue != NULL) {
+        Word_t freed = 0;
+        JLFA(freed, *PValue);
+
+        JLN(PValue, *memo, Index);
+    }
+
+    Word_t freed = 0;
+    JLFA(freed, *memo);
+}
+
+/* Frees a thread's memo when the thread exits. */
+static pthread_key_t is_a_key;
+static pthread_once_t is_a_once = PTHREAD_ONCE_INIT;
+
+static void
+is_a_exit(
+        void *memo)
+{
+    is_a_flush(memo);
+}
+
+static void
+is_a_key_create()
+{
+    pthread_key_create(&is_a_key, is_a_exit);
+}
+
+static void
+supers_unlock(
+        void *lock)
+{
+    pthread_rwlock_unlock(lock);
+}
+
+/* Searches the declared supertypes of the type (supers_lock must be held). */
+static unsigned int
+supers_search(
+        const char *type,
+        const char *super)
+{
+    if (type == super) return 1;
+
+    unsigned int is_a = 0;
+
+    Pvoid_t *PDeclared = NULL;
+    JLG(PDeclared, type_to_supers, (Word_t)type);
+
+    if (PDeclared != NULL) {
+        Word_t Index = 0;
+        int found = 0;
+
+        J1F(found, *PDeclared, Index);
+
+        while (found && !is_a) {
+            is_a = supers_search((const char *)Index, super);
+
+            J1N(found, *PDeclared, Index);
+        }
+    }
+
+    return is_a;
+}
+
+unsigned int
+type_is_a(
+        const char *type,
+        const char *super)
+{
+    if (type == super) return 1;
+
+    Word_t generation = __atomic_load_n(&subtype_generation, __ATOMIC_ACQUIRE);
+
+    if (is_a_generation != generation) {
+        is_a_flush(&type_to_is_a);
+        is_a_generation = generation;
+    }
+
+    /* Check the memo. */
+    Pvoid_t *PSupers = NULL;
+    PWord_t PValue = NULL;
+
+    JLG(PSupers, type_to_is_a, (Word_t)type);
+    if (PSupers != NULL) {
+        JLG(PValue, *PSupers, (Word_t)super);
+        if (PValue != NULL) {
+            return *PValue - 1;
+        }
+    }
+
+    /* Search the declared supertypes. */
+    pthread_rwlock_rdlock(&supers_lock);
+    unsigned int is_a = supers_search(type, super);
+    pthread_rwlock_unlock(&supers_lock);
+
+    /* Memoize. */
+    if (type_to_is_a == NULL) {
+        pthread_once(&is_a_once, is_a_key_create);
+        pthread_setspecific(is_a_key, &type_to_is_a);
+    }
+
+    JLI(PSupers, type_to_is_a, (Word_t)type);
+    JLI(PValue, *PSupers, (Word_t)super);
+    *PValue = is_a + 1;
+
+    return is_a;
+}
+
+void
+type_subtype(
+        const char *sub,
+        const char *super)
+{
+    unsigned int cycle = 0;
+
+    pthread_rwlock_wrlock(&supers_lock);
+    ec_with (&supers_lock, supers_unlock) {
+        /* Checked under the lock, so a racing declaration can't close a cycle. */
+        cycle = supers_search(super, sub);
+
+        if (!cycle) {
+            Pvoid_t *PSupers = NULL;
+            JLI(PSupers, type_to_supers, (Word_t)sub);
+
+            int status = 0;
+            J1S(status, *PSupers, (Word_t)super);
+
+            if (status) {
+                __atomic_add_fetch(&subtype_generation, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    if (cycle) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Type '%s' is already a supertype of '%s'.", sub, super);
+        stats_throw_str(TYPE_SUBTYPE_CYCLE) msg;
+    }
+}
+
+/* Returns the most specific dynamic type attached to the tag (or its parents)
+ * that is a subtype of super or NULL if there isn't one.
+ */
+static const char *
+tag_most_specific(
+        struct type_tag *tag,
+        const char *super)
+{
+    for (; tag != NULL; tag = tag->parent) {
+        const char *specific = NULL;
+
+        Pvoid_t *PValue = NULL;
+        Word_t Index = 0;
+
+        PValue = tag_next(tag, &Index, 1);
+
+        while (PValue != NULL) {
+            const char *type = (const char *)Index;
+
+            if (type_is_a(type, super) &&
+                (specific == NULL || type_is_a(type, specific))) {
+                specific = type;
+            }
+
+            PValue = tag_next(tag, &Index, 0);
+        }
+
+        if (specific != NULL) return specific;
+    }
+
+    return NULL;
+}
+
+/* Like tag_most_specific(...), but cached (per thread) until the tag, any tag
+ * with children or the subtype relation changes.
+ */
+static const char *
+tag_specific(
+        struct type_tag *tag,
+        const char *super)
+{
+    Word_t chain = __atomic_load_n(&chain_generation, __ATOMIC_RELAXED);
+    Word_t relation = __atomic_load_n(&subtype_generation, __ATOMIC_ACQUIRE);
+
+    /* Check the cache. */
+    struct specific *specific =
+        &specifics[cache_slot(tag, super, SPECIFIC_CACHE)];
+
+    if (specific->tag != tag ||
+        specific->super != super ||
+        specific->generation != tag->generation ||
+        specific->chain != chain ||
+        specific->relation != relation) {
+        const char *type = tag_most_specific(tag, super);
+
+        specific->tag = tag;
+        specific->super = super;
+        specific->generation = tag->generation;
+        specific->chain = chain;
+        specific->relation = relation;
+        specific->type = type;
+    }
+
+    return specific->type;
+}
+
+void
+type_tag_acquire_a(
+        struct type_tag_impl *tti)
+{
+    const char *type = tag_specific(tti->tag, tti->type);
+
+    /* Fall back to the type itself (e.g. a static type). */
+    if (type != NULL) {
+        tti->type = type;
+    }
+
+    type_tag_acquire(tti);
+}
+
+/*** Dispatch ***/
+
+const char TYPE_DISPATCH_ALREADY_REGISTERED[]   = "Type Dispatch: Already Registered";
+const char TYPE_DISPATCH_NOT_REGISTERED[]       = "Type Dispatch: Not Registered";
+const char TYPE_DISPATCH_NOT_FOUND[]            = "Type Dispatch: Not Found";
+const char TYPE_DISPATCH_AMBIGUOUS[]            = "Type Dispatch: Ambiguous";
+
+/* Number of cached dispatches (direct mapped by the generations). */
+#define DISPATCH_CACHE 256
+
+/* Cached dispatch for a pair of tags and a table. Generations are unique and
+ * change whenever a tag or table does, so they identify the entry on their own
+ * (an entry for a tag since finalized never matches a tag reinitialized at its
+ * address).
+ */
+struct dispatch_entry {
+    Word_t generation_a;                /* Tag A generation (or 0 if unused). */
+    Word_t generation_b;                /* Tag B generation when resolved. */
+    Word_t table;                       /* Table generation when resolved. */
+    Word_t chain;                       /* Chain generation when resolved. */
+    Word_t relation;                    /* Subtype generation when resolved. */
+    void *impl;
+};
+
+/* Global per-thread cache of dispatches (shared by all tables). */
+static __thread struct dispatch_entry dispatch_cache[DISPATCH_CACHE];
+
+struct type_dispatch {
+    Pvoid_t a_to_b_to_impl;             /* Map from type to type to impl. */
+    Word_t generation;                  /* Changes on (un)registration. */
+};
+
+size_t
+type_dispatch_size()
+{
+    return sizeof (struct type_dispatch);
+}
+
+void
+type_dispatch_init(
+        struct type_dispatch *dispatch)
+{
+    dispatch->a_to_b_to_impl = NULL;
+    dispatch->generation = generation_next();
+}
+
+void
+type_dispatch_fini(
+        struct type_dispatch *dispatch)
+{
+    Pvoid_t *PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, dispatch->a_to_b_to_impl, Index);
+
+    while (PValue != NULL) {
+        Word_t freed = 0;
+        JLFA(freed, *PValue);
+
+        JLN(PValue, dispatch->a_to_b_to_impl, Index);
+    }
+
+    Word_t freed = 0;
+    JLFA(freed, dispatch->a_to_b_to_impl);
+}
+
+void
+type_dispatch_register(
+        struct type_dispatch *dispatch,
+        const char *a,
+        const char *b,
+        void *impl)
+{
+    /* NULL is returned for pairs without one. */
+    if (impl == NULL) {
+        stats_throw_str_static(TYPE_INVALID_ARG, "Implementation is NULL.");
+    }
+
+    Pvoid_t *PRow = NULL;
+    JLI(PRow, dispatch->a_to_b_to_impl, (Word_t)a);
+
+    Pvoid_t *PValue = NULL;
+    JLI(PValue, *PRow, (Word_t)b);
+
+    if (*PValue != NULL) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "An implementation for ('%s', '%s') is already registered.", a, b);
+        stats_throw_str(TYPE_DISPATCH_ALREADY_REGISTERED) msg;
+    }
+
+    *PValue = impl;
+    dispatch->generation = generation_next();
+}
+
+void
+type_dispatch_unregister(
+        struct type_dispatch *dispatch,
+        const char *a,
+        const char *b)
+{
+    Pvoid_t *PRow = NULL;
+    JLG(PRow, dispatch->a_to_b_to_impl, (Word_t)a);
+
+    int status = 0;
+    if (PRow != NULL) {
+        JLD(status, *PRow, (Word_t)b);
+    }
+
+    if (status == 0) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "An implementation for ('%s', '%s') is not registered.", a, b);
+        stats_throw_str(TYPE_DISPATCH_NOT_REGISTERED) msg;
+    }
+
+    if (*PRow == NULL) {
+        JLD(status, dispatch->a_to_b_to_impl, (Word_t)a);
+    }
+
+    dispatch->generation = generation_next();
+}
+
+/* Returns 1 if the type or one of its subtypes is attached to the tag. */
+static unsigned int
+dispatch_has_a(
+        struct type_tag *tag,
+        const char *type)
+{
+    return type_tag_has_a(tag, type) || tag_specific(tag, type) != NULL;
+}
+
+/* Returns the implementation registered for the most specific pair of types
+ * attached to the tags (or their supertypes) or NULL if there isn't one. If
+ * resolving, then *best_a and *best_b are the most specific pair found so far.
+ * Otherwise the pair given is checked against the other matches and NULL is
+ * returned if it isn't at least as specific as all of them.
+ */
+static void *
+dispatch_search(
+        struct type_dispatch *dispatch,
+        struct type_tag *a,
+        struct type_tag *b,
+        const char **best_a,
+        const char **best_b,
+        unsigned int resolving)
+{
+    void *best = NULL;
+
+    Pvoid_t *PRow = NULL;
+    Word_t IndexA = 0;
+
+    JLF(PRow, dispatch->a_to_b_to_impl, IndexA);
+
+    while (PRow != NULL) {
+        const char *type_a = (const char *)IndexA;
+
+        if (dispatch_has_a(a, type_a)) {
+            Pvoid_t *PValue = NULL;
+            Word_t IndexB = 0;
+
+            JLF(PValue, *PRow, IndexB);
+
+            while (PValue != NULL) {
+                const char *type_b = (const char *)IndexB;
+
+                if (!dispatch_has_a(b, type_b)) {
+                    /* Not a match. */
+                }
+                else if (!resolving) {
+                    if (!type_is_a(*best_a, type_a) ||
+                        !type_is_a(*best_b, type_b)) {
+                        return NULL;
+                    }
+
+                    best = (void *)1;
+                }
+                else if (best == NULL || (type_is_a(type_a, *best_a) &&
+                                          type_is_a(type_b, *best_b))) {
+                    *best_a = type_a;
+                    *best_b = type_b;
+                    best = *PValue;
+                }
+
+                JLN(PValue, *PRow, IndexB);
+            }
+        }
+
+        JLN(PRow, dispatch->a_to_b_to_impl, IndexA);
+    }
+
+    return best;
+}
+
+/* Returns the implementation registered for the most specific pair of types
+ * attached to the tags (or their supertypes) or NULL if there isn't one.
+ */
+static void *
+dispatch_resolve(
+        struct type_dispatch *dispatch,
+        struct type_tag *a,
+        struct type_tag *b)
+{
+    const char *best_a = NULL;
+    const char *best_b = NULL;
+
+    void *best = dispatch_search(dispatch, a, b, &best_a, &best_b, 1);
+    if (best == NULL) return NULL;
+
+    /* The best match must be at least as specific as every other match. */
+    if (dispatch_search(dispatch, a, b, &best_a, &best_b, 0) == NULL) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "No pair of types is more specific than the others (e.g. ('%s', '%s')).",
+                best_a, best_b);
+        stats_throw_str(TYPE_DISPATCH_AMBIGUOUS) msg;
+    }
+
+    return best;
+}
+
+/* Returns the cache entry for the pair of tags and the table. */
+static inline struct dispatch_entry *
+dispatch_entry(
+        struct type_dispatch *dispatch,
+        struct type_tag *a,
+        struct type_tag *b)
+{
+    Word_t hash = (a->generation * 31 + b->generation) * 31 +
+        dispatch->generation;
+    hash ^= hash >> 8;
+
+    return &dispatch_cache[hash % DISPATCH_CACHE];
+}
+
+void *
+type_dispatch(
+        struct type_dispatch *dispatch,
+        struct type_tag *a,
+        struct type_tag *b)
+{
+    Word_t chain = __atomic_load_n(&chain_generation, __ATOMIC_RELAXED);
+    Word_t relation = __atomic_load_n(&subtype_generation, __ATOMIC_ACQUIRE);
+
+    /* Check the cache. */
+    struct dispatch_entry *entry = dispatch_entry(dispatch, a, b);
+    if (entry->generation_a == a->generation &&
+        entry->generation_b == b->generation &&
+        entry->table == dispatch->generation &&
+        entry->chain == chain &&
+        entry->relation == relation) {
+        return entry->impl;
+    }
+
+    void *impl = dispatch_resolve(dispatch, a, b);
+
+    if (impl == NULL) {
+        stats_throw_str_static(TYPE_DISPATCH_NOT_FOUND,
+                "No implementation is registered for the tags' types.");
+    }
+
+    /* Replaces whichever pair was cached. */
+    entry->generation_a = a->generation;
+    entry->generation_b = b->generation;
+    entry->table = dispatch->generation;
+    entry->chain = chain;
+    entry->relation = relation;
+    entry->impl = impl;
+
+    return impl;
+}
+
+/*** Global ***/
+
+const char TYPE_STILL_ATTACHED[]    = "Type: Still Attached";
+const char TYPE_ALREADY_ATTACHED[]  = "Type: Already Attached";
+const char TYPE_NOT_ATTACHED[]      = "Type: Not Attached";
+const char TYPE_STILL_ACQUIRED[]    = "Type: Still Acquired";
+const char TYPE_NOT_ACQUIRED[]      = "Type: Not Acquired";
+const char TYPE_INVALID_ARG[]       = "Type: Invalid Arg";
+const char TYPE_MISMATCH[]          = "Type: Mismatch";
+
+struct data_tag {
+    struct type_tag *tag;
+    void (*tag_detach)(struct type_tag *tag);
+    size_t acquisitions;
+};
+
+/* Global per-thread map from data to type tag. */
+__thread Pvoid_t data_to_dtag = NULL;
+
+/* Handles are split into a page number and an index in the page. */
+#define HANDLE_PAGE_BITS 8
+#define HANDLE_PAGE ((size_t)1 << HANDLE_PAGE_BITS)
+
+/* Map values (or 0) for a page of handles. */
+struct handle_page {
+    size_t attached;                    /* Non-zero values. */
+    Word_t values[HANDLE_PAGE];
+};
+
+/* Global per-thread array from handle to type tag (see type_handle_attach). */
+struct handles {
+    struct handle_page **pages;         /* Pages (or NULL). */
+    size_t count;                       /* Length of pages. */
+};
+
+static __thread struct handles handles = {NULL, 0};
+
+static void
+free_tag(struct type_tag *tag)
+{
+    type_tag_fini(tag);
+    free(tag);
+}
+
+/* Map values are either a pointer to a struct data_tag record or, for tags
+ * without acquisitions, the tag pointer itself with the low bit set. If the
+ * tag was automatically created (and will be freed on detach), then the
+ * second lowest bit is also set. Records are only created when needed (and
+ * dropped on the last release).
+ */
+#define DTAG_DIRECT ((Word_t)0x1)
+#define DTAG_OWNED  ((Word_t)0x2)
+
+static inline unsigned int
+dtag_is_direct(
+        Word_t value)
+{
+    return (value & DTAG_DIRECT) != 0;
+}
+
+/* Returns the type tag stored in the map value. */
+static inline struct type_tag *
+dtag_tag(
+        Word_t value)
+{
+    if (dtag_is_direct(value)) {
+        return (struct type_tag *)(value & ~(DTAG_DIRECT | DTAG_OWNED));
+    }
+
+    return ((struct data_tag *)value)->tag;
+}
+
+typedef void (*tag_detach_f)(struct type_tag *tag);
+
+/* Returns the tag detach callback stored in the map value. */
+static inline tag_detach_f
+dtag_tag_detach(
+        Word_t value)
+{
+    if (dtag_is_direct(value)) {
+        return (value & DTAG_OWNED) ? free_tag : NULL;
+    }
+
+    return ((struct data_tag *)value)->tag_detach;
+}
+
+/* Returns the number of acquisitions stored in the map value. */
+static inline size_t
+dtag_acquisitions(
+        Word_t value)
+{
+    if (dtag_is_direct(value)) {
+        return 0;
+    }
+
+    return ((struct data_tag *)value)->acquisitions;
+}
+
+/* Returns the record for the map value, creating it if the tag is stored
+ * directly.
+ */
+static struct data_tag *
+dtag_record(
+        PWord_t PValue)
+{
+    Word_t value = *PValue;
+
+    if (!dtag_is_direct(value)) {
+        return (struct data_tag *)value;
+    }
+
+    struct data_tag *dtag = ecx_malloc(sizeof(struct data_tag));
+    dtag->tag = dtag_tag(value);
+    dtag->tag_detach = dtag_tag_detach(value);
+    dtag->acquisitions = 0;
+
+    *PValue = (Word_t)dtag;
+
+    return dtag;
+}
+
+/* Returns the map value for the tag. If the tag is NULL, then one is created
+ * (and returned in tag).
+ */
+static Word_t
+dtag_new(
+        struct type_tag **tag,
+        void (*tag_detach)(struct type_tag *tag))
+{
+    /* If no tag is provided, create one. */
+    if (*tag == NULL) {
+        if (tag_detach != NULL) {
+            stats_throw_str_static(TYPE_INVALID_ARG, "Tag is NULL, but tag_detach is not.");
+        }
+
+        *tag = ecx_malloc(type_tag_size());
+        type_tag_init(*tag, NULL);
+
+        return (Word_t)*tag | DTAG_DIRECT | DTAG_OWNED;
+    }
+
+    if (tag_detach == NULL) {
+        return (Word_t)*tag | DTAG_DIRECT;
+    }
+
+    /* Create internal data tag. */
+    struct data_tag *dtag = ecx_malloc(sizeof(struct data_tag));
+    dtag->tag = *tag;
+    dtag->tag_detach = tag_detach;
+    dtag->acquisitions = 0;
+
+    return (Word_t)dtag;
+}
+
+/* Throws unless the map value's tag can be detached (see type_detach(...)). */
+static void
+dtag_check_detach(
+        Word_t value,
+        struct type_tag *tag)
+{
+    size_t acquisitions = dtag_acquisitions(value);
+
+    /* Outstanding acquisitions? */
+    if (acquisitions != 0) {
+        char *msg = NULL;
+
+        /* Choose correct numbering. */
+        const char *acq = NULL;
+        const char acq1[] = "acquisition remains";
+        const char acq2[] = "acquisitions remain";
+        acq = acquisitions == 1 ? acq1 : acq2;
+
+        ecx_asprintf(&msg, "Can't detach because %zi %s.",
+                acquisitions, acq);
+        stats_throw_str(TYPE_STILL_ACQUIRED) msg;
+    }
+
+    /* Provided tag doesn't match attached. */
+    if (tag != NULL &&
+        tag != dtag_tag(value)) {
+        stats_throw_str_static(TYPE_MISMATCH,
+                "Tag provided doesn't match currently attached.");
+    }
+}
+
+/* Calls the tag detach callback and frees the record of a detached map value. */
+static void
+dtag_free(
+        Word_t value)
+{
+    struct type_tag *attached = dtag_tag(value);
+    tag_detach_f tag_detach = dtag_tag_detach(value);
+
+    /* Call the tag detach callback. */
+    if (tag_detach != NULL) {
+        tag_detach(attached);
+    }
+
+    if (!dtag_is_direct(value)) {
+        struct data_tag *dtag = (struct data_tag *)value;
+
+        dtag->tag = NULL;
+        dtag->tag_detach = NULL;
+        dtag->acquisitions = 0;
+
+        free(dtag);
+        dtag = NULL;
+    }
+}
+
+/* Throws unless the map value's tag can be released (see type_release(...)). */
+static void
+dtag_check_release(
+        Word_t value,
+        struct type_tag *tag)
+{
+    if (tag != NULL &&
+        tag != dtag_tag(value)) {
+        stats_throw_str_static(TYPE_MISMATCH,
+                "Provided tag doesn't match currently attached.");
+    }
+
+    if (dtag_acquisitions(value) == 0) {
+        stats_throw_str_static(TYPE_NOT_ACQUIRED, "No outstanding acquisitions to release.");
+    }
+}
+
+/* Releases the map value's tag. The tag is stored directly again once the
+ * record isn't needed.
+ */
+static void
+dtag_release(
+        PWord_t PValue)
+{
+    struct data_tag *dtag = (struct data_tag *)*PValue;
+    struct type_tag *tag = dtag->tag;
+
+    if (--dtag->acquisitions != 0) return;
+
+    if (dtag->tag_detach == NULL) {
+        *PValue = (Word_t)tag | DTAG_DIRECT;
+    }
+    else if (dtag->tag_detach == free_tag) {
+        *PValue = (Word_t)tag | DTAG_DIRECT | DTAG_OWNED;
+    }
+    else {
+        return;
+    }
+
+    free(dtag);
+}
+
+/* Adds the memory used by the map value to usage. */
+static void
+dtag_memory_usage(
+        Word_t value,
+        struct type_memory_usage *usage)
+{
+    /* Records (only for tags not stored directly). */
+    if (!dtag_is_direct(value)) {
+        usage->records += sizeof(struct data_tag);
+    }
+
+    /* Automatically created tags are owned by the registry. */
+    if (dtag_tag_detach(value) == free_tag) {
+        usage->tags += type_tag_size();
+        type_tag_memory_usage(dtag_tag(value), usage);
+    }
+}
+
+void
+type_attach(
+        struct type_tagged *tagged,
+        void (*tag_detach)(struct type_tag *tag))
+{
+    void *data = tagged->data;
+
+    /* Look for tag. */
+    PWord_t PValue = NULL;
+    JLG(PValue, data_to_dtag, (Word_t)data);
+
+    if (PValue != NULL) {
+        stats_throw_str_static(TYPE_ALREADY_ATTACHED, "Data already has a tag attached.");
+    }
+
+    Word_t value = dtag_new(&tagged->tag, tag_detach);
+    struct type_tag *tag = tagged->tag;
+
+    /* Insert mapping from data to type tag. */
+    PValue = NULL;
+    JLI(PValue, data_to_dtag, (Word_t)data);
+
+    *PValue = value;
+
+    if (index_enabled) {
+        index_tag(tag);
+        index_set(&tag_to_data, (Word_t)tag, (Word_t)data);
+    }
+
+    probe2(attach, data, tag);
+}
+
+void
+type_detach(
+        struct type_tagged *tagged)
+{
+    void *data = tagged->data;
+    struct type_tag *tag = tagged->tag;
+
+    /* Get tag. */
+    PWord_t PValue = NULL;
+    JLG(PValue, data_to_dtag, (Word_t)tagged->data);
+
+    if (PValue == NULL) {
+        stats_throw_str_static(TYPE_NOT_ATTACHED, "Data does not have a tag to detach.");
+    }
+
+    Word_t value = *PValue;
+    dtag_check_detach(value, tag);
+
+    struct type_tag *attached = dtag_tag(value);
+
+    /* Remove data to tag mapping. */
+    int status = 0;
+    JLD(status, data_to_dtag, (Word_t)data);
+
+    if (index_enabled) {
+        index_unset(&tag_to_data, (Word_t)attached, (Word_t)data);
+    }
+
+    probe2(detach, data, attached);
+
+    dtag_free(value);
+}
+
+unsigned int
+type_has_a(
+        void *data)
+{
+    /* Look for type tag. */
+    PWord_t PValue = NULL;
+    JLG(PValue, data_to_dtag, (Word_t)data);
+
+    if (PValue != NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+size_t
+type_acquisitions(
+        void *data)
+{
+    /* Look for type tag. */
+    Pvoid_t *PValue = NULL;
+    JLG(PValue, data_to_dtag, (Word_t)data);
+
+    if (PValue == NULL) {
+        stats_throw_str_static(TYPE_NOT_ATTACHED, "Data does not have a tag attached.");
+    }
+
+    return dtag_acquisitions((Word_t)*PValue);
+}
+
+/* Acquires the data's tag (see type_acquire(...)). Returns its acquisitions
+ * afterwards.
+ */
+static size_t
+data_acquire(
+        struct type_tagged *tagged)
+{
+    void *data = tagged->data;
+
+    /* Get data tag. */
+    PWord_t PValue = NULL;
+    JLG(PValue, data_to_dtag, (Word_t)data);
+
+    if (PValue == NULL) {
+        stats_throw_str_static(TYPE_NOT_ATTACHED, "Data does not have a tag attached.");
+    }
+
+    struct data_tag *dtag = dtag_record(PValue);
+    dtag->acquisitions++;
+
+    stats_count(NULL, acquires);
+
+    tagged->tag = dtag->tag;
+
+    return dtag->acquisitions;
+}
+
+void
+type_acquire(
+        struct type_tagged *tagged)
+{
+    size_t acquisitions = data_acquire(tagged);
+
+    probe3(acquire, tagged->data, tagged->tag, acquisitions);
+    profile_acquired(tagged->data, NULL, NULL, 0);
+}
+
+void
+type_acquire_at(
+        struct type_tagged *tagged,
+        const char *file,
+        unsigned int line)
+{
+    size_t acquisitions = data_acquire(tagged);
+
+    probe3(acquire, tagged->data, tagged->tag, acquisitions);
+    profile_acquired(tagged->data, NULL, file, line);
+}
+
+void
+type_release(
+        struct type_tagged *tagged)
+{
+    void *data = tagged->data;
+    struct type_tag *tag = tagged->tag;
+
+    /* Get data tag. */
+    PWord_t PValue = NULL;
+    JLG(PValue, data_to_dtag, (Word_t)data);
+
+    if (PValue == NULL) {
+        stats_throw_str_static(TYPE_NOT_ATTACHED, "Data does not have a tag attached.");
+    }
+
+    dtag_check_release(*PValue, tag);
+    dtag_release(PValue);
+
+    stats_count(NULL, releases);
+
+    probe3(release, data, dtag_tag(*PValue), dtag_acquisitions(*PValue));
+    profile_released(data, NULL);
+}
+
+int
+type_for_each(
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_tagged *tagged))
+{
+    int status = 0;
+
+    PWord_t PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, data_to_dtag, Index);
+
+    while (PValue != NULL) {
+        struct type_tagged tagged = {
+            .data = (void *)Index,
+            .tag = dtag_tag(*PValue),
+        };
+
+        /* Call action. */
+        status = action(self, &tagged);
+        if (status != 0) return status;
+
+        JLN(PValue, data_to_dtag, Index);
+    }
+
+    return status;
+}
+
+size_t
+type_registry_memory_usage(
+        struct type_memory_usage *usage)
+{
+    struct type_memory_usage local = {
+        .maps       = 0,
+        .records    = 0,
+        .tags       = 0,
+        .shared     = 0,
+    };
+
+    /* Map nodes. */
+    Word_t used = 0;
+    JLMU(used, data_to_dtag);
+    local.maps = used;
+
+    /* Loop over data tags. */
+    PWord_t PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, data_to_dtag, Index);
+
+    while (PValue != NULL) {
+        dtag_memory_usage(*PValue, &local);
+
+        JLN(PValue, data_to_dtag, Index);
+    }
+
+    /* Handles. */
+    if (handles.pages != NULL) {
+        local.maps += handles.count * sizeof(struct handle_page *);
+    }
+
+    for (size_t page = 0; page < handles.count; page++) {
+        if (handles.pages[page] == NULL) continue;
+
+        local.maps += sizeof(struct handle_page);
+
+        for (size_t i = 0; i < HANDLE_PAGE; i++) {
+            Word_t value = handles.pages[page]->values[i];
+            if (value != 0) dtag_memory_usage(value, &local);
+        }
+    }
+
+    /* Shapes. */
+    shape_memory_usage(&local);
+
+    /* Reverse index. */
+    index_memory_usage(index_tags, &local.maps);
+    index_memory_usage(type_to_tags, &local.maps);
+    index_memory_usage(tag_to_data, &local.maps);
+
+    if (usage != NULL) {
+        usage->maps += local.maps;
+        usage->records += local.records;
+        usage->tags += local.tags;
+        usage->shared += local.shared;
+    }
+
+    return local.maps + local.records + local.tags + local.shared;
+}
+
+/*** Handle ***/
+
+/* Returns the handle's map value slot (or NULL if its page isn't allocated). */
+static inline Word_t *
+handle_get(
+        size_t handle)
+{
+    size_t page = handle >> HANDLE_PAGE_BITS;
+
+    if (page >= handles.count || handles.pages[page] == NULL) {
+        return NULL;
+    }
+
+    return &handles.pages[page]->values[handle & (HANDLE_PAGE - 1)];
+}
+
+/* Returns the handle's map value (or 0 if it has no tag attached). */
+static inline Word_t
+handle_value(
+        size_t handle)
+{
+    Word_t *slot = handle_get(handle);
+
+    return slot != NULL ? *slot : 0;
+}
+
+/* Sets the map value of a handle without a tag, allocating its page (and
+ * growing the pages) if needed.
+ */
+static void
+handle_set(
+        size_t handle,
+        Word_t value)
+{
+    size_t page = handle >> HANDLE_PAGE_BITS;
+
+    if (page >= handles.count) {
+        size_t count = handles.count != 0 ? handles.count : 1;
+        while (count <= page) count *= 2;
+
+        handles.pages = ecx_realloc(handles.pages,
+                count * sizeof(struct handle_page *));
+        memset(handles.pages + handles.count, 0,
+                (count - handles.count) * sizeof(struct handle_page *));
+        handles.count = count;
+    }
+
+    if (handles.pages[page] == NULL) {
+        struct handle_page *values = ecx_malloc(sizeof(struct handle_page));
+        memset(values, 0, sizeof(struct handle_page));
+
+        handles.pages[page] = values;
+    }
+
+    handles.pages[page]->values[handle & (HANDLE_PAGE - 1)] = value;
+    handles.pages[page]->attached++;
+}
+
+/* Clears the map value of a handle with a tag, freeing its page once empty
+ * (and the pages once they're all empty).
+ */
+static void
+handle_unset(
+        size_t handle)
+{
+    size_t page = handle >> HANDLE_PAGE_BITS;
+    struct handle_page *values = handles.pages[page];
+
+    values->values[handle & (HANDLE_PAGE - 1)] = 0;
+    if (--values->attached != 0) return;
+
+    free(values);
+    handles.pages[page] = NULL;
+
+    for (size_t i = 0; i < handles.count; i++) {
+        if (handles.pages[i] != NULL) return;
+    }
+
+    free(handles.pages);
+    handles.pages = NULL;
+    handles.count = 0;
+}
+
+void
+type_handle_attach(
+        struct type_handle_tagged *tagged,
+        void (*tag_detach)(struct type_tag *tag))
+{
+    size_t handle = tagged->handle;
+
+    if (handle > TYPE_HANDLE_MAX) {
+        stats_throw_str_static(TYPE_INVALID_ARG, "Handle is larger than TYPE_HANDLE_MAX.");
+    }
+
+    if (handle_value(handle) != 0) {
+        stats_throw_str_static(TYPE_ALREADY_ATTACHED, "Handle already has a tag attached.");
+    }
+
+    Word_t value = dtag_new(&tagged->tag, tag_detach);
+
+    handle_set(handle, value);
+
+    probe2(handle_attach, handle, tagged->tag);
+}
+
+void
+type_handle_detach(
+        struct type_handle_tagged *tagged)
+{
+    size_t handle = tagged->handle;
+    Word_t value = handle_value(handle);
+
+    if (value == 0) {
+        stats_throw_str_static(TYPE_NOT_ATTACHED, "Handle does not have a tag to detach.");
+    }
+
+    dtag_check_detach(value, tagged->tag);
+
+    handle_unset(handle);
+
+    probe2(handle_detach, handle, dtag_tag(value));
+
+    dtag_free(value);
+}
+
+unsigned int
+type_handle_has_a(
+        size_t handle)
+{
+    return handle_value(handle) != 0;
+}
+
+size_t
+type_handle_acquisitions(
+        size_t handle)
+{
+    Word_t value = handle_value(handle);
+
+    if (value == 0) {
+        stats_throw_str_static(TYPE_NOT_ATTACHED, "Handle does not have a tag attached.");
+    }
+
+    return dtag_acquisitions(value);
+}
+
+void
+type_handle_acquire(
+        struct type_handle_tagged *tagged)
+{
+    Word_t *slot = handle_get(tagged->handle);
+
+    if (slot == NULL || *slot == 0) {
+        stats_throw_str_static(TYPE_NOT_ATTACHED, "Handle does not have a tag attached.");
+    }
+
+    struct data_tag *dtag = dtag_record(slot);
+    dtag->acquisitions++;
+
+    stats_count(NULL, acquires);
+
+    tagged->tag = dtag->tag;
+
+    probe3(handle_acquire, tagged->handle, tagged->tag, dtag->acquisitions);
+    profile_handle_acquired(tagged->handle, NULL, 0);
+}
+
+void
+type_handle_release(
+        struct type_handle_tagged *tagged)
+{
+    Word_t *slot = handle_get(tagged->handle);
+
+    if (slot == NULL || *slot == 0) {
+        stats_throw_str_static(TYPE_NOT_ATTACHED, "Handle does not have a tag attached.");
+    }
+
+    dtag_check_release(*slot, tagged->tag);
+    dtag_release(slot);
+
+    stats_count(NULL, releases);
+
+    probe3(handle_release, tagged->handle, dtag_tag(*slot),
+            dtag_acquisitions(*slot));
+    profile_handle_released(tagged->handle);
+}
+
+int
+type_handle_for_each(
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_handle_tagged *tagged))
+{
+    int status = 0;
+    size_t handle = 0;
+
+    /* The action may detach handles (and free their pages). */
+    while ((handle >> HANDLE_PAGE_BITS) < handles.count) {
+        Word_t *slot = handle_get(handle);
+
+        /* Skip unallocated pages. */
+        if (slot == NULL) {
+            handle = (handle | (HANDLE_PAGE - 1)) + 1;
+            continue;
+        }
+
+        if (*slot != 0) {
+            struct type_handle_tagged tagged = {
+                .handle = handle,
+                .tag = dtag_tag(*slot),
+            };
+
+            /* Call action. */
+            status = action(self, &tagged);
+            if (status != 0) return status;
+        }
+
+        handle++;
+    }
+
+    return status;
+}
+
+/*** Index ***/
+
+void
+type_index_enable()
+{
+    if (index_enabled) return;
+
+    index_enabled = 1;
+
+    /* Index the data in the registry (and their tags). */
+    PWord_t PValue = NULL;
+    Word_t Index = 0;
+
+    JLF(PValue, data_to_dtag, Index);
+
+    while (PValue != NULL) {
+        struct type_tag *tag = dtag_tag(*PValue);
+
+        index_tag(tag);
+        index_set(&tag_to_data, (Word_t)tag, Index);
+
+        JLN(PValue, data_to_dtag, Index);
+    }
+}
+
+void
+type_index_disable()
+{
+    index_enabled = 0;
+
+    Word_t freed = 0;
+    J1FA(freed, index_tags);
+
+    index_free(&type_to_tags);
+    index_free(&tag_to_data);
+}
+
+size_t
+type_index_tags(
+        const char *type,
+        struct type_tag **tags,
+        size_t size)
+{
+    Pvoid_t *PSet = NULL;
+    JLG(PSet, type_to_tags, (Word_t)type);
+
+    if (PSet == NULL) return 0;
+
+    size_t count = 0;
+    Word_t Index = 0;
+    int found = 0;
+
+    J1F(found, *PSet, Index);
+
+    while (found && count < size) {
+        tags[count++] = (struct type_tag *)Index;
+
+        J1N(found, *PSet, Index);
+    }
+
+    Word_t total = 0;
+    J1C(total, *PSet, 0, -1);
+
+    return total;
+}
+
+size_t
+type_index_data(
+        const char *type,
+        void **data,
+        size_t size)
+{
+    Pvoid_t *PTags = NULL;
+    JLG(PTags, type_to_tags, (Word_t)type);
+
+    if (PTags == NULL) return 0;
+
+    size_t total = 0;
+    Word_t Tag = 0;
+    int found = 0;
+
+    J1F(found, *PTags, Tag);
+
+    while (found) {
+        Pvoid_t *PSet = NULL;
+        JLG(PSet, tag_to_data, Tag);
+
+        if (PSet != NULL) {
+            Word_t Index = 0;
+            int more = 0;
+
+            J1F(more, *PSet, Index);
+
+            while (more && total < size) {
+                data[total++] = (void *)Index;
+
+                J1N(more, *PSet, Index);
+            }
+
+            /* Count the rest. */
+            if (more) {
+                Word_t rest = 0;
+                J1C(rest, *PSet, Index, -1);
+
+                total += rest;
+            }
+        }
+
+        J1N(found, *PTags, Tag);
+    }
+
+    return total;
+}
+
+/*** Mask ***/
+
+const char TYPE_MASK_FULL[]         = "Type Mask: Full";
+
+/* Vector of the mask words (for the batch filter). */
+typedef uint64_t mask_v __attribute__ ((vector_size (sizeof(struct type_mask))));
+
+void
+type_mask_init(
+        struct type_mask *mask)
+{
+    memset(mask, 0, sizeof(struct type_mask));
+}
+
+void
+type_mask_add(
+        struct type_mask *mask,
+        const char *type)
+{
+    unsigned int id = mask_id(type, 1);
+
+    if (id >= TYPE_MASK_BITS) {
+        char *msg = NULL;
+        ecx_asprintf(&msg,
+                "Can't add '%s', all %d mask IDs are in use.", type, TYPE_MASK_BITS);
+        stats_throw_str(TYPE_MASK_FULL) msg;
+    }
+
+    mask_set(mask, id);
+}
+
+/* Returns 1 if the type with the ID is (statically or through a parent)
+ * attached to the tag.
+ */
+static inline unsigned int
+mask_has_a(
+        struct type_tag *tag,
+        unsigned int id)
+{
+    return type_tag_has_a(tag, id_to_type[id]);
+}
+
+/* Returns true(1) if the tag's types are only found through its mask. */
+static inline unsigned int
+tag_mask_only(
+        struct type_tag *tag)
+{
+    return tag->parent == NULL && tag->hooks.has_a == NULL;
+}
+
+unsigned int
+type_tag_has_all(
+        struct type_tag *tag,
+        const struct type_mask *mask)
+{
+    struct type_mask scratch;
+    const struct type_mask *have = tag_mask(tag, &scratch);
+
+    for (unsigned int word = 0; word < TYPE_MASK_BITS / 64; word++) {
+        uint64_t missing = mask->bits[word] & ~have->bits[word];
+
+        while (missing != 0) {
+            if (tag_mask_only(tag)) return 0;
+
+            unsigned int bit = __builtin_ctzll(missing);
+            if (!mask_has_a(tag, word * 64 + bit)) return 0;
+
+            missing &= missing - 1;
+        }
+    }
+
+    return 1;
+}
+
+unsigned int
+type_tag_has_any(
+        struct type_tag *tag,
+        const struct type_mask *mask)
+{
+    struct type_mask scratch;
+    const struct type_mask *have = tag_mask(tag, &scratch);
+
+    for (unsigned int word = 0; word < TYPE_MASK_BITS / 64; word++) {
+        if (mask->bits[word] & have->bits[word]) return 1;
+    }
+
+    if (tag_mask_only(tag)) return 0;
+
+    for (unsigned int word = 0; word < TYPE_MASK_BITS / 64; word++) {
+        uint64_t missing = mask->bits[word];
+
+        while (missing != 0) {
+            unsigned int bit = __builtin_ctzll(missing);
+            if (mask_has_a(tag, word * 64 + bit)) return 1;
+
+            missing &= missing - 1;
+        }
+    }
+
+    return 0;
+}
+
+size_t
+type_tag_filter(
+        struct type_tag **tags,
+        size_t count,
+        const struct type_mask *mask,
+        struct type_tag **matched)
+{
+    mask_v need;
+    memcpy(&need, mask, sizeof(need));
+
+    size_t found = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct type_tag *tag = tags[i];
+
+        struct type_mask scratch;
+
+        mask_v have;
+        memcpy(&have, tag_mask(tag, &scratch), sizeof(have));
+
+        /* Reduce the missing bits to a single word. */
+        mask_v missing = need & ~have;
+        uint64_t any = 0;
+
+        for (unsigned int word = 0; word < TYPE_MASK_BITS / 64; word++) {
+            any |= missing[word];
+        }
+
+        if (any == 0 ||
+            (!tag_mask_only(tag) && type_tag_has_all(tag, mask))) {
+            matched[found++] = tag;
+        }
     }
 
-    struct impl *impl = *PValue;
-    return impl->acquisitions;
+    return found;
 }
 
-int
-type_tag_for_each(
-        struct type_tag *tag,
-        void *self,
-        int (*action)(
-            void *self,
-            struct type_tag_impl *tti))
-{
-    int status = 0;
+/*** Parallel ***/
 
-    /* First loop over static types. */
-    if (tag->hooks.for_each != NULL) {
-        status = tag->hooks.for_each(tag, self, action);
-        if (status != 0) return status;
-    }
+/* Chunks per thread (so faster threads can take on more of them). */
+#define PARALLEL_CHUNKS 8
 
-    /* Loop over dynamic types. */
-    Pvoid_t *PValue = NULL;
-    Word_t Index = 0;
+/* Chunks [next, end) still to be claimed from a thread's share. */
+struct parallel_range {
+    size_t next;
+    size_t end;
+};
 
-    const char *type = NULL;
-    struct impl *impl = NULL;
+/* A parallel iteration over a map's keys split into chunks. Each thread takes
+ * an equal share of the chunks and, once its own share is done, steals from
+ * the others'.
+ */
+struct parallel {
+    Word_t *starts;                     /* First key of each chunk. */
+    size_t chunks;
+    struct parallel_range *ranges;      /* Each thread's share. */
+    size_t threads;
+    size_t joined;                      /* Threads that joined (less one). */
+    size_t stop;                        /* Lowest chunk stopped early. */
+    int *statuses;                      /* Status of each chunk stopped. */
+
+    /* Calls the action for the keys in [start, end] of the chunk. */
+    int (*range)(struct parallel *parallel, size_t chunk, Word_t start, Word_t end);
+
+    void *source;                       /* Tag or map iterated over. */
+    void *self;
+    void *action;
+};
 
-    /* Get first type implementation. */
-    JLF(PValue, tag->type_to_impl, Index);
+/* Returns 1 if a chunk before this one stopped early (so its keys don't need
+ * to be visited).
+ */
+static inline unsigned int
+parallel_stopped(
+        struct parallel *parallel,
+        size_t chunk)
+{
+    return __atomic_load_n(&parallel->stop, __ATOMIC_RELAXED) < chunk;
+}
 
-    while (PValue != NULL) {
-        type = (const char *)Index;
-        impl = *PValue;
+static int
+parallel_tag_range(
+        struct parallel *parallel,
+        size_t chunk,
+        Word_t start,
+        Word_t end)
+{
+    struct type_tag *tag = parallel->source;
+    int (*action)(void *self, struct type_tag_impl *tti) = parallel->action;
+
+    Word_t Index = start;
+    Pvoid_t *PValue = tag_next(tag, &Index, 1);
+
+    while (PValue != NULL && Index <= end) {
+        if (parallel_stopped(parallel, chunk)) return 0;
 
         struct type_tag_impl tti = {
             .tag = tag,
-            .type = type,
-            .impl = impl,
+            .type = (const char *)Index,
+            .impl = impl_of((Word_t)*PValue),
         };
 
-        /* Call action. */
-        status = action(self, &tti);
+        int status = action(parallel->self, &tti);
         if (status != 0) return status;
 
-        /* Get next type implementation. */
-        JLN(PValue, tag->type_to_impl, Index);
+        if (Index == end) break;
+
+        PValue = tag_next(tag, &Index, 0);
     }
 
-    return status;
+    return 0;
 }
 
-struct type_tag_i TYPE_TAG_I = {
-    .size           = type_tag_size,
-    .align          = type_tag_align,
-
-    .init           = type_tag_init,
-    .fini           = type_tag_fini,
-
-    .attach         = type_tag_attach,
-    .detach         = type_tag_detach,
-    .detach_all     = type_tag_detach_all,
+static int
+parallel_data_range(
+        struct parallel *parallel,
+        size_t chunk,
+        Word_t start,
+        Word_t end)
+{
+    Pvoid_t map = parallel->source;
+    int (*action)(void *self, struct type_tagged *tagged) = parallel->action;
 
-    .is_static      = type_tag_is_static,
+    PWord_t PValue = NULL;
+    Word_t Index = start;
 
-    .attachments    = type_tag_attachments,
-    .has_a          = type_tag_has_a,
+    JLF(PValue, map, Index);
 
-    .acquire        = type_tag_acquire,
-    .release        = type_tag_release,
+    while (PValue != NULL && Index <= end) {
+        if (parallel_stopped(parallel, chunk)) return 0;
 
-    .acquisitions   = type_tag_acquisitions,
-    .for_each       = type_tag_for_each,
-};
+        struct type_tagged tagged = {
+            .data = (void *)Index,
+            .tag = dtag_tag(*PValue),
+        };
 
-/*** Global ***/
+        int status = action(parallel->self, &tagged);
+        if (status != 0) return status;
 
-const char TYPE_STILL_ATTACHED[]    = "Type: Still Attached";
-const char TYPE_ALREADY_ATTACHED[]  = "Type: Already Attached";
-const char TYPE_NOT_ATTACHED[]      = "Type: Not Attached";
-const char TYPE_STILL_ACQUIRED[]    = "Type: Still Acquired";
-const char TYPE_NOT_ACQUIRED[]      = "Type: Not Acquired";
-const char TYPE_INVALID_ARG[]       = "Type: Invalid Arg";
-const char TYPE_MISMATCH[]          = "Type: Mismatch";
+        if (Index == end) break;
 
-struct data_tag {
-    struct type_tag *tag;
-    void (*tag_detach)(struct type_tag *tag);
-    size_t acquisitions;
-};
+        JLN(PValue, map, Index);
+    }
 
-/* Global per-thread map from data to type tag. */
-__thread Pvoid_t data_to_dtag = NULL;
+    return 0;
+}
 
+/* Runs the chunks of the thread's share, then steals the others'. */
 static void
-free_tag(struct type_tag *tag)
+parallel_work(
+        struct parallel *parallel,
+        size_t thread)
 {
-    type_tag_fini(tag);
-    free(tag);
+    for (size_t i = 0; i < parallel->threads; i++) {
+        struct parallel_range *range =
+            &parallel->ranges[(thread + i) % parallel->threads];
+
+        for (;;) {
+            size_t chunk = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED);
+            if (chunk >= range->end || parallel_stopped(parallel, chunk)) break;
+
+            Word_t start = parallel->starts[chunk];
+            Word_t end = chunk + 1 < parallel->chunks ?
+                parallel->starts[chunk + 1] - 1 : (Word_t)-1;
+
+            int status = parallel->range(parallel, chunk, start, end);
+            if (status == 0) continue;
+
+            /* The lowest chunk stopped wins, so the result doesn't depend on
+             * the timing.
+             */
+            parallel->statuses[chunk] = status;
+
+            size_t stop = __atomic_load_n(&parallel->stop, __ATOMIC_RELAXED);
+            while (chunk < stop &&
+                   !__atomic_compare_exchange_n(&parallel->stop, &stop, chunk,
+                       0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        }
+    }
 }
 
-void
-type_attach(
-        struct type_tagged *tagged,
-        void (*tag_detach)(struct type_tag *tag))
+/* Workers kept between iterations. They're started on first use (and as more
+ * are needed) and only one iteration uses them at a time.
+ */
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static size_t pool_size = 0;            /* Workers started. */
+static struct parallel *pool_job = NULL;
+static size_t pool_wanted = 0;          /* Workers still to join the job. */
+static size_t pool_active = 0;          /* Workers working on the job. */
+
+static void *
+pool_worker(
+        void *arg)
 {
-    void *data = tagged->data;
-    struct type_tag *tag = tagged->tag;
-
-    /* Look for tag. */
-    PWord_t PValue = NULL;
-    JLG(PValue, data_to_dtag, (Word_t)data);
+    (void)arg;
 
-    if (PValue != NULL) {
-        ec_throw_str_static(TYPE_ALREADY_ATTACHED, "Data already has a tag attached.");
-    }
+    pthread_mutex_lock(&pool_lock);
 
-    /* If no tag is provided, create one. */
-    if (tag == NULL) {
-        if (tag_detach != NULL) {
-            ec_throw_str_static(TYPE_INVALID_ARG, "Tag is NULL, but tag_detach is not.");
+    for (;;) {
+        while (pool_wanted == 0) {
+            pthread_cond_wait(&pool_wake, &pool_lock);
         }
 
-        tag = ecx_malloc(type_tag_size());
-        type_tag_init(tag, NULL);
+        struct parallel *parallel = pool_job;
+        pool_wanted--;
+        pool_active++;
+
+        pthread_mutex_unlock(&pool_lock);
+
+        parallel_work(parallel,
+                __atomic_add_fetch(&parallel->joined, 1, __ATOMIC_RELAXED));
 
-        tagged->tag = tag;
-        tag_detach = free_tag;
+        pthread_mutex_lock(&pool_lock);
+
+        if (--pool_active == 0) {
+            pthread_cond_signal(&pool_idle);
+        }
     }
 
-    /* Create internal data tag. */
-    struct data_tag *dtag = ecx_malloc(sizeof(struct data_tag));
-    dtag->tag = tag;
-    dtag->tag_detach = tag_detach;
-    dtag->acquisitions = 0;
+    return NULL;
+}
 
-    /* Insert mapping from data to type tag. */
-    PValue = NULL;
-    JLI(PValue, data_to_dtag, (Word_t)data);
+/* Only the forking thread survives in the child. */
+static void
+pool_atfork_child()
+{
+    pool_size = 0;
+    pool_wanted = 0;
+    pool_active = 0;
+    pool_job = NULL;
 
-    *(void **)PValue = dtag;
+    pthread_mutex_init(&pool_busy, NULL);
+    pthread_mutex_init(&pool_lock, NULL);
 }
 
-void
-type_detach(
-        struct type_tagged *tagged)
+static void
+pool_init()
 {
-    void *data = tagged->data;
-    struct type_tag *tag = tagged->tag;
+    pthread_atfork(NULL, NULL, pool_atfork_child);
+}
 
-    /* Get tag. */
-    PWord_t PValue = NULL;
-    JLG(PValue, data_to_dtag, (Word_t)tagged->data);
+/* Runs the iteration with the calling thread and up to threads - 1 workers
+ * from the pool. If the pool is in use (e.g. by an action of another
+ * iteration) or a worker can't be started, the rest of the work is done
+ * without them.
+ */
+static int
+parallel_run(
+        struct parallel *parallel,
+        size_t threads)
+{
+    parallel->threads = threads;
+    parallel->joined = 0;
+    parallel->stop = (size_t)-1;
+    parallel->statuses = ecx_malloc(sizeof(int) * parallel->chunks);
+    parallel->ranges = ecx_malloc(sizeof(struct parallel_range) * threads);
+
+    for (size_t i = 0; i < threads; i++) {
+        parallel->ranges[i].next = i * parallel->chunks / threads;
+        parallel->ranges[i].end = (i + 1) * parallel->chunks / threads;
+    }
 
-    if (PValue == NULL) {
-        ec_throw_str_static(TYPE_NOT_ATTACHED, "Data does not have a tag to detach.");
+    if (threads > 1 && pthread_mutex_trylock(&pool_busy) == 0) {
+        pthread_once(&pool_once, pool_init);
+        pthread_mutex_lock(&pool_lock);
+
+        while (pool_size < threads - 1) {
+            pthread_t worker;
+            if (pthread_create(&worker, NULL, pool_worker, NULL) != 0) break;
+
+            pthread_detach(worker);
+            pool_size++;
+        }
+
+        pool_job = parallel;
+        pool_wanted = pool_size < threads - 1 ? pool_size : threads - 1;
+        pthread_cond_broadcast(&pool_wake);
+
+        pthread_mutex_unlock(&pool_lock);
+
+        parallel_work(parallel, 0);
+
+        /* Workers that haven't joined yet aren't needed anymore. */
+        pthread_mutex_lock(&pool_lock);
+
+        pool_wanted = 0;
+        while (pool_active != 0) {
+            pthread_cond_wait(&pool_idle, &pool_lock);
+        }
+        pool_job = NULL;
+
+        pthread_mutex_unlock(&pool_lock);
+        pthread_mutex_unlock(&pool_busy);
+    }
+    else {
+        parallel_work(parallel, 0);
     }
 
-    struct data_tag *dtag = (void *)*PValue;
+    size_t stop = __atomic_load_n(&parallel->stop, __ATOMIC_ACQUIRE);
+    int status = stop < parallel->chunks ? parallel->statuses[stop] : 0;
 
-    /* Outstanding acquisitions? */
-    if (dtag->acquisitions != 0) {
-        char *msg = NULL;
+    free(parallel->ranges);
+    free(parallel->statuses);
+    free(parallel->starts);
 
-        /* Choose correct numbering. */
-        const char *acq = NULL;
-        const char acq1[] = "acquisition remains";
-        const char acq2[] = "acquisitions remain";
-        acq = dtag->acquisitions == 1 ? acq1 : acq2;
+    return status;
+}
 
-        ecx_asprintf(&msg, "Can't detach because %zi %s.",
-                dtag->acquisitions, acq);
-        ec_throw_str(TYPE_STILL_ACQUIRED) msg;
+/* Returns the number of threads to use (and the chunk size for count keys). */
+static size_t
+parallel_threads(
+        size_t threads,
+        size_t count,
+        size_t *size)
+{
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
     }
 
-    /* Provided tag doesn't match attached. */
-    if (tag != NULL &&
-        tag != dtag->tag) {
-        ec_throw_str_static(TYPE_MISMATCH,
-                "Tag provided doesn't match currently attached.");
+    *size = count / (threads * PARALLEL_CHUNKS);
+    if (*size == 0) {
+        *size = 1;
     }
 
-    /* Remove data to tag mapping. */
+    return threads;
+}
+
+int
+type_tag_for_each_parallel(
+        struct type_tag *tag,
+        size_t threads,
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_tag_impl *tti))
+{
     int status = 0;
-    JLD(status, data_to_dtag, (Word_t)data);
 
-    /* Call the tag detach callback. */
-    if (dtag->tag_detach != NULL) {
-        dtag->tag_detach(dtag->tag);
+    /* First loop over static types. */
+    if (tag->hooks.for_each != NULL) {
+        status = tag->hooks.for_each(tag, self, action);
+        if (status != 0) return status;
     }
 
-    dtag->tag = NULL;
-    dtag->tag_detach = NULL;
-    dtag->acquisitions = 0;
+    if (tag->count == 0) return status;
 
-    free(dtag);
-    dtag = NULL;
-}
+    size_t size = 0;
+    threads = parallel_threads(threads, tag->count, &size);
 
-unsigned int
-type_has_a(
-        void *data)
-{
-    /* Look for type tag. */
-    PWord_t PValue = NULL;
-    JLG(PValue, data_to_dtag, (Word_t)data);
+    struct parallel parallel = {
+        .starts = ecx_malloc(sizeof(Word_t) * (tag->count / size + 1)),
+        .chunks = 0,
+        .range = parallel_tag_range,
+        .source = tag,
+        .self = self,
+        .action = action,
+    };
 
-    if (PValue != NULL) {
-        return 1;
+    if (tag->base == NULL) {
+        /* Split at every size-th key. */
+        for (Word_t nth = 1; nth <= tag->count; nth += size) {
+            Pvoid_t *PValue = NULL;
+            Word_t Index = 0;
+
+            JLBC(PValue, tag->type_to_impl, nth, Index);
+
+            parallel.starts[parallel.chunks++] = Index;
+        }
     }
+    else {
+        /* Shared entries are merged, so walk them to split. */
+        Pvoid_t *PValue = NULL;
+        Word_t Index = 0;
+        size_t n = 0;
 
-    return 0;
+        PValue = tag_next(tag, &Index, 1);
+
+        while (PValue != NULL) {
+            if (n++ % size == 0) {
+                parallel.starts[parallel.chunks++] = Index;
+            }
+
+            PValue = tag_next(tag, &Index, 0);
+        }
+    }
+
+    return parallel_run(&parallel, threads);
 }
 
-size_t
-type_acquisitions(
-        void *data)
+int
+type_for_each_parallel(
+        size_t threads,
+        void *self,
+        int (*action)(
+            void *self,
+            struct type_tagged *tagged))
 {
-    /* Look for type tag. */
-    Pvoid_t *PValue = NULL;
-    JLG(PValue, data_to_dtag, (Word_t)data);
+    Word_t count = 0;
+    JLC(count, data_to_dtag, 0, -1);
 
-    if (PValue == NULL) {
-        ec_throw_str_static(TYPE_NOT_ATTACHED, "Data does not have a tag attached.");
+    if (count == 0) return 0;
+
+    size_t size = 0;
+    threads = parallel_threads(threads, count, &size);
+
+    struct parallel parallel = {
+        .starts = ecx_malloc(sizeof(Word_t) * (count / size + 1)),
+        .chunks = 0,
+        .range = parallel_data_range,
+        .source = data_to_dtag,
+        .self = self,
+        .action = action,
+    };
+
+    /* Split at every size-th key. */
+    for (Word_t nth = 1; nth <= count; nth += size) {
+        PWord_t PValue = NULL;
+        Word_t Index = 0;
+
+        JLBC(PValue, data_to_dtag, nth, Index);
+
+        parallel.starts[parallel.chunks++] = Index;
     }
 
-    struct data_tag *dtag = (void *)*PValue;
-    return dtag->acquisitions;
+    return parallel_run(&parallel, threads);
 }
 
+/*** Optimistic ***/
+
 void
-type_acquire(
-        struct type_tagged *tagged)
+type_tag_optimistic_enable(
+        struct type_tag *tag)
 {
-    void *data = tagged->data;
-
-    /* Get data tag. */
-    PWord_t PValue = NULL;
-    JLG(PValue, data_to_dtag, (Word_t)data);
+    if (tag->optimistic != NULL) return;
 
-    if (PValue == NULL) {
-        ec_throw_str_static(TYPE_NOT_ATTACHED, "Data does not have a tag attached.");
-    }
+    struct optimistic *optimistic = ecx_malloc(sizeof(struct optimistic));
+    optimistic->sequence = 0;
+    optimistic->mirror = mirror_new(tag);
 
-    struct data_tag *dtag = (void *)*PValue;
-    dtag->acquisitions++;
+    tag->optimistic = optimistic;
+}
 
-    tagged->tag = dtag->tag;
+size_t
+type_tag_optimistic_begin(
+        struct type_tag *tag)
+{
+    /* Mirrors are only replaced whole, so reads needn't wait out a change in
+     * progress: they see the types from before it (and retry if it ends).
+     */
+    return __atomic_load_n(&tag->optimistic->sequence, __ATOMIC_ACQUIRE);
 }
 
-void
-type_release(
-        struct type_tagged *tagged)
+void *
+type_tag_optimistic_get(
+        struct type_tag *tag,
+        const char *type)
 {
-    void *data = tagged->data;
-    struct type_tag *tag = tagged->tag;
+    struct reader *self = reader_get();
+    struct mirror *mirror = __atomic_load_n(&tag->optimistic->mirror, __ATOMIC_ACQUIRE);
 
-    /* Get data tag. */
-    PWord_t PValue = NULL;
-    JLG(PValue, data_to_dtag, (Word_t)data);
+    /* Keeps the mirror from being freed while it's searched. */
+    for (;;) {
+        __atomic_store_n(&self->hazard, mirror, __ATOMIC_SEQ_CST);
 
-    if (PValue == NULL) {
-        ec_throw_str_static(TYPE_NOT_ATTACHED, "Data does not have a tag attached.");
+        struct mirror *current = __atomic_load_n(&tag->optimistic->mirror, __ATOMIC_SEQ_CST);
+        if (current == mirror) break;
+
+        mirror = current;
     }
 
-    struct data_tag *dtag = (void *)*PValue;
+    void *impl = NULL;
+    size_t low = 0;
+    size_t high = mirror->count;
 
-    if (tag != NULL &&
-        tag != dtag->tag) {
-        ec_throw_str_static(TYPE_MISMATCH,
-                "Provided tag doesn't match currently attached.");
-    }
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const char *found = mirror->entries[middle].type;
 
-    if (dtag->acquisitions == 0) {
-        ec_throw_str_static(TYPE_NOT_ACQUIRED, "No outstanding acquisitions to release.");
+        if (found == type) {
+            impl = mirror->entries[middle].impl;
+            break;
+        }
+        else if ((Word_t)found < (Word_t)type) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
     }
 
-    dtag->acquisitions--;
+    __atomic_store_n(&self->hazard, NULL, __ATOMIC_RELEASE);
+
+    return impl;
 }
 
+unsigned int
+type_tag_optimistic_retry(
+        struct type_tag *tag,
+        size_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&tag->optimistic->sequence, __ATOMIC_RELAXED) != sequence;
+}
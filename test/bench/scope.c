@@ -0,0 +1,191 @@
+/* Copyright 2011 Caleb Case
+ *
+ * This file is part of the Type Library.
+ *
+ * The Type Library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * The Type Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the Type Library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compares the cost of the scoped acquisition macros: type_tag_with(...) and
+ * type_with(...) (unwind handlers) against type_tag_scope(...) and
+ * type_scope(...) (cleanup attributes), with plain acquire and release as the
+ * baseline. The inline fast path (see type_inline.h) and immortal
+ * implementations (see type_tag_attach_immortal(...)) are included too.
+ *
+ * Usage: scope [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ec/ec.h>
+#include <ecx_stdlib.h>
+#include <type.h>
+#include <type_inline.h>
+
+const char integer[] = "integer";
+const char natural[] = "natural";
+struct integer {
+    int i;
+};
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(
+        const char *name,
+        double start,
+        size_t iterations)
+{
+    printf("%-24s %8.2f ns\n", name, (now() - start) / iterations);
+}
+
+int
+main(
+        int argc,
+        char **argv)
+{
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    struct type_tag_impl immortal = {
+        .tag = tag,
+        .type = natural,
+        .impl = &int_impl,
+    };
+    type_tag_attach_immortal(&immortal);
+
+    int data = 0;
+    struct type_tagged tagged = {
+        .data = &data,
+        .tag = tag,
+    };
+    type_attach(&tagged, NULL);
+
+    struct integer *impl = NULL;
+    struct type_tag *acquired = NULL;
+    double start = 0;
+
+    /* Type tags. */
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        struct type_tag_impl received = {
+            .tag = tag,
+            .type = integer,
+            .impl = NULL,
+        };
+
+        type_tag_acquire(&received);
+        ((struct integer *)received.impl)->i++;
+        type_tag_release(&received);
+    }
+    report("type_tag_acquire", start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        struct type_tag_impl received = {
+            .tag = tag,
+            .type = integer,
+            .impl = NULL,
+        };
+
+        type_tag_acquire_inline(&received);
+        ((struct integer *)received.impl)->i++;
+        type_tag_release_inline(&received);
+    }
+    report("type_tag_acquire_inline", start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        type_tag_with (tag, integer, impl) {
+            impl->i++;
+        }
+    }
+    report("type_tag_with", start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        type_tag_scope (tag, integer, impl) {
+            impl->i++;
+        }
+    }
+    report("type_tag_scope", start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        type_tag_with (tag, natural, impl) {
+            impl->i++;
+        }
+    }
+    report("type_tag_with immortal", start, iterations);
+
+    /* Data. */
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        struct type_tagged received = {
+            .data = &data,
+            .tag = NULL,
+        };
+
+        type_acquire(&received);
+        acquired = received.tag;
+        type_release(&received);
+    }
+    report("type_acquire", start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        type_with (&data, acquired) {
+            data++;
+        }
+    }
+    report("type_with", start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        type_scope (&data, acquired) {
+            data++;
+        }
+    }
+    report("type_scope", start, iterations);
+
+    type_detach(&tagged);
+    type_tag_detach(&tti);
+
+    /* Detaches the immortal. */
+    type_tag_fini(tag);
+    free(tag);
+
+    return 0;
+}
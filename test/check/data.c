@@ -88,6 +88,314 @@ START_TEST(data_basic)
 }
 END_TEST
 
+START_TEST(data_memory_usage)
+{
+    char data[] = "data";
+
+    struct type_tagged tagged = {
+        .data = data,
+        .tag = NULL,
+    };
+
+    type_attach(&tagged, NULL);
+
+    struct type_memory_usage usage = {
+        .maps = 0,
+        .records = 0,
+        .tags = 0,
+        .shared = 0,
+    };
+
+    /* Tags without acquisitions don't need a record. */
+    size_t total = type_registry_memory_usage(&usage);
+    fail_unless(total == usage.maps + usage.records + usage.tags + usage.shared);
+    fail_unless(usage.records == 0);
+    fail_unless(usage.tags >= type_tag_size());
+
+    struct type_tag *tag = NULL;
+    type_with (data, tag) {
+        usage.records = 0;
+        type_registry_memory_usage(&usage);
+        fail_unless(usage.records != 0);
+    }
+
+    usage.records = 0;
+    type_registry_memory_usage(&usage);
+    fail_unless(usage.records == 0);
+
+    type_detach(&tagged);
+}
+END_TEST
+
+START_TEST(data_stats)
+{
+    char data[] = "data";
+
+    struct type_tagged tagged = {
+        .data = data,
+        .tag = NULL,
+    };
+
+    type_attach(&tagged, NULL);
+
+    type_stats_reset();
+    type_stats_enable(1);
+
+    struct type_tag *tag = NULL;
+    type_with (data, tag) {
+    }
+
+    type_stats_enable(0);
+
+    struct type_stats stats;
+    type_stats_get(&stats);
+    fail_unless(stats.acquires == 1);
+    fail_unless(stats.releases == 1);
+
+    type_stats_reset();
+    type_detach(&tagged);
+}
+END_TEST
+
+START_TEST(data_index)
+{
+    char before[] = "before";
+    char after[] = "after";
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    /* Data tagged before the index is enabled. */
+    struct type_tagged tagged = {
+        .data = before,
+        .tag = NULL,
+    };
+    type_attach(&tagged, NULL);
+
+    struct type_tag_impl tti = {
+        .tag = tagged.tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    type_index_enable();
+
+    void *found[2] = {NULL, NULL};
+    fail_unless(type_index_data(integer, found, 2) == 1);
+    fail_unless(found[0] == before);
+
+    /* Data tagged after shares the tag. */
+    struct type_tagged shared = {
+        .data = after,
+        .tag = tagged.tag,
+    };
+    type_attach(&shared, NULL);
+
+    fail_unless(type_index_data(integer, found, 2) == 2);
+    fail_unless(type_index_data(integer, found, 1) == 2);
+
+    struct type_tag *tags[1] = {NULL};
+    fail_unless(type_index_tags(integer, tags, 1) == 1);
+    fail_unless(tags[0] == tagged.tag);
+
+    /* Detaching the type removes the tag (and its data). */
+    type_tag_detach(&tti);
+    fail_unless(type_index_tags(integer, tags, 1) == 0);
+    fail_unless(type_index_data(integer, found, 2) == 0);
+
+    /* So does detaching all of them. */
+    type_tag_attach(&tti, NULL);
+    fail_unless(type_index_tags(integer, tags, 1) == 1);
+
+    type_tag_detach_all(tagged.tag);
+    fail_unless(type_index_tags(integer, tags, 1) == 0);
+
+    type_tag_attach(&tti, NULL);
+    fail_unless(type_index_tags(integer, tags, 1) == 1);
+    type_tag_detach(&tti);
+
+    type_detach(&shared);
+    type_detach(&tagged);
+
+    type_index_disable();
+}
+END_TEST
+
+static int
+count_data(void *self, struct type_tagged *tagged)
+{
+    (void)tagged;
+    __atomic_add_fetch((size_t *)self, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int
+find_data(void *self, struct type_tagged *tagged)
+{
+    return tagged->data == self ? 1 : 0;
+}
+
+START_TEST(data_for_each)
+{
+    char data[100];
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        struct type_tagged tagged = {
+            .data = &data[i],
+            .tag = NULL,
+        };
+        type_attach(&tagged, NULL);
+    }
+
+    size_t count = 0;
+    fail_unless(type_for_each(&count, count_data) == 0);
+    fail_unless(count == sizeof(data));
+
+    count = 0;
+    fail_unless(type_for_each_parallel(4, &count, count_data) == 0);
+    fail_unless(count == sizeof(data));
+
+    fail_unless(type_for_each(&data[50], find_data) == 1);
+    fail_unless(type_for_each_parallel(4, &data[50], find_data) == 1);
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        struct type_tagged tagged = {
+            .data = &data[i],
+            .tag = NULL,
+        };
+        type_detach(&tagged);
+    }
+}
+END_TEST
+
+static int
+count_handles(
+        void *self,
+        struct type_handle_tagged *tagged)
+{
+    size_t *count = self;
+    (*count)++;
+
+    /* Detaching during the loop is allowed. */
+    type_handle_detach(tagged);
+
+    return 0;
+}
+
+static int
+last_hold(
+        void *self,
+        struct type_profile_hold *hold)
+{
+    struct type_profile_hold *found = self;
+    *found = *hold;
+
+    return 0;
+}
+
+START_TEST(data_handle)
+{
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    size_t before = type_registry_memory_usage(NULL);
+
+    struct type_handle_tagged tagged = {
+        .handle = 3,
+        .tag = NULL,
+    };
+
+    type_handle_attach(&tagged, NULL);
+    fail_unless(tagged.tag != NULL);
+    fail_unless(type_handle_has_a(3));
+    fail_unless(!type_handle_has_a(4));
+    fail_unless(!type_handle_has_a(TYPE_HANDLE_MAX + 1));
+
+    struct type_tag_impl tti = {
+        .tag = tagged.tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+
+    type_tag_attach(&tti, NULL);
+
+    struct type_handle_tagged received = {
+        .handle = 3,
+        .tag = NULL,
+    };
+
+    /* Counted and profiled like data. */
+    type_stats_reset();
+    type_stats_enable(1);
+    type_profile_enable();
+
+    type_handle_acquire(&received);
+    fail_unless(received.tag == tagged.tag);
+    fail_unless(type_handle_acquisitions(3) == 1);
+
+    type_handle_release(&received);
+    fail_unless(type_handle_acquisitions(3) == 0);
+
+    struct type_profile_histogram histogram;
+    type_profile_histogram(NULL, &histogram);
+    fail_unless(histogram.count == 1);
+
+    /* Holds of the handle are kept apart from data at the same address. */
+    struct type_tagged data = {
+        .data = (void *)3,
+        .tag = tagged.tag,
+    };
+    type_attach(&data, NULL);
+
+    type_acquire_at(&data, __FILE__, __LINE__);
+    type_handle_acquire(&received);
+    type_release(&data);
+
+    struct type_profile_hold hold = {
+        .kind = TYPE_PROFILE_DATA,
+    };
+    fail_unless(type_profile_for_each(&hold, last_hold) == 0);
+    fail_unless(hold.kind == TYPE_PROFILE_HANDLE);
+    fail_unless(hold.key == NULL && hold.handle == 3);
+    fail_unless(hold.file == NULL);
+
+    type_handle_release(&received);
+    type_detach(&data);
+
+    type_profile_disable();
+    type_stats_enable(0);
+
+    struct type_stats stats;
+    type_stats_get(&stats);
+    fail_unless(stats.acquires == 3);
+    fail_unless(stats.releases == 3);
+    type_stats_reset();
+
+    type_tag_detach(&tti);
+
+    /* Handles on other pages. */
+    for (size_t handle = 1000; handle < 1100; handle++) {
+        struct type_handle_tagged other = {
+            .handle = handle,
+            .tag = NULL,
+        };
+        type_handle_attach(&other, NULL);
+    }
+
+    fail_unless(type_registry_memory_usage(NULL) > before);
+
+    size_t count = 0;
+    fail_unless(type_handle_for_each(&count, count_handles) == 0);
+    fail_unless(count == 101);
+    fail_unless(!type_handle_has_a(3));
+
+    fail_unless(type_registry_memory_usage(NULL) == before);
+}
+END_TEST
+
 Suite *
 data_suite(void)
 {
@@ -95,6 +403,11 @@ data_suite(void)
 
     TCase *tc_d = tcase_create("Data");
     tcase_add_test(tc_d, data_basic);
+    tcase_add_test(tc_d, data_memory_usage);
+    tcase_add_test(tc_d, data_stats);
+    tcase_add_test(tc_d, data_index);
+    tcase_add_test(tc_d, data_for_each);
+    tcase_add_test(tc_d, data_handle);
     /* tcase_add_test(tc_d, data_iterator); */
     suite_add_tcase(s, tc_d);
 
@@ -0,0 +1,239 @@
+/* Copyright 2011 Caleb Case
+ *
+ * This file is part of the Type Library.
+ *
+ * The Type Library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * The Type Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the Type Library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <ec/ec.h>
+#include <ecx_stdlib.h>
+#include <type.h>
+
+const char integer[] = "integer";
+const char number[] = "number";
+const char real[] = "real";
+
+int integer_impl;
+int number_impl;
+int mixed_impl;
+
+START_TEST(dispatch_basic)
+{
+    type_subtype(integer, number);
+    type_subtype(real, number);
+
+    struct type_dispatch *dispatch = ecx_malloc(type_dispatch_size());
+    type_dispatch_init(dispatch);
+
+    type_dispatch_register(dispatch, number, number, &number_impl);
+    type_dispatch_register(dispatch, integer, real, &mixed_impl);
+
+    struct type_tag *a = ecx_malloc(type_tag_size());
+    struct type_tag *b = ecx_malloc(type_tag_size());
+    type_tag_init(a, NULL);
+    type_tag_init(b, NULL);
+
+    struct type_tag_impl tti_a = {
+        .tag = a,
+        .type = integer,
+        .impl = &integer_impl,
+    };
+    type_tag_attach(&tti_a, NULL);
+
+    struct type_tag_impl tti_b = {
+        .tag = b,
+        .type = integer,
+        .impl = &integer_impl,
+    };
+    type_tag_attach(&tti_b, NULL);
+
+    /* Both are numbers. */
+    fail_unless(type_dispatch(dispatch, a, b) == &number_impl);
+    fail_unless(type_dispatch(dispatch, a, b) == &number_impl);
+
+    /* The more specific pair is preferred once it matches. */
+    tti_b.type = real;
+    type_tag_attach(&tti_b, NULL);
+    fail_unless(type_dispatch(dispatch, a, b) == &mixed_impl);
+
+    /* Registration changes invalidate the cache. */
+    type_dispatch_unregister(dispatch, integer, real);
+    fail_unless(type_dispatch(dispatch, a, b) == &number_impl);
+
+    type_tag_detach(&tti_b);
+    tti_b.type = integer;
+    type_tag_detach(&tti_b);
+    type_tag_detach(&tti_a);
+
+    type_tag_fini(b);
+    type_tag_fini(a);
+    type_dispatch_fini(dispatch);
+
+    free(b);
+    free(a);
+    free(dispatch);
+}
+END_TEST
+
+START_TEST(dispatch_evict)
+{
+    struct type_dispatch *dispatch = ecx_malloc(type_dispatch_size());
+    type_dispatch_init(dispatch);
+
+    type_dispatch_register(dispatch, integer, integer, &integer_impl);
+
+    struct type_tag *b = ecx_malloc(type_tag_size());
+    type_tag_init(b, NULL);
+
+    struct type_tag_impl tti = {
+        .tag = b,
+        .type = integer,
+        .impl = &integer_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    /* Short lived tags only take cache space while they're used. */
+    for (size_t i = 0; i < 1000; i++) {
+        struct type_tag *a = ecx_malloc(type_tag_size());
+        type_tag_init(a, NULL);
+
+        tti.tag = a;
+        type_tag_attach(&tti, NULL);
+
+        fail_unless(type_dispatch(dispatch, a, b) == &integer_impl);
+        fail_unless(type_dispatch(dispatch, b, a) == &integer_impl);
+
+        type_tag_detach(&tti);
+        type_tag_fini(a);
+        free(a);
+    }
+
+    tti.tag = b;
+    type_tag_detach(&tti);
+    type_tag_fini(b);
+    type_dispatch_fini(dispatch);
+
+    free(b);
+    free(dispatch);
+}
+END_TEST
+
+/* Tables share the cache, but never each other's entries. */
+START_TEST(dispatch_tables)
+{
+    struct type_dispatch *first = ecx_malloc(type_dispatch_size());
+    struct type_dispatch *second = ecx_malloc(type_dispatch_size());
+    type_dispatch_init(first);
+    type_dispatch_init(second);
+
+    type_dispatch_register(first, integer, integer, &integer_impl);
+    type_dispatch_register(second, integer, integer, &mixed_impl);
+
+    struct type_tag *a = ecx_malloc(type_tag_size());
+    type_tag_init(a, NULL);
+
+    struct type_tag_impl tti = {
+        .tag = a,
+        .type = integer,
+        .impl = &integer_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    for (size_t i = 0; i < 3; i++) {
+        fail_unless(type_dispatch(first, a, a) == &integer_impl);
+        fail_unless(type_dispatch(second, a, a) == &mixed_impl);
+    }
+
+    type_tag_detach(&tti);
+    type_tag_fini(a);
+    type_dispatch_fini(second);
+    type_dispatch_fini(first);
+
+    free(a);
+    free(second);
+    free(first);
+}
+END_TEST
+
+/* NULL means not found, so it can't be registered (the uncaught exception
+ * aborts).
+ */
+START_TEST(dispatch_null)
+{
+    struct type_dispatch *dispatch = ecx_malloc(type_dispatch_size());
+    type_dispatch_init(dispatch);
+
+    type_dispatch_register(dispatch, integer, integer, NULL);
+}
+END_TEST
+
+/* Neither pair is more specific (the uncaught exception aborts). */
+START_TEST(dispatch_ambiguous)
+{
+    type_subtype(integer, number);
+
+    struct type_dispatch *dispatch = ecx_malloc(type_dispatch_size());
+    type_dispatch_init(dispatch);
+
+    type_dispatch_register(dispatch, integer, number, &integer_impl);
+    type_dispatch_register(dispatch, number, integer, &number_impl);
+
+    struct type_tag *a = ecx_malloc(type_tag_size());
+    type_tag_init(a, NULL);
+
+    struct type_tag_impl tti = {
+        .tag = a,
+        .type = integer,
+        .impl = &integer_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    type_dispatch(dispatch, a, a);
+}
+END_TEST
+
+Suite *
+dispatch_suite(void)
+{
+    Suite *s = suite_create("Dispatch");
+
+    TCase *tc_d = tcase_create("Dispatch");
+    tcase_add_test(tc_d, dispatch_basic);
+    tcase_add_test(tc_d, dispatch_evict);
+    tcase_add_test(tc_d, dispatch_tables);
+    tcase_add_test_raise_signal(tc_d, dispatch_ambiguous, SIGABRT);
+    tcase_add_test_raise_signal(tc_d, dispatch_null, SIGABRT);
+    suite_add_tcase(s, tc_d);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+
+    SRunner *sr = srunner_create(dispatch_suite());
+
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+
+    srunner_free(sr);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,184 @@
+/* Copyright 2011 Caleb Case
+ *
+ * This file is part of the Type Library.
+ *
+ * The Type Library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * The Type Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the Type Library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <ec/ec.h>
+#include <ecx_stdlib.h>
+#include <type.h>
+
+/* Any shared library will do, so use the C library. */
+#define LIBRARY "libc.so.6"
+
+START_TEST(plugin_basic)
+{
+    char path[] = "/tmp/type-plugin-XXXXXX";
+    int fd = mkstemp(path);
+    fail_unless(fd != -1);
+
+    FILE *manifest = fdopen(fd, "w");
+    fprintf(manifest, "# type library symbol\n");
+    fprintf(manifest, "sorter " LIBRARY " qsort\n");
+    fprintf(manifest, "\n");
+    fprintf(manifest, "missing " LIBRARY " no_such_symbol # Never loaded.\n");
+    fclose(manifest);
+
+    type_plugin_manifest(path);
+    unlink(path);
+
+    const char *sorter = type_plugin_intern("sorter");
+    fail_unless(sorter == type_plugin_intern("sorter"));
+
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = sorter,
+        .impl = NULL,
+    };
+    type_tag_attach_plugin(&tti);
+
+    /* The missing symbol is only a problem if acquired. */
+    tti.type = type_plugin_intern("missing");
+    type_tag_attach_plugin(&tti);
+    type_tag_detach(&tti);
+
+    void *impl = NULL;
+    type_tag_with (tag, sorter, impl) {
+        fail_unless(impl != NULL);
+    }
+
+    tti.type = sorter;
+    type_tag_detach(&tti);
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+/* Writes the manifest to a temporary file and loads it. */
+static void
+plugin_manifest(
+        const char *contents)
+{
+    char path[] = "/tmp/type-plugin-XXXXXX";
+    int fd = mkstemp(path);
+    fail_unless(fd != -1);
+
+    FILE *manifest = fdopen(fd, "w");
+    fputs(contents, manifest);
+    fclose(manifest);
+
+    /* Unlinked first, since a bad manifest throws. */
+    FILE *file = fopen(path, "r");
+    unlink(path);
+
+    char link[64];
+    snprintf(link, sizeof(link), "/dev/fd/%d", fileno(file));
+    type_plugin_manifest(link);
+    fclose(file);
+}
+
+/* The uncaught exceptions below abort. */
+START_TEST(plugin_load_failed)
+{
+    plugin_manifest("absent " LIBRARY " no_such_symbol\n");
+
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = type_plugin_intern("absent"),
+        .impl = NULL,
+    };
+    type_tag_attach_plugin(&tti);
+
+    void *impl = NULL;
+    type_tag_with (tag, tti.type, impl) {
+    }
+}
+END_TEST
+
+START_TEST(plugin_no_library)
+{
+    plugin_manifest("orphan /no/such/library.so qsort\n");
+
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = type_plugin_intern("orphan"),
+        .impl = NULL,
+    };
+    type_tag_attach_plugin(&tti);
+
+    void *impl = NULL;
+    type_tag_with (tag, tti.type, impl) {
+    }
+}
+END_TEST
+
+START_TEST(plugin_bad_manifest)
+{
+    plugin_manifest("sorter " LIBRARY "\n");
+}
+END_TEST
+
+START_TEST(plugin_no_manifest)
+{
+    type_plugin_manifest("/no/such/manifest");
+}
+END_TEST
+
+Suite *
+plugin_suite(void)
+{
+    Suite *s = suite_create("Plugin");
+
+    TCase *tc_p = tcase_create("Plugin");
+    tcase_add_test(tc_p, plugin_basic);
+    tcase_add_test_raise_signal(tc_p, plugin_load_failed, SIGABRT);
+    tcase_add_test_raise_signal(tc_p, plugin_no_library, SIGABRT);
+    tcase_add_test_raise_signal(tc_p, plugin_bad_manifest, SIGABRT);
+    tcase_add_test_raise_signal(tc_p, plugin_no_manifest, SIGABRT);
+    suite_add_tcase(s, tc_p);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+
+    SRunner *sr = srunner_create(plugin_suite());
+
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+
+    srunner_free(sr);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
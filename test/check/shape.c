@@ -0,0 +1,138 @@
+/* Copyright 2011 Caleb Case
+ *
+ * This file is part of the Type Library.
+ *
+ * The Type Library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * The Type Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the Type Library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+#include <stdlib.h>
+
+#include <ec/ec.h>
+#include <ecx_stdlib.h>
+#include <type.h>
+
+const char integer[] = "integer";
+struct integer {
+    int i;
+};
+
+const char real[] = "real";
+struct real {
+    double r;
+};
+
+START_TEST(shape_basic)
+{
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct real real_impl = {
+        .r = 0.0,
+    };
+
+    struct type_tag *empty = type_shape_empty();
+    fail_unless(type_tag_is_shape(empty));
+    fail_unless(type_tag_attachments(empty) == 0);
+
+    /* Attach in one order. */
+    struct type_tag_impl tti = {
+        .tag = empty,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    struct type_tag *a = type_shape_attach(&tti);
+
+    tti.tag = a;
+    tti.type = real;
+    tti.impl = &real_impl;
+    a = type_shape_attach(&tti);
+
+    /* Attach in the other order. */
+    tti.tag = empty;
+    struct type_tag *b = type_shape_attach(&tti);
+
+    tti.tag = b;
+    tti.type = integer;
+    tti.impl = &int_impl;
+    b = type_shape_attach(&tti);
+
+    /* Same contents, same shape. */
+    fail_unless(a == b);
+    fail_unless(type_tag_attachments(a) == 2);
+
+    /* Transitions are cached. */
+    tti.tag = empty;
+    fail_unless(type_shape_attach(&tti) == type_shape_attach(&tti));
+
+    /* Shapes can be attached to data directly. */
+    char data[] = "data";
+    struct type_tagged tagged = {
+        .data = data,
+        .tag = a,
+    };
+    type_attach(&tagged, NULL);
+
+    struct type_tag *tag = NULL;
+    struct integer *impl = NULL;
+    type_with (data, tag) {
+        fail_unless(tag == a);
+
+        type_tag_with (tag, integer, impl) {
+            impl->i++;
+        }
+    }
+    fail_unless(int_impl.i == 1);
+
+    type_detach(&tagged);
+
+    /* Detaching everything returns to the empty shape. */
+    tti.tag = a;
+    tti.type = integer;
+    tti.impl = NULL;
+    a = type_shape_detach(&tti);
+
+    tti.tag = a;
+    tti.type = real;
+    fail_unless(type_shape_detach(&tti) == empty);
+}
+END_TEST
+
+Suite *
+shape_suite(void)
+{
+    Suite *s = suite_create("Shape");
+
+    TCase *tc_s = tcase_create("Shape");
+    tcase_add_test(tc_s, shape_basic);
+    suite_add_tcase(s, tc_s);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+
+    SRunner *sr = srunner_create(shape_suite());
+
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+
+    srunner_free(sr);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
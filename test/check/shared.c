@@ -0,0 +1,425 @@
+/* Copyright 2011 Caleb Case
+ *
+ * This file is part of the Type Library.
+ *
+ * The Type Library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * The Type Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the Type Library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <ec/ec.h>
+#include <ecx_stdlib.h>
+#include <type.h>
+
+#define SIZE (64 * 1024)
+
+static int impls[4];
+
+START_TEST(shared_basic)
+{
+    struct type_shared *shared = type_shared_create(NULL, SIZE);
+    fail_unless(type_shared_fd(shared) != -1);
+
+    size_t used = type_shared_memory_usage(shared);
+
+    size_t a = type_shared_intern(shared, "a");
+    size_t b = type_shared_intern(shared, "b");
+    fail_unless(a != 0 && b != 0 && a != b);
+    fail_unless(a == type_shared_intern(shared, "a"));
+    fail_unless(strcmp(type_shared_name(shared, b), "b") == 0);
+
+    struct type_shared_tag *tag = type_shared_tag(shared, "tag");
+    fail_unless(tag == type_shared_tag(shared, "tag"));
+    fail_unless(tag != type_shared_tag(shared, "other"));
+
+    struct type_shared_impl tsi = {
+        .tag = tag,
+        .type = b,
+        .id = type_shared_provide(shared, "b", &impls[1]),
+        .impl = NULL,
+    };
+    type_shared_attach(shared, &tsi);
+
+    tsi.type = a;
+    tsi.id = type_shared_provide(shared, "a", &impls[0]);
+    type_shared_attach(shared, &tsi);
+
+    fail_unless(type_shared_has_a(shared, tag, a));
+    fail_unless(type_shared_has_a(shared, tag, b));
+    fail_unless(!type_shared_has_a(shared, tag, type_shared_intern(shared, "c")));
+
+    tsi.type = b;
+    type_shared_acquire(shared, &tsi);
+    fail_unless(tsi.impl == &impls[1]);
+    fail_unless(type_shared_acquisitions(shared, &tsi) == 1);
+
+    type_shared_release(shared, &tsi);
+    fail_unless(tsi.impl == NULL);
+    fail_unless(type_shared_acquisitions(shared, &tsi) == 0);
+
+    type_shared_detach(shared, &tsi);
+    fail_unless(!type_shared_has_a(shared, tag, b));
+    fail_unless(type_shared_has_a(shared, tag, a));
+
+    tsi.type = a;
+    type_shared_detach(shared, &tsi);
+    fail_unless(!type_shared_has_a(shared, tag, a));
+
+    fail_unless(type_shared_memory_usage(shared) > used);
+
+    type_shared_close(shared);
+}
+END_TEST
+
+START_TEST(shared_fork)
+{
+    struct type_shared *shared = type_shared_create(NULL, SIZE);
+    struct type_shared_tag *tag = type_shared_tag(shared, "tag");
+
+    struct type_shared_impl tsi = {
+        .tag = tag,
+        .type = type_shared_intern(shared, "a"),
+        .id = type_shared_provide(shared, "impl-a", &impls[0]),
+        .impl = NULL,
+    };
+    type_shared_attach(shared, &tsi);
+
+    pid_t pid = fork();
+    fail_unless(pid != -1);
+
+    if (pid == 0) {
+        /* The worker maps the segment again and finds the same tag, but with
+         * its own implementation.
+         */
+        struct type_shared *mapped = type_shared_map(dup(type_shared_fd(shared)));
+        type_shared_provide(mapped, "impl-a", &impls[2]);
+
+        struct type_shared_impl worker = {
+            .tag = type_shared_tag(mapped, "tag"),
+            .type = type_shared_intern(mapped, "a"),
+            .id = 0,
+            .impl = NULL,
+        };
+        type_shared_acquire(mapped, &worker);
+
+        struct type_shared_impl other = {
+            .tag = worker.tag,
+            .type = type_shared_intern(mapped, "b"),
+            .id = type_shared_provide(mapped, "impl-b", &impls[1]),
+            .impl = NULL,
+        };
+        type_shared_attach(mapped, &other);
+
+        _exit(worker.impl == &impls[2] ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status = 0;
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    /* The worker's changes are visible. */
+    fail_unless(type_shared_acquisitions(shared, &tsi) == 1);
+    fail_unless(type_shared_has_a(shared, tag, type_shared_intern(shared, "b")));
+
+    /* Resolved with this process's implementation. */
+    struct type_shared_impl other = {
+        .tag = tag,
+        .type = type_shared_intern(shared, "b"),
+        .id = 0,
+        .impl = NULL,
+    };
+    type_shared_provide(shared, "impl-b", &impls[3]);
+    type_shared_acquire(shared, &other);
+    fail_unless(other.impl == &impls[3]);
+    type_shared_release(shared, &other);
+
+    type_shared_release(shared, &tsi);
+    type_shared_detach(shared, &tsi);
+
+    type_shared_close(shared);
+}
+END_TEST
+
+START_TEST(shared_detach_acquired)
+{
+    struct type_shared *shared = type_shared_create(NULL, SIZE);
+    struct type_shared_tag *tag = type_shared_tag(shared, "tag");
+
+    struct type_shared_impl tsi = {
+        .tag = tag,
+        .type = type_shared_intern(shared, "b"),
+        .id = type_shared_provide(shared, "b", &impls[1]),
+        .impl = NULL,
+    };
+    type_shared_attach(shared, &tsi);
+
+    tsi.type = type_shared_intern(shared, "a");
+    tsi.id = type_shared_provide(shared, "a", &impls[0]);
+    type_shared_attach(shared, &tsi);
+
+    type_shared_acquire(shared, &tsi);
+
+    size_t used = type_shared_memory_usage(shared);
+
+    /* The detach throws (and aborts) in a child process. */
+    pid_t pid = fork();
+    fail_unless(pid != -1);
+
+    if (pid == 0) {
+        type_shared_detach(shared, &tsi);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status = 0;
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    fail_unless(WIFSIGNALED(status));
+
+    /* Failing didn't use up space in the segment. */
+    fail_unless(type_shared_memory_usage(shared) == used);
+    fail_unless(type_shared_acquisitions(shared, &tsi) == 1);
+
+    type_shared_release(shared, &tsi);
+    type_shared_detach(shared, &tsi);
+
+    type_shared_close(shared);
+}
+END_TEST
+
+START_TEST(shared_not_provided)
+{
+    struct type_shared *shared = type_shared_create(NULL, SIZE);
+
+    struct type_shared_impl tsi = {
+        .tag = type_shared_tag(shared, "tag"),
+        .type = type_shared_intern(shared, "a"),
+        .id = type_shared_provide(shared, "a", &impls[0]),
+        .impl = NULL,
+    };
+    type_shared_attach(shared, &tsi);
+
+    /* Another mapping hasn't provided the implementation, so the acquire
+     * throws (and aborts) in a child process.
+     */
+    pid_t pid = fork();
+    fail_unless(pid != -1);
+
+    if (pid == 0) {
+        struct type_shared *mapped = type_shared_map(dup(type_shared_fd(shared)));
+        type_shared_acquire(mapped, &tsi);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status = 0;
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    fail_unless(WIFSIGNALED(status));
+
+    /* The failed acquire isn't counted, so the type can be detached. */
+    fail_unless(type_shared_acquisitions(shared, &tsi) == 0);
+    type_shared_detach(shared, &tsi);
+
+    type_shared_close(shared);
+}
+END_TEST
+
+START_TEST(shared_reattach)
+{
+    struct type_shared *shared = type_shared_create(NULL, SIZE);
+
+    struct type_shared_impl tsi = {
+        .tag = type_shared_tag(shared, "tag"),
+        .type = type_shared_intern(shared, "a"),
+        .id = type_shared_provide(shared, "a", &impls[0]),
+        .impl = NULL,
+    };
+    type_shared_attach(shared, &tsi);
+    type_shared_detach(shared, &tsi);
+
+    size_t used = type_shared_memory_usage(shared);
+
+    /* Attaching again reuses the type's entry. */
+    for (size_t i = 0; i < 10000; i++) {
+        tsi.id = type_shared_provide(shared, i % 2 ? "a" : "b", &impls[i % 2]);
+        type_shared_attach(shared, &tsi);
+
+        type_shared_acquire(shared, &tsi);
+        fail_unless(tsi.impl == &impls[i % 2]);
+        type_shared_release(shared, &tsi);
+
+        type_shared_detach(shared, &tsi);
+    }
+
+    /* Only the second name was interned. */
+    fail_unless(type_shared_memory_usage(shared) - used <= 64);
+
+    type_shared_close(shared);
+}
+END_TEST
+
+START_TEST(shared_export)
+{
+    static const char A[] = "a";
+    static const char B[] = "b";
+
+    struct type_tag *local = ecx_malloc(type_tag_size());
+    type_tag_init(local, NULL);
+
+    struct type_tag_impl tti = {
+        .tag = local,
+        .type = A,
+        .impl = &impls[0],
+    };
+    type_tag_attach(&tti, NULL);
+
+    tti.type = B;
+    tti.impl = &impls[1];
+    type_tag_attach(&tti, NULL);
+
+    struct type_shared *shared = type_shared_create(NULL, SIZE);
+    struct type_shared_tag *tag = type_shared_tag(shared, "tag");
+
+    type_shared_export(shared, tag, local);
+
+    struct type_shared_impl tsi = {
+        .tag = tag,
+        .type = type_shared_intern(shared, B),
+        .id = 0,
+        .impl = NULL,
+    };
+    type_shared_acquire(shared, &tsi);
+    fail_unless(tsi.impl == &impls[1]);
+    type_shared_release(shared, &tsi);
+
+    fail_unless(type_shared_has_a(shared, tag, type_shared_intern(shared, A)));
+
+    /* Other processes provide theirs by the same name. */
+    struct type_shared *mapped = type_shared_map(dup(type_shared_fd(shared)));
+    type_shared_provide(mapped, "tag/b", &impls[2]);
+
+    type_shared_acquire(mapped, &tsi);
+    fail_unless(tsi.impl == &impls[2]);
+    type_shared_release(mapped, &tsi);
+
+    type_shared_close(mapped);
+
+    type_shared_close(shared);
+
+    type_tag_detach_all(local);
+    type_tag_fini(local);
+    free(local);
+}
+END_TEST
+
+/* Counts the types (see shared_bind). */
+static int
+shared_count(
+        void *self,
+        struct type_tag_impl *tti)
+{
+    size_t *count = self;
+    if (tti->impl != NULL) (*count)++;
+
+    return 0;
+}
+
+START_TEST(shared_bind)
+{
+    static const char A[] = "a";
+    static const char B[] = "b";
+
+    struct type_shared *shared = type_shared_create(NULL, SIZE);
+    struct type_shared_tag *tag = type_shared_tag(shared, "tag");
+
+    struct type_shared_impl tsi = {
+        .tag = tag,
+        .type = type_shared_intern(shared, "a"),
+        .id = type_shared_provide(shared, "a", &impls[0]),
+        .impl = NULL,
+    };
+    type_shared_attach(shared, &tsi);
+
+    struct type_tag *local = type_shared_bind(shared, tag);
+
+    /* Types are found by name. */
+    fail_unless(type_tag_has_a(local, A));
+    fail_unless(!type_tag_has_a(local, B));
+
+    struct type_tag_impl tti = {
+        .tag = local,
+        .type = A,
+        .impl = NULL,
+    };
+    type_tag_acquire(&tti);
+    fail_unless(tti.impl == &impls[0]);
+    fail_unless(type_tag_acquisitions(&tti) == 1);
+    fail_unless(type_shared_acquisitions(shared, &tsi) == 1);
+
+    type_tag_release(&tti);
+    fail_unless(type_shared_acquisitions(shared, &tsi) == 0);
+
+    /* Changes to the shared tag are seen. */
+    tsi.type = type_shared_intern(shared, B);
+    tsi.id = type_shared_provide(shared, "b", &impls[1]);
+    type_shared_attach(shared, &tsi);
+    fail_unless(type_tag_has_a(local, B));
+    fail_unless(type_tag_attachments(local) == 2);
+
+    size_t count = 0;
+    type_tag_for_each(local, &count, shared_count);
+    fail_unless(count == 2);
+
+    type_shared_detach(shared, &tsi);
+    fail_unless(!type_tag_has_a(local, B));
+
+    type_shared_unbind(local);
+    type_shared_close(shared);
+}
+END_TEST
+
+Suite *
+shared_suite(void)
+{
+    Suite *s = suite_create("Shared");
+
+    TCase *tc_s = tcase_create("Shared");
+    tcase_add_test(tc_s, shared_basic);
+    tcase_add_test(tc_s, shared_fork);
+    tcase_add_test(tc_s, shared_detach_acquired);
+    tcase_add_test(tc_s, shared_not_provided);
+    tcase_add_test(tc_s, shared_reattach);
+    tcase_add_test(tc_s, shared_export);
+    tcase_add_test(tc_s, shared_bind);
+    suite_add_tcase(s, tc_s);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+
+    SRunner *sr = srunner_create(shared_suite());
+
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+
+    srunner_free(sr);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
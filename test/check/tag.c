@@ -17,11 +17,16 @@
  */
 
 #include <check.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <ec/ec.h>
 #include <ecx_stdlib.h>
 #include <type.h>
+#include <type_inline.h>
 
 const char integer[] = "integer";
 struct integer {
@@ -73,6 +78,1444 @@ START_TEST(tag_basic)
 }
 END_TEST
 
+START_TEST(tag_memory_usage)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+
+    type_tag_init(tag, NULL);
+
+    fail_unless(type_tag_memory_usage(tag, NULL) == 0);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+
+    type_tag_attach(&tti, NULL);
+
+    struct type_memory_usage usage = {
+        .maps = 0,
+        .records = 0,
+        .tags = 0,
+        .shared = 0,
+    };
+
+    size_t total = type_tag_memory_usage(tag, &usage);
+    fail_unless(total > 0);
+    fail_unless(total == usage.maps + usage.records + usage.tags + usage.shared);
+    fail_unless(usage.tags == 0);
+    fail_unless(usage.records == 0);
+
+    /* Records are only kept while needed. */
+    type_tag_acquire(&tti);
+
+    usage.records = 0;
+    type_tag_memory_usage(tag, &usage);
+    fail_unless(usage.records != 0);
+
+    type_tag_release(&tti);
+
+    usage.records = 0;
+    type_tag_memory_usage(tag, &usage);
+    fail_unless(usage.records == 0);
+
+    type_tag_detach(&tti);
+    fail_unless(type_tag_memory_usage(tag, NULL) == 0);
+
+    type_tag_fini(tag);
+
+    free(tag);
+}
+END_TEST
+
+static unsigned int detached = 0;
+
+static void
+count_detach(void *impl)
+{
+    (void)impl;
+    detached++;
+}
+
+START_TEST(tag_clone)
+{
+    struct type_tag *src = ecx_malloc(type_tag_size());
+    struct type_tag *dst = ecx_malloc(type_tag_size());
+
+    type_tag_init(src, NULL);
+    type_tag_init(dst, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct integer other_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = src,
+        .type = integer,
+        .impl = &int_impl,
+    };
+
+    type_tag_attach(&tti, count_detach);
+
+    type_tag_clone(src, dst);
+    fail_unless(type_tag_attachments(dst) == 1);
+    fail_unless(type_tag_has_a(dst, integer));
+
+    /* Acquisitions are independent. */
+    struct integer *impl = NULL;
+    type_tag_with (dst, integer, impl) {
+        fail_unless(impl == &int_impl);
+
+        struct type_tag_impl acq = {
+            .tag = src,
+            .type = integer,
+            .impl = NULL,
+        };
+        fail_unless(type_tag_acquisitions(&acq) == 0);
+
+        acq.tag = dst;
+        fail_unless(type_tag_acquisitions(&acq) == 1);
+    }
+
+    /* Detaching from the source doesn't affect the clone. */
+    type_tag_detach(&tti);
+    fail_unless(!type_tag_has_a(src, integer));
+    fail_unless(type_tag_has_a(dst, integer));
+    fail_unless(detached == 0);
+
+    /* Changes to the clone don't affect the source. */
+    tti.tag = dst;
+    tti.impl = NULL;
+    type_tag_detach(&tti);
+
+    tti.impl = &other_impl;
+    type_tag_attach(&tti, NULL);
+    fail_unless(!type_tag_has_a(src, integer));
+
+    /* The shared implementation is detached once nothing shares it. */
+    fail_unless(detached == 1);
+
+    type_tag_detach_all(dst);
+
+    type_tag_fini(dst);
+    type_tag_fini(src);
+
+    free(dst);
+    free(src);
+}
+END_TEST
+
+START_TEST(tag_clone_detach)
+{
+    struct type_tag *src = ecx_malloc(type_tag_size());
+    struct type_tag *dst = ecx_malloc(type_tag_size());
+
+    type_tag_init(src, NULL);
+    type_tag_init(dst, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = src,
+        .type = integer,
+        .impl = &int_impl,
+    };
+
+    detached = 0;
+
+    type_tag_attach(&tti, count_detach);
+    type_tag_clone(src, dst);
+
+    type_tag_detach_all(dst);
+    fail_unless(detached == 0);
+
+    type_tag_fini(dst);
+    free(dst);
+
+    /* Nothing shares the implementation any more, so it's detached now. */
+    type_tag_detach(&tti);
+    fail_unless(detached == 1);
+    fail_unless(!type_tag_has_a(src, integer));
+
+    type_tag_fini(src);
+    fail_unless(detached == 1);
+
+    free(src);
+}
+END_TEST
+
+START_TEST(tag_parent)
+{
+    struct type_tag *parent = ecx_malloc(type_tag_size());
+    struct type_tag *child = ecx_malloc(type_tag_size());
+
+    type_tag_init(parent, NULL);
+    type_tag_init(child, NULL);
+
+    type_tag_set_parent(child, parent);
+    fail_unless(type_tag_parent(child) == parent);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = parent,
+        .type = integer,
+        .impl = &int_impl,
+    };
+
+    type_tag_attach(&tti, NULL);
+
+    fail_unless(type_tag_has_a(child, integer));
+    fail_unless(type_tag_attachments(child) == 0);
+
+    /* Resolving through the parent doesn't allocate in the child. */
+    size_t used = type_tag_memory_usage(child, NULL);
+
+    /* Acquisitions are counted by the parent. */
+    struct integer *impl = NULL;
+    type_tag_with (child, integer, impl) {
+        fail_unless(impl == &int_impl);
+        fail_unless(type_tag_memory_usage(child, NULL) == used);
+
+        struct type_tag_impl acq = {
+            .tag = parent,
+            .type = integer,
+            .impl = NULL,
+        };
+        fail_unless(type_tag_acquisitions(&acq) == 1);
+    }
+
+    /* Changes to the parent are seen by the child. */
+    type_tag_detach(&tti);
+    fail_unless(!type_tag_has_a(child, integer));
+
+    type_tag_attach(&tti, NULL);
+
+    type_tag_with (child, integer, impl) {
+        fail_unless(impl == &int_impl);
+    }
+
+    type_tag_detach(&tti);
+
+    type_tag_fini(child);
+    type_tag_fini(parent);
+
+    free(child);
+    free(parent);
+}
+END_TEST
+
+const char number[] = "number";
+const char natural[] = "natural";
+
+START_TEST(tag_subtype)
+{
+    type_subtype(integer, number);
+    type_subtype(natural, integer);
+
+    fail_unless(type_is_a(natural, number));
+    fail_unless(type_is_a(integer, integer));
+    fail_unless(!type_is_a(number, integer));
+
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+    struct integer nat_impl = {
+        .i = 1,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    struct type_tag_impl acq = {
+        .tag = tag,
+        .type = number,
+        .impl = NULL,
+    };
+    type_tag_acquire_a(&acq);
+    fail_unless(acq.type == integer);
+    fail_unless(acq.impl == &int_impl);
+    type_tag_release(&acq);
+
+    /* A more specific subtype wins once attached. */
+    struct type_tag_impl nat = {
+        .tag = tag,
+        .type = natural,
+        .impl = &nat_impl,
+    };
+    type_tag_attach(&nat, NULL);
+
+    acq.type = number;
+    type_tag_acquire_a(&acq);
+    fail_unless(acq.type == natural);
+    fail_unless(acq.impl == &nat_impl);
+    type_tag_release(&acq);
+
+    type_tag_detach(&nat);
+    type_tag_detach(&tti);
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+static unsigned int created = 0;
+
+static void *
+create_integer(void *ctx)
+{
+    created++;
+    return ctx;
+}
+
+START_TEST(tag_lazy)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = NULL,
+    };
+
+    /* Never materialized, never detached. */
+    created = 0;
+    detached = 0;
+
+    type_tag_attach_lazy(&tti, create_integer, &int_impl, count_detach);
+    fail_unless(type_tag_has_a(tag, integer));
+
+    type_tag_detach(&tti);
+    fail_unless(created == 0);
+    fail_unless(detached == 0);
+
+    /* Materialized on the first acquire only. */
+    type_tag_attach_lazy(&tti, create_integer, &int_impl, count_detach);
+
+    struct integer *impl = NULL;
+    type_tag_with (tag, integer, impl) {
+        fail_unless(impl == &int_impl);
+    }
+    type_tag_with (tag, integer, impl) {
+        fail_unless(impl == &int_impl);
+    }
+    fail_unless(created == 1);
+
+    type_tag_detach(&tti);
+    fail_unless(detached == 1);
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+START_TEST(tag_cursor)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct type_tag_cursor cursor;
+    fail_unless(!type_tag_cursor_first(&cursor, tag));
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+    struct integer nat_impl = {
+        .i = 1,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    tti.type = natural;
+    tti.impl = &nat_impl;
+    type_tag_attach(&tti, NULL);
+
+    struct integer *impl = NULL;
+    type_tag_with (tag, natural, impl) {
+        /* Visit both, in order. */
+        size_t count = 0;
+        const char *last = NULL;
+
+        for (unsigned int more = type_tag_cursor_first(&cursor, tag);
+             more;
+             more = type_tag_cursor_next(&cursor)) {
+            fail_unless(last == NULL || last < cursor.entry.type);
+            last = cursor.entry.type;
+
+            if (cursor.entry.type == natural) {
+                fail_unless(cursor.entry.impl == &nat_impl);
+                fail_unless(cursor.entry.acquisitions == 1);
+            }
+
+            count++;
+        }
+        fail_unless(count == 2);
+
+        /* Snapshots are truncated to the size given. */
+        struct type_tag_entry entries[2];
+        fail_unless(type_tag_snapshot(tag, entries, 1) == 2);
+        fail_unless(type_tag_snapshot(tag, entries, 2) == 2);
+        fail_unless(entries[0].type < entries[1].type);
+    }
+
+    type_tag_detach_all(tag);
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+START_TEST(tag_mask)
+{
+    struct type_tag *parent = ecx_malloc(type_tag_size());
+    struct type_tag *child = ecx_malloc(type_tag_size());
+
+    type_tag_init(parent, NULL);
+    type_tag_init(child, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = child,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    struct type_mask both;
+    type_mask_init(&both);
+    type_mask_add(&both, integer);
+    type_mask_add(&both, number);
+
+    fail_unless(!type_tag_has_all(child, &both));
+    fail_unless(type_tag_has_any(child, &both));
+
+    /* Masks follow attach and detach. */
+    tti.type = number;
+    type_tag_attach(&tti, NULL);
+    fail_unless(type_tag_has_all(child, &both));
+
+    type_tag_detach(&tti);
+    fail_unless(!type_tag_has_all(child, &both));
+
+    /* Types given an ID after the mask was built are found too. */
+    static const char late[] = "late";
+    static const char later[] = "later";
+
+    struct type_tag *frozen = ecx_malloc(type_tag_size());
+    type_tag_init(frozen, NULL);
+
+    tti.type = late;
+    type_tag_attach(&tti, NULL);
+    tti.tag = frozen;
+    tti.type = later;
+    type_tag_attach(&tti, NULL);
+    type_tag_freeze(frozen);
+
+    fail_unless(!type_tag_has_any(frozen, &both));
+
+    struct type_mask lately;
+    type_mask_init(&lately);
+    type_mask_add(&lately, late);
+    fail_unless(type_tag_has_any(child, &lately));
+
+    type_mask_init(&lately);
+    type_mask_add(&lately, later);
+    fail_unless(type_tag_has_any(frozen, &lately));
+    fail_unless(!type_tag_has_any(child, &lately));
+
+    type_tag_fini(frozen);
+    free(frozen);
+
+    tti.tag = child;
+    tti.type = late;
+    type_tag_detach(&tti);
+    tti.type = number;
+
+    /* Types attached to the parent count too. */
+    tti.tag = parent;
+    type_tag_attach(&tti, NULL);
+    type_tag_set_parent(child, parent);
+
+    struct type_tag *tags[2] = {parent, child};
+    fail_unless(type_tag_filter(tags, 2, &both, tags) == 1);
+    fail_unless(tags[0] == child);
+
+    type_tag_detach(&tti);
+    type_tag_set_parent(child, NULL);
+
+    tti.tag = child;
+    tti.type = integer;
+    type_tag_detach(&tti);
+
+    type_tag_fini(child);
+    type_tag_fini(parent);
+
+    free(child);
+    free(parent);
+}
+END_TEST
+
+/* Static hooks answering for a type they don't list. */
+static unsigned int
+unlisted_has_a(
+        struct type_tag *tag,
+        const char *type)
+{
+    return type == number;
+}
+
+static int
+unlisted_for_each(
+        struct type_tag *tag,
+        void *self,
+        int (*action)(void *self, struct type_tag_impl *tti))
+{
+    return 0;
+}
+
+/* Static hooks listing the only type they answer for. */
+static size_t listed_asked = 0;
+
+static unsigned int
+listed_has_a(
+        struct type_tag *tag,
+        const char *type)
+{
+    listed_asked++;
+    return type == number;
+}
+
+static void
+listed_acquire(
+        struct type_tag_impl *tti)
+{
+    tti->impl = (void *)number;
+}
+
+static int
+listed_for_each(
+        struct type_tag *tag,
+        void *self,
+        int (*action)(void *self, struct type_tag_impl *tti))
+{
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = number,
+        .impl = NULL,
+    };
+
+    return action(self, &tti);
+}
+
+START_TEST(tag_bloom)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    type_stats_enable(1);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    /* Misses are either rejected or counted as false positives. */
+    fail_unless(type_tag_has_a(tag, integer));
+    fail_unless(!type_tag_has_a(tag, number));
+    fail_unless(!type_tag_has_a(tag, natural));
+
+    struct type_bloom_stats stats;
+    type_tag_bloom_stats(tag, &stats);
+    fail_unless(stats.probes == 3);
+    fail_unless(stats.negatives + stats.false_positives == 2);
+
+    /* Acquisitions check it too. */
+    struct integer *impl = NULL;
+    type_tag_with (tag, integer, impl) {
+        type_tag_bloom_stats(tag, &stats);
+        fail_unless(stats.probes == 4);
+    }
+
+    /* Detached types are never reported. */
+    type_tag_detach(&tti);
+    fail_unless(!type_tag_has_a(tag, integer));
+
+    type_tag_fini(tag);
+
+    /* Static types are found even if the hooks don't list them. */
+    struct type_tag_static_i hooks = {
+        .has_a = unlisted_has_a,
+        .for_each = unlisted_for_each,
+    };
+    type_tag_init(tag, &hooks);
+    type_tag_attach(&tti, NULL);
+
+    fail_unless(type_tag_has_a(tag, number));
+    fail_unless(type_tag_is_static(tag, number));
+    fail_unless(!type_tag_is_static(tag, integer));
+    fail_unless(!type_tag_has_a(tag, natural));
+
+    type_tag_detach(&tti);
+    type_tag_fini(tag);
+
+    /* Listed static types are in the filter, so the hooks are rarely asked
+     * about other types.
+     */
+    struct type_tag_static_i listed = {
+        .has_a = listed_has_a,
+        .acquire = listed_acquire,
+        .for_each = listed_for_each,
+    };
+    type_tag_init(tag, &listed);
+    type_tag_bloom_statics(tag);
+    type_tag_attach(&tti, NULL);
+
+    fail_unless(type_tag_has_a(tag, number));
+    fail_unless(type_tag_has_a(tag, integer));
+
+    struct type_tag_impl acq = {
+        .tag = tag,
+        .type = number,
+        .impl = NULL,
+    };
+    type_tag_acquire(&acq);
+    fail_unless(acq.impl == number);
+
+    char unlisted[64];
+    listed_asked = 0;
+
+    for (size_t i = 0; i < sizeof(unlisted); i++) {
+        fail_unless(!type_tag_has_a(tag, &unlisted[i]));
+    }
+
+    fail_unless(listed_asked < sizeof(unlisted) / 2);
+
+    type_stats_enable(0);
+
+    type_tag_detach(&tti);
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+START_TEST(tag_detach_all)
+{
+    struct type_tag *src = ecx_malloc(type_tag_size());
+    struct type_tag *dst = ecx_malloc(type_tag_size());
+
+    type_tag_init(src, NULL);
+    type_tag_init(dst, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    const char *types[] = {integer, number, natural};
+
+    detached = 0;
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        struct type_tag_impl tti = {
+            .tag = src,
+            .type = types[i],
+            .impl = &int_impl,
+        };
+        type_tag_attach(&tti, count_detach);
+    }
+
+    /* Shared entries are detached once the last sharer lets go. */
+    type_tag_clone(src, dst);
+
+    type_tag_detach_all(src);
+    fail_unless(type_tag_attachments(src) == 0);
+    fail_unless(detached == 0);
+
+    type_tag_detach_all(dst);
+    fail_unless(type_tag_attachments(dst) == 0);
+    fail_unless(detached == 3);
+
+    type_tag_fini(dst);
+    type_tag_fini(src);
+
+    free(dst);
+    free(src);
+}
+END_TEST
+
+static int
+count_impl(void *self, struct type_tag_impl *tti)
+{
+    __atomic_add_fetch((int *)self, ((struct integer *)tti->impl)->i, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Stops at every type from self on, returning its distance from self plus one.
+ * The first one is slow to stop, so the others stop before it.
+ */
+static int
+stop_from(void *self, struct type_tag_impl *tti)
+{
+    if (tti->type < (const char *)self) return 0;
+
+    if (tti->type == self) {
+        usleep(1000);
+    }
+
+    return (int)(tti->type - (const char *)self) + 1;
+}
+
+START_TEST(tag_for_each_parallel)
+{
+    struct type_tag *src = ecx_malloc(type_tag_size());
+    struct type_tag *dst = ecx_malloc(type_tag_size());
+
+    type_tag_init(src, NULL);
+    type_tag_init(dst, NULL);
+
+    char types[64];
+    struct integer impls[64];
+
+    for (size_t i = 0; i < 64; i++) {
+        impls[i].i = 1;
+
+        struct type_tag_impl tti = {
+            .tag = src,
+            .type = &types[i],
+            .impl = &impls[i],
+        };
+        type_tag_attach(&tti, NULL);
+    }
+
+    int sum = 0;
+    fail_unless(type_tag_for_each_parallel(src, 4, &sum, count_impl) == 0);
+    fail_unless(sum == 64);
+
+    /* The first type stopping (in key order) decides the result. */
+    for (size_t i = 0; i < 50; i++) {
+        fail_unless(type_tag_for_each_parallel(src, 4, &types[16], stop_from) == 1);
+    }
+
+    /* Shared entries too. */
+    type_tag_clone(src, dst);
+
+    sum = 0;
+    fail_unless(type_tag_for_each_parallel(dst, 4, &sum, count_impl) == 0);
+    fail_unless(sum == 64);
+
+    type_tag_detach_all(dst);
+    type_tag_detach_all(src);
+
+    type_tag_fini(dst);
+    type_tag_fini(src);
+
+    free(dst);
+    free(src);
+}
+END_TEST
+
+START_TEST(tag_stats)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    type_stats_reset();
+    type_stats_enable(1);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    fail_unless(type_tag_has_a(tag, integer));
+    fail_unless(!type_tag_has_a(tag, number));
+
+    type_tag_acquire(&tti);
+    type_tag_release(&tti);
+
+    type_tag_detach(&tti);
+
+    type_stats_enable(0);
+
+    /* Not counted while disabled. */
+    fail_unless(!type_tag_has_a(tag, integer));
+
+    struct type_stats stats;
+    type_tag_stats(tag, &stats);
+    fail_unless(stats.attaches == 1);
+    fail_unless(stats.detaches == 1);
+    fail_unless(stats.acquires == 1);
+    fail_unless(stats.releases == 1);
+    fail_unless(stats.hits == 1);
+    fail_unless(stats.misses == 1);
+    fail_unless(stats.dynamics == 1);
+    fail_unless(stats.statics == 0);
+
+    type_stats_get(&stats);
+    fail_unless(stats.attaches == 1);
+    fail_unless(stats.acquires == 1);
+    fail_unless(stats.misses == 1);
+    fail_unless(stats.exceptions == 0);
+    fail_unless(type_stats_exceptions(TYPE_TAG_NOT_ATTACHED) == 0);
+
+    type_stats_reset();
+    type_stats_get(&stats);
+    fail_unless(stats.attaches == 0);
+
+    /* Tag counts are reset separately. */
+    type_tag_stats(tag, &stats);
+    fail_unless(stats.attaches == 1);
+
+    type_tag_stats_reset(tag);
+    type_tag_stats(tag, &stats);
+    fail_unless(stats.attaches == 0);
+    fail_unless(stats.acquires == 0);
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+static int
+count_hold(
+        void *self,
+        struct type_profile_hold *hold)
+{
+    struct type_profile_hold *found = self;
+    *found = *hold;
+
+    return 0;
+}
+
+START_TEST(tag_profile)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    type_profile_enable();
+
+    struct integer *impl = NULL;
+    struct type_profile_hold hold = {
+        .key = NULL,
+    };
+
+    type_tag_with(tag, integer, impl) {
+        /* The call site is recorded. */
+        fail_unless(type_profile_for_each(&hold, count_hold) == 0);
+        fail_unless(hold.key == tag);
+        fail_unless(hold.type == integer);
+        fail_unless(hold.file != NULL && strcmp(hold.file, __FILE__) == 0);
+    }
+
+    /* Released holds are counted in the histogram. */
+    hold.key = NULL;
+    type_profile_for_each(&hold, count_hold);
+    fail_unless(hold.key == NULL);
+
+    struct type_profile_histogram histogram;
+    type_profile_histogram(integer, &histogram);
+    fail_unless(histogram.count == 1);
+
+    size_t total = 0;
+    for (size_t i = 0; i < TYPE_PROFILE_BUCKETS; i++) {
+        total += histogram.buckets[i];
+    }
+    fail_unless(total == 1);
+
+    type_profile_disable();
+
+    type_profile_histogram(integer, &histogram);
+    fail_unless(histogram.count == 0);
+
+    type_tag_detach(&tti);
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+START_TEST(tag_scope)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    struct integer *impl = NULL;
+
+    type_tag_scope(tag, integer, impl) {
+        fail_unless(type_tag_acquisitions(&tti) == 1);
+        impl->i++;
+    }
+    fail_unless(type_tag_acquisitions(&tti) == 0);
+
+    /* Released when leaving early too. */
+    for (int i = 0; i < 2; i++) {
+        type_tag_scope(tag, integer, impl) {
+            impl->i++;
+            break;
+        }
+    }
+    fail_unless(type_tag_acquisitions(&tti) == 0);
+    fail_unless(int_impl.i == 3);
+
+    type_tag_detach(&tti);
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+START_TEST(tag_inline)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    struct type_tag_impl received = {
+        .tag = tag,
+        .type = integer,
+        .impl = NULL,
+    };
+
+    size_t used = type_tag_memory_usage(tag, NULL);
+
+    /* The first acquire goes through the library (caching the type). */
+    for (int i = 0; i < 2; i++) {
+        type_tag_acquire_inline(&received);
+        fail_unless(received.impl == &int_impl);
+        fail_unless(type_tag_acquisitions(&tti) == 1);
+
+        type_tag_release_inline(&received);
+        fail_unless(received.impl == NULL);
+        fail_unless(type_tag_acquisitions(&tti) == 0);
+    }
+
+    /* Nested acquisitions are counted inline and the last release (through
+     * the library) drops the record again.
+     */
+    for (int i = 0; i < 3; i++) {
+        type_tag_acquire_inline(&received);
+    }
+    fail_unless(type_tag_acquisitions(&tti) == 3);
+
+    type_tag_acquire_inline(&received);
+    type_tag_release_inline(&received);
+
+    for (int i = 0; i < 3; i++) {
+        type_tag_release_inline(&received);
+    }
+    fail_unless(type_tag_acquisitions(&tti) == 0);
+    fail_unless(type_tag_memory_usage(tag, NULL) == used);
+
+    /* Mixed with the library. */
+    type_tag_acquire_inline(&received);
+    type_tag_release(&received);
+    fail_unless(type_tag_acquisitions(&tti) == 0);
+
+    /* Changes clear the cache. */
+    type_tag_detach(&tti);
+
+    struct integer other_impl = {
+        .i = 1,
+    };
+    tti.impl = &other_impl;
+    type_tag_attach(&tti, NULL);
+
+    type_tag_acquire_inline(&received);
+    fail_unless(received.impl == &other_impl);
+    type_tag_release_inline(&received);
+
+    type_tag_detach(&tti);
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+START_TEST(tag_immortal)
+{
+    struct type_tag *src = ecx_malloc(type_tag_size());
+    struct type_tag *dst = ecx_malloc(type_tag_size());
+
+    type_tag_init(src, NULL);
+    type_tag_init(dst, NULL);
+
+    static struct integer int_impl = {
+        .i = 0,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = src,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach_immortal(&tti);
+
+    struct integer *impl = NULL;
+
+    type_tag_with(src, integer, impl) {
+        fail_unless(impl == &int_impl);
+
+        /* Not counted. */
+        fail_unless(type_tag_acquisitions(&tti) == 0);
+    }
+
+    /* Releasing without the flags still works. */
+    struct type_tag_impl received = {
+        .tag = src,
+        .type = integer,
+        .impl = NULL,
+    };
+    type_tag_acquire(&received);
+    fail_unless(received.flags & TYPE_TAG_IMPL_IMMORTAL);
+
+    received.flags = 0;
+    type_tag_release(&received);
+
+    /* Clones share it. */
+    type_tag_clone(src, dst);
+
+    type_tag_with(dst, integer, impl) {
+        fail_unless(impl == &int_impl);
+    }
+
+    /* Detached by fini. */
+    type_tag_fini(dst);
+    type_tag_fini(src);
+
+    free(dst);
+    free(src);
+}
+END_TEST
+
+START_TEST(tag_optimistic)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct integer int_impl = {
+        .i = 1,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    type_tag_optimistic_enable(tag);
+
+    struct integer *impl = NULL;
+    int i = 0;
+
+    type_tag_optimistic(tag, integer, impl) {
+        i = impl->i;
+    }
+    fail_unless(i == 1);
+
+    /* Reads aren't counted. */
+    fail_unless(type_tag_acquisitions(&tti) == 0);
+
+    type_tag_optimistic(tag, number, impl) {
+        fail_unless(impl == NULL);
+    }
+
+    /* Reads left early don't keep replaced copies. */
+    struct type_memory_usage before = {0, 0, 0, 0};
+    type_tag_memory_usage(tag, &before);
+
+    for (int j = 0; j < 4; j++) {
+        type_tag_optimistic(tag, integer, impl) {
+            if (impl != NULL) break;
+        }
+    }
+
+    tti.type = number;
+    type_tag_attach(&tti, NULL);
+    type_tag_detach(&tti);
+    tti.type = integer;
+
+    struct type_memory_usage after = {0, 0, 0, 0};
+    type_tag_memory_usage(tag, &after);
+    fail_unless(after.records == before.records);
+
+    /* Changes are seen (and make readers retry). */
+    size_t sequence = type_tag_optimistic_begin(tag);
+    fail_unless(!type_tag_optimistic_retry(tag, sequence));
+
+    type_tag_detach(&tti);
+    fail_unless(type_tag_optimistic_retry(tag, sequence));
+
+    type_tag_optimistic(tag, integer, impl) {
+        fail_unless(impl == NULL);
+    }
+
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+/* Attaches and detaches a type over and over (see tag_optimistic_threads). */
+static void *
+optimistic_writer(
+        void *tag)
+{
+    static struct integer num_impl = {
+        .i = 2,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = number,
+        .impl = &num_impl,
+    };
+
+    for (size_t i = 0; i < 10000; i++) {
+        type_tag_attach(&tti, NULL);
+        type_tag_detach(&tti);
+    }
+
+    return NULL;
+}
+
+START_TEST(tag_optimistic_threads)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    struct integer int_impl = {
+        .i = 1,
+    };
+
+    struct type_tag_impl tti = {
+        .tag = tag,
+        .type = integer,
+        .impl = &int_impl,
+    };
+    type_tag_attach(&tti, NULL);
+
+    type_tag_optimistic_enable(tag);
+
+    /* Without readers, replaced copies are freed right away. */
+    tti.type = number;
+    type_tag_attach(&tti, NULL);
+    type_tag_detach(&tti);
+    tti.type = integer;
+
+    struct type_memory_usage before = {0, 0, 0, 0};
+    type_tag_memory_usage(tag, &before);
+
+    pthread_t writer;
+    fail_unless(pthread_create(&writer, NULL, optimistic_writer, tag) == 0);
+
+    /* Reads see the type throughout. */
+    for (size_t i = 0; i < 100000; i++) {
+        struct integer *impl = NULL;
+        int found = 0;
+
+        type_tag_optimistic(tag, integer, impl) {
+            found = impl != NULL ? impl->i : 0;
+        }
+        fail_unless(found == 1);
+    }
+
+    pthread_join(writer, NULL);
+
+    /* Copies retired while reading are freed by the next change. */
+    tti.type = number;
+    type_tag_attach(&tti, NULL);
+    type_tag_detach(&tti);
+    tti.type = integer;
+
+    struct type_memory_usage after = {0, 0, 0, 0};
+    type_tag_memory_usage(tag, &after);
+    fail_unless(after.records == before.records);
+
+    type_tag_detach(&tti);
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+START_TEST(tag_freeze)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    type_tag_init(tag, NULL);
+
+    char types[64];
+    struct integer impls[64];
+
+    for (size_t i = 0; i < 64; i++) {
+        impls[i].i = i;
+
+        struct type_tag_impl tti = {
+            .tag = tag,
+            .type = &types[i],
+            .impl = &impls[i],
+        };
+        type_tag_attach(&tti, NULL);
+    }
+
+    type_tag_freeze(tag);
+
+    for (size_t i = 0; i < 64; i++) {
+        struct integer *impl = NULL;
+
+        fail_unless(type_tag_has_a(tag, &types[i]));
+
+        type_tag_with(tag, &types[i], impl) {
+            fail_unless(impl == &impls[i]);
+        }
+    }
+
+    fail_unless(!type_tag_has_a(tag, integer));
+    fail_unless(type_tag_attachments(tag) == 64);
+
+    /* Detached by fini. */
+    type_tag_fini(tag);
+    free(tag);
+}
+END_TEST
+
+/* Chains of subtypes declared by the threads of tag_subtype_threads. */
+static const char subtype_root[] = "root";
+static char subtype_chains[4][16];
+
+static void *
+subtype_declarer(
+        void *arg)
+{
+    char *chain = arg;
+
+    type_subtype(&chain[0], subtype_root);
+
+    for (size_t i = 1; i < 16; i++) {
+        type_subtype(&chain[i], &chain[i - 1]);
+
+        /* Query the other chains while they're being declared. */
+        for (size_t j = 0; j < 4; j++) {
+            (void)type_is_a(&subtype_chains[j][i], subtype_root);
+        }
+
+        fail_unless(type_is_a(&chain[i], subtype_root));
+    }
+
+    return NULL;
+}
+
+START_TEST(tag_subtype_threads)
+{
+    pthread_t declarers[4];
+
+    for (size_t i = 0; i < 4; i++) {
+        fail_unless(pthread_create(
+                    &declarers[i], NULL, subtype_declarer,
+                    subtype_chains[i]) == 0);
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        pthread_join(declarers[i], NULL);
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        fail_unless(type_is_a(&subtype_chains[i][15], subtype_root));
+        fail_unless(!type_is_a(&subtype_chains[i][15], &subtype_chains[(i + 1) % 4][0]));
+    }
+}
+END_TEST
+
+/* Frozen tag shared by the threads of tag_freeze_threads. */
+struct frozen_shared {
+    struct type_tag *tag;
+    char types[64];
+    struct integer impls[64];
+};
+
+/* Reads the frozen tag directly and as the parent of a private tag. */
+static void *
+frozen_reader(
+        void *arg)
+{
+    struct frozen_shared *shared = arg;
+
+    struct type_tag *child = ecx_malloc(type_tag_size());
+    type_tag_init(child, NULL);
+
+    for (size_t round = 0; round < 100; round++) {
+        type_tag_set_parent(child, shared->tag);
+
+        struct type_mask mask;
+        type_mask_init(&mask);
+        type_mask_add(&mask, &shared->types[round % 64]);
+
+        fail_unless(type_tag_has_all(shared->tag, &mask));
+        fail_unless(type_tag_has_all(child, &mask));
+        fail_unless(!type_tag_is_static(shared->tag, &shared->types[0]));
+
+        for (size_t i = 0; i < 64; i++) {
+            struct integer *impl = NULL;
+
+            fail_unless(type_tag_has_a(shared->tag, &shared->types[i]));
+
+            type_tag_with(shared->tag, &shared->types[i], impl) {
+                fail_unless(impl == &shared->impls[i]);
+            }
+
+            type_tag_with(child, &shared->types[i], impl) {
+                fail_unless(impl == &shared->impls[i]);
+            }
+        }
+
+        type_tag_set_parent(child, NULL);
+    }
+
+    type_tag_fini(child);
+    free(child);
+
+    return NULL;
+}
+
+START_TEST(tag_freeze_threads)
+{
+    struct frozen_shared *shared = ecx_malloc(sizeof(struct frozen_shared));
+    shared->tag = ecx_malloc(type_tag_size());
+    type_tag_init(shared->tag, NULL);
+
+    for (size_t i = 0; i < 64; i++) {
+        shared->impls[i].i = i;
+
+        struct type_tag_impl tti = {
+            .tag = shared->tag,
+            .type = &shared->types[i],
+            .impl = &shared->impls[i],
+        };
+        type_tag_attach(&tti, NULL);
+    }
+
+    type_tag_freeze(shared->tag);
+
+    /* Stats are only counted per thread, not on the shared tag. */
+    type_stats_reset();
+    type_stats_enable(1);
+
+    pthread_t readers[4];
+
+    for (size_t i = 0; i < 4; i++) {
+        fail_unless(pthread_create(
+                    &readers[i], NULL, frozen_reader, shared) == 0);
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    type_stats_enable(0);
+
+    struct type_stats stats;
+    type_tag_stats(shared->tag, &stats);
+    fail_unless(stats.acquires == 0);
+    fail_unless(stats.hits == 0);
+
+    type_stats_get(&stats);
+    fail_unless(stats.acquires >= 4 * 100 * 64 * 2);
+
+    /* Every child let go of it. */
+    type_tag_fini(shared->tag);
+    free(shared->tag);
+    free(shared);
+}
+END_TEST
+
+/* Immutable tags can't get a parent (the uncaught exception aborts). */
+START_TEST(tag_freeze_parent)
+{
+    struct type_tag *tag = ecx_malloc(type_tag_size());
+    struct type_tag *parent = ecx_malloc(type_tag_size());
+
+    type_tag_init(tag, NULL);
+    type_tag_init(parent, NULL);
+
+    type_tag_freeze(tag);
+    type_tag_set_parent(tag, parent);
+}
+END_TEST
+
 Suite *
 tag_suite(void)
 {
@@ -80,6 +1523,28 @@ tag_suite(void)
 
     TCase *tc_tt = tcase_create("Type Tag");
     tcase_add_test(tc_tt, tag_basic);
+    tcase_add_test(tc_tt, tag_memory_usage);
+    tcase_add_test(tc_tt, tag_clone);
+    tcase_add_test(tc_tt, tag_clone_detach);
+    tcase_add_test(tc_tt, tag_parent);
+    tcase_add_test(tc_tt, tag_subtype);
+    tcase_add_test(tc_tt, tag_lazy);
+    tcase_add_test(tc_tt, tag_cursor);
+    tcase_add_test(tc_tt, tag_mask);
+    tcase_add_test(tc_tt, tag_bloom);
+    tcase_add_test(tc_tt, tag_detach_all);
+    tcase_add_test(tc_tt, tag_for_each_parallel);
+    tcase_add_test(tc_tt, tag_stats);
+    tcase_add_test(tc_tt, tag_profile);
+    tcase_add_test(tc_tt, tag_scope);
+    tcase_add_test(tc_tt, tag_inline);
+    tcase_add_test(tc_tt, tag_immortal);
+    tcase_add_test(tc_tt, tag_optimistic);
+    tcase_add_test(tc_tt, tag_optimistic_threads);
+    tcase_add_test(tc_tt, tag_freeze);
+    tcase_add_test(tc_tt, tag_freeze_threads);
+    tcase_add_test(tc_tt, tag_subtype_threads);
+    tcase_add_test_raise_signal(tc_tt, tag_freeze_parent, SIGABRT);
     suite_add_tcase(s, tc_tt);
 
     return s;